@@ -0,0 +1,347 @@
+/*
+ * fjbench.c		fork/join scheduling benchmark for qlib
+ *
+ * Runs a fork/join computation of small tasks on 1,2,4..N worker
+ * threads and reports tasks per second and the speedup over one
+ * worker, for each way of handing out the tasks:
+ *	* steal: a work-stealing deque per worker (create_deque());
+ *	  a worker pushes and pops its own deque and steals from a
+ *	  random other one when that is empty
+ *	* shared: one FIFO queue every worker puts on and takes off,
+ *	  behind a mutex (the library is otherwise not thread safe),
+ *	  standing for a single shared MPMC queue
+ *
+ * A task is just its depth: running a task of depth d > 0 forks
+ * a task of depth d-1 and goes on with the other half itself,
+ * work-first; a task of depth 0 does a little arithmetic (the -w
+ * option says how much). So a run of depth D is 2^D leaves and
+ * 2^(D+1)-1 tasks. A fork that finds its queue full runs the task
+ * on the spot instead.
+ *
+ * Usage: fjbench [-t maxthreads] [-D depth] [-w work] [-v variant]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "../qlib.h"
+
+#define MAXTHR		64	/* most workers */
+
+/*
+ * a way of handing out tasks
+ * setup() makes room for nthr workers and depth-d runs, put()
+ * forks a task from worker me, get() finds worker me a task
+ * (returning a qlib error code, the task through *n), teardown()
+ * destroys everything setup() made
+ */
+struct variant {
+	const char *name;		/* name used on output and -v */
+	int (*setup)(int nthr, int d);	/* build the queues */
+	int (*put)(int me, int n);	/* fork task n */
+	int (*get)(int me, int *n);	/* find a task */
+	void (*teardown)(void);		/* destroy the queues */
+};
+
+/*
+ * per-worker state; padded so counters of different threads
+ * never share a cache line
+ */
+struct worker {
+	pthread_t tid;			/* thread id */
+	int me;				/* worker number */
+	unsigned int rng;		/* xorshift state, for victims */
+	_Atomic long done;		/* tasks run */
+	unsigned int sink;		/* what the leaves computed */
+	char pad[64];
+};
+
+static struct worker wk[MAXTHR];	/* the workers */
+static int nwk;				/* how many in this run */
+
+static unsigned int rnd(unsigned int *x)
+{
+	*x ^= *x << 13;
+	*x ^= *x >> 17;
+	*x ^= *x << 5;
+	return(*x);
+}
+
+/********** steal: a Chase-Lev deque per worker ************/
+static QTICKET dq[MAXTHR];
+
+static int st_setup(int nthr, int d)
+{
+	int i, rv;
+
+	for(i = 0; i < nthr; i++){
+		/* work-first, a deque holds about one task per level */
+		if (QE_ISERROR(rv = create_deque(4 * d + 64))){
+			fprintf(stderr, "fjbench: %s\n", qe_errbuf);
+			return(rv);
+		}
+		dq[i] = rv;
+	}
+	return(QE_NONE);
+}
+
+static int st_put(int me, int n)
+{
+	return(deque_push(dq[me], n));
+}
+
+/* own deque first, newest task; then one round of the others */
+static int st_get(int me, int *n)
+{
+	int i, v, rv;
+
+	if (!QE_ISERROR(rv = deque_pop(dq[me]))){
+		*n = rv;
+		return(QE_NONE);
+	}
+	v = rnd(&wk[me].rng) % nwk;
+	for(i = 0; i < nwk; i++, v = (v + 1) % nwk)
+		if (v != me && !QE_ISERROR(rv = deque_steal(dq[v]))){
+			*n = rv;
+			return(QE_NONE);
+		}
+	return(QE_EMPTY);
+}
+
+static void st_teardown(void)
+{
+	int i;
+
+	for(i = 0; i < nwk; i++)
+		(void) delete_queue(dq[i]);
+}
+
+/********** shared: one FIFO behind a mutex ************/
+static pthread_mutex_t sh_lock = PTHREAD_MUTEX_INITIALIZER;
+static QTICKET sh_q;
+
+static int sh_setup(int nthr, int d)
+{
+	int rv;
+
+	(void) nthr;
+	/* breadth first, a whole level may be queued at once */
+	if (QE_ISERROR(rv = create_queue(1 << (d + 1)))){
+		fprintf(stderr, "fjbench: %s\n", qe_errbuf);
+		return(rv);
+	}
+	sh_q = rv;
+	return(QE_NONE);
+}
+
+static int sh_put(int me, int n)
+{
+	int rv;
+
+	(void) me;
+	pthread_mutex_lock(&sh_lock);
+	rv = put_on_queue(sh_q, n);
+	pthread_mutex_unlock(&sh_lock);
+	return(rv);
+}
+
+static int sh_get(int me, int *n)
+{
+	int rv;
+
+	(void) me;
+	pthread_mutex_lock(&sh_lock);
+	rv = take_off_queue(sh_q);
+	pthread_mutex_unlock(&sh_lock);
+	if (QE_ISERROR(rv))
+		return(rv);
+	*n = rv;
+	return(QE_NONE);
+}
+
+static void sh_teardown(void)
+{
+	(void) delete_queue(sh_q);
+}
+
+static struct variant variants[] = {
+	{ "steal", st_setup, st_put, st_get, st_teardown },
+	{ "shared", sh_setup, sh_put, sh_get, sh_teardown },
+};
+#define NVARIANTS	((int)(sizeof(variants)/sizeof(variants[0])))
+
+/********** the driver ************/
+static struct variant *cur;		/* variant being measured */
+static long total;			/* tasks in a run */
+static int work = 64;			/* arithmetic per leaf */
+static volatile int started;		/* set to start the run */
+static int ncpu;			/* CPUs we may run on */
+static int cpus[1024];			/* ... and which ones */
+
+static unsigned long long nsnow(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return((unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static void pin(int cpu)
+{
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	(void) pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+/* run a task: fork one half, go on with the other */
+static void run(struct worker *w, int d)
+{
+	unsigned int x = d + 1;
+	int i;
+
+	for(; d > 0; d--){
+		if (QE_ISERROR(cur->put(w->me, d - 1)))
+			run(w, d - 1);
+		atomic_fetch_add_explicit(&w->done, 1, memory_order_relaxed);
+	}
+	for(i = 0; i < work; i++)
+		w->sink += rnd(&x);
+	atomic_fetch_add_explicit(&w->done, 1, memory_order_relaxed);
+}
+
+/* all tasks run? */
+static int finished(void)
+{
+	long n = 0;
+	int i;
+
+	for(i = 0; i < nwk; i++)
+		n += atomic_load_explicit(&wk[i].done, memory_order_relaxed);
+	return(n >= total);
+}
+
+static void *worker(void *arg)
+{
+	struct worker *w = arg;
+	int n, miss = 0;
+
+	pin(cpus[w->me % ncpu]);
+	while(!started)
+		;
+	for(;;){
+		if (!QE_ISERROR(cur->get(w->me, &n))){
+			run(w, n);
+			miss = 0;
+			continue;
+		}
+		if (++miss % 16 == 0){
+			if (finished())
+				break;
+			sched_yield();
+		}
+	}
+	return(NULL);
+}
+
+static double runs(int nthr, int depth)
+{
+	unsigned long long t0, t1;
+	int i;
+
+	if (QE_ISERROR(cur->setup(nthr, depth)))
+		return(-1);
+	nwk = nthr;
+	total = (2L << depth) - 1;
+	started = 0;
+	for(i = 0; i < nthr; i++){
+		memset(&wk[i], 0, sizeof(wk[i]));
+		wk[i].me = i;
+		wk[i].rng = 2463534242U + i;
+	}
+	/* the root goes to worker 0 */
+	if (QE_ISERROR(cur->put(0, depth))){
+		fprintf(stderr, "fjbench: %s\n", qe_errbuf);
+		return(-1);
+	}
+	for(i = 0; i < nthr; i++)
+		pthread_create(&wk[i].tid, NULL, worker, &wk[i]);
+	t0 = nsnow();
+	started = 1;
+	for(i = 0; i < nthr; i++)
+		pthread_join(wk[i].tid, NULL);
+	t1 = nsnow();
+	cur->teardown();
+	return(total / ((t1 - t0) / 1e9));
+}
+
+/* thread counts double up to, and always include, the maximum */
+static int nextthr(int n, int max)
+{
+	if (n == max)
+		return(max + 1);
+	return(2 * n > max ? max : 2 * n);
+}
+
+int main(int argc, char **argv)
+{
+	const char *only = NULL;
+	int maxthr = 0, depth = 20;
+	int v, n, c;
+	double r, r1;
+	cpu_set_t set;
+
+	while((c = getopt(argc, argv, "t:D:w:v:")) != -1)
+		switch(c){
+		case 't':	maxthr = atoi(optarg);	break;
+		case 'D':	depth = atoi(optarg);	break;
+		case 'w':	work = atoi(optarg);	break;
+		case 'v':	only = optarg;		break;
+		default:
+			fprintf(stderr,
+			    "usage: fjbench [-t maxthreads] [-D depth] [-w work] [-v variant]\n");
+			return(1);
+		}
+	if (depth < 1 || depth > 26){
+		fprintf(stderr, "fjbench: depth must be 1 .. 26\n");
+		return(1);
+	}
+
+	/* find the CPUs we may use; threads are pinned round robin */
+	CPU_ZERO(&set);
+	(void) sched_getaffinity(0, sizeof(set), &set);
+	for(c = 0; c < CPU_SETSIZE && ncpu < 1024; c++)
+		if (CPU_ISSET(c, &set))
+			cpus[ncpu++] = c;
+	if (ncpu == 0)
+		cpus[ncpu++] = 0;
+	if (maxthr <= 0)
+		maxthr = ncpu;
+	if (maxthr > MAXTHR)
+		maxthr = MAXTHR;
+
+	printf("# %d cpus, depth %d (%ld tasks), work %d per leaf\n",
+				ncpu, depth, (2L << depth) - 1, work);
+	printf("%-8s %3s %12s %8s\n", "variant", "T", "tasks/s", "speedup");
+	for(v = 0; v < NVARIANTS; v++){
+		if (only != NULL && strcmp(only, variants[v].name) != 0)
+			continue;
+		cur = &variants[v];
+		r1 = 0;
+		for(n = 1; n <= maxthr; n = nextthr(n, maxthr)){
+			if ((r = runs(n, depth)) < 0)
+				return(1);
+			if (n == 1)
+				r1 = r;
+			printf("%-8s %3d %12.0f %8.2f\n", cur->name, n, r, r / r1);
+			fflush(stdout);
+		}
+	}
+	return(0);
+}
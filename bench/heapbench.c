@@ -0,0 +1,94 @@
+/*
+ * heapbench.c		priority queue benchmark
+ *
+ * Measures priority queues (create_prio_queue()) of each arity
+ * from 2 (a binary heap, the baseline) to 8, at a range of sizes.
+ * Each run fills the queue to half its capacity with random
+ * priorities and then does the "hold" operation (a take followed
+ * by a put of a priority a random amount above the one taken, as
+ * an event simulation does) for a fixed time, reporting
+ * nanoseconds per take/put pair.
+ *
+ * Usage: heapbench [-d millisecs]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "../qlib.h"
+
+static unsigned long long nsnow(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return((unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+/* xorshift; rand() would cost more than some of the heaps */
+static unsigned int rnd(void)
+{
+	static unsigned int x = 2463534242U;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return(x);
+}
+
+int main(int argc, char **argv)
+{
+	static const int sizes[] = { 1024, 65536, 1048576, 8388608 };
+	static const int arities[] = { 2, 3, 4, 8 };
+	unsigned long long t0, t1, end;
+	long n;
+	int i, j, k, c, p, rv, msec = 500;
+	QTICKET t;
+
+	while((c = getopt(argc, argv, "d:")) != -1)
+		switch(c){
+		case 'd':	msec = atoi(optarg);	break;
+		default:
+			fprintf(stderr, "usage: heapbench [-d msec]\n");
+			return(1);
+		}
+
+	printf("# %d ms per point; hold = take then put\n", msec);
+	printf("%8s %6s %12s %10s\n", "size", "arity", "holds/s", "ns/hold");
+	for(i = 0; i < (int)(sizeof(sizes)/sizeof(sizes[0])); i++)
+		for(j = 0; j < (int)(sizeof(arities)/sizeof(arities[0])); j++){
+			/* a QTICKET is unsigned: test before storing it */
+			if (QE_ISERROR(rv = create_prio_queue(sizes[i], arities[j]))){
+				fprintf(stderr, "heapbench: %s\n", qe_errbuf);
+				return(1);
+			}
+			t = rv;
+			for(k = 0; k < sizes[i] / 2; k++){
+				p = (int) (rnd() & 0xfffff);
+				(void) put_on_prio_queue(t, p, p);
+			}
+
+			/*
+			 * the element is its own priority, so a take tells
+			 * us what to put back
+			 */
+			t0 = nsnow();
+			end = t0 + msec * 1000000ULL;
+			for(n = 0; (n & 1023) != 0 || nsnow() < end; n++){
+				if (QE_ISERROR(p = take_off_queue(t))){
+					fprintf(stderr, "heapbench: %s\n", qe_errbuf);
+					return(1);
+				}
+				k = p + (int) (rnd() & 0xfff);
+				(void) put_on_prio_queue(t, k, k);
+			}
+			t1 = nsnow();
+			(void) delete_queue(t);
+
+			printf("%8d %6d %12.0f %10.1f\n", sizes[i], arities[j],
+				n / ((t1 - t0) / 1e9), (double) (t1 - t0) / n);
+			fflush(stdout);
+		}
+	return(0);
+}
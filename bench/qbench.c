@@ -0,0 +1,392 @@
+/*
+ * qbench.c		multi-threaded contention benchmark for qlib
+ *
+ * Runs P producer and C consumer threads against a set of queues
+ * for a fixed amount of wall-clock time and reports, for every
+ * queue variant and every point of the sweep:
+ *	* throughput (elements moved end to end per second)
+ *	* per-call latency percentiles (sampled put/take calls)
+ *	* fairness (Jain's index over per-thread operation counts;
+ *	  1.0 means every thread got the same share)
+ *
+ * The sweep covers 1,2,4..N producers x 1,2,4..N consumers, a
+ * list of queue counts and a list of capacities. Threads are pinned
+ * round-robin onto the CPUs available to the process.
+ *
+ * Variants are kept in a table (see variants[] below) so other
+ * queue kinds can be measured against the same baseline; the
+ * baseline is the plain create_queue/put_on_queue/take_off_queue
+ * API serialized behind one mutex, since the library itself is
+ * not thread safe. The shard variant uses sharded queues
+ * (create_shard_queue()) with a shard per CPU, which need no lock.
+ *
+ * Usage: qbench [-t maxthreads] [-d millisecs] [-v variant]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include "../qlib.h"
+
+#define MAXTHR		64	/* most threads of either role */
+#define NSAMPLE		4096	/* latency samples kept per thread */
+#define SAMPLEMASK	31	/* sample one call out of 32 */
+
+/*
+ * a queue variant under test
+ * setup() creates nq queues of capacity cap, put()/take() act
+ * on queue number qi (0 <= qi < nq) and return a qlib error code
+ * (take() returns the element through *n), teardown() destroys
+ * everything setup() made
+ */
+struct variant {
+	const char *name;		/* name used on output and -v */
+	int (*setup)(int nq, int cap);	/* build the queues */
+	int (*put)(int qi, int n);	/* append n to queue qi */
+	int (*take)(int qi, int *n);	/* remove head of queue qi */
+	void (*teardown)(void);		/* destroy the queues */
+};
+
+/********** baseline: the qlib API behind a single mutex ************/
+static pthread_mutex_t mtx_lock = PTHREAD_MUTEX_INITIALIZER;
+static QTICKET mtx_tkt[MAXTHR];		/* tickets of the queues */
+static int mtx_nq;			/* number of queues in use */
+
+static int mtx_setup(int nq, int cap)
+{
+	int i, rv;
+
+	/* a QTICKET is unsigned, so test the result before storing it */
+	for(i = 0; i < nq; i++){
+		if (QE_ISERROR(rv = create_queue(cap))){
+			fprintf(stderr, "qbench: %s\n", qe_errbuf);
+			return(rv);
+		}
+		mtx_tkt[i] = rv;
+	}
+	mtx_nq = nq;
+	return(QE_NONE);
+}
+
+static int mtx_put(int qi, int n)
+{
+	int rv;
+
+	pthread_mutex_lock(&mtx_lock);
+	rv = put_on_queue(mtx_tkt[qi], n);
+	pthread_mutex_unlock(&mtx_lock);
+	return(rv);
+}
+
+/* elements are always non-negative here, so errors are unambiguous */
+static int mtx_take(int qi, int *n)
+{
+	int rv;
+
+	pthread_mutex_lock(&mtx_lock);
+	rv = take_off_queue(mtx_tkt[qi]);
+	pthread_mutex_unlock(&mtx_lock);
+	if (QE_ISERROR(rv))
+		return(rv);
+	*n = rv;
+	return(QE_NONE);
+}
+
+static void mtx_teardown(void)
+{
+	int i;
+
+	for(i = 0; i < mtx_nq; i++)
+		(void) delete_queue(mtx_tkt[i]);
+	mtx_nq = 0;
+}
+
+/********** shard: sharded queues, a ring per CPU ************/
+static QTICKET sh_tkt[MAXTHR];		/* tickets of the queues */
+static int sh_nq;			/* number of queues in use */
+
+static int sh_setup(int nq, int cap)
+{
+	int i, rv;
+
+	for(i = 0; i < nq; i++){
+		if (QE_ISERROR(rv = create_shard_queue(cap, 0))){
+			fprintf(stderr, "qbench: %s\n", qe_errbuf);
+			return(rv);
+		}
+		sh_tkt[i] = rv;
+	}
+	sh_nq = nq;
+	return(QE_NONE);
+}
+
+static int sh_put(int qi, int n)
+{
+	return(shard_put(sh_tkt[qi], n));
+}
+
+static int sh_take(int qi, int *n)
+{
+	int rv;
+
+	if (QE_ISERROR(rv = shard_take(sh_tkt[qi])))
+		return(rv);
+	*n = rv;
+	return(QE_NONE);
+}
+
+static void sh_teardown(void)
+{
+	int i;
+
+	for(i = 0; i < sh_nq; i++)
+		(void) delete_queue(sh_tkt[i]);
+	sh_nq = 0;
+}
+
+static struct variant variants[] = {
+	{ "mutex", mtx_setup, mtx_put, mtx_take, mtx_teardown },
+	{ "shard", sh_setup, sh_put, sh_take, sh_teardown },
+};
+#define NVARIANTS	((int)(sizeof(variants)/sizeof(variants[0])))
+
+/********** the driver ************/
+/*
+ * per-thread state; padded so counters of different threads
+ * never share a cache line
+ */
+struct worker {
+	pthread_t tid;			/* thread id */
+	int cpu;			/* CPU it is pinned to */
+	int qi;				/* first queue it works on */
+	long ops;			/* successful puts or takes */
+	int nlat;			/* latency samples taken */
+	unsigned int lat[NSAMPLE];	/* sampled call latency, ns */
+	char pad[64];
+};
+
+static struct variant *cur;		/* variant being measured */
+static int curnq;			/* number of queues in this run */
+static volatile int running;		/* cleared to stop the run */
+static volatile int started;		/* set to start the run */
+static int ncpu;			/* CPUs we may run on */
+static int cpus[1024];			/* ... and which ones */
+
+static unsigned long long nsnow(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return((unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static void pin(int cpu)
+{
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	(void) pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+static void sample(struct worker *w, unsigned long long t0)
+{
+	if (w->nlat < NSAMPLE)
+		w->lat[w->nlat++] = (unsigned int) (nsnow() - t0);
+}
+
+static void *producer(void *arg)
+{
+	struct worker *w = arg;
+	unsigned long long t0 = 0;
+	int n = 0;
+
+	pin(w->cpu);
+	while(!started)
+		;
+	while(running){
+		if ((w->ops & SAMPLEMASK) == 0)
+			t0 = nsnow();
+		if (QE_ISERROR(cur->put(w->qi, n))){
+			sched_yield();
+			continue;
+		}
+		if ((w->ops & SAMPLEMASK) == 0)
+			sample(w, t0);
+		w->ops++;
+		n = (n + 1) & 0x7fffffff;
+	}
+	return(NULL);
+}
+
+static void *consumer(void *arg)
+{
+	struct worker *w = arg;
+	unsigned long long t0 = 0;
+	int n, qi = w->qi, miss = 0;
+
+	pin(w->cpu);
+	while(!started)
+		;
+	while(running){
+		if ((w->ops & SAMPLEMASK) == 0)
+			t0 = nsnow();
+		if (QE_ISERROR(cur->take(qi, &n))){
+			/* own queue is dry; look at the next one */
+			qi = (qi + 1) % curnq;
+			if (++miss >= curnq){
+				miss = 0;
+				sched_yield();
+			}
+			continue;
+		}
+		if ((w->ops & SAMPLEMASK) == 0)
+			sample(w, t0);
+		miss = 0;
+		w->ops++;
+	}
+	return(NULL);
+}
+
+static int cmpu(const void *a, const void *b)
+{
+	unsigned int x = *(const unsigned int *)a;
+	unsigned int y = *(const unsigned int *)b;
+
+	return((x > y) - (x < y));
+}
+
+/* Jain's fairness index: (sum x)^2 / (n * sum x^2) */
+static double jain(struct worker *w, int n)
+{
+	double s = 0, s2 = 0;
+	int i;
+
+	for(i = 0; i < n; i++){
+		s += w[i].ops;
+		s2 += (double) w[i].ops * w[i].ops;
+	}
+	return(s2 == 0 ? 1.0 : s * s / (n * s2));
+}
+
+static int run(int np, int nc, int nq, int cap, int msec)
+{
+	static struct worker wp[MAXTHR], wc[MAXTHR];
+	static unsigned int all[2 * MAXTHR * NSAMPLE];
+	unsigned long long t0, t1;
+	long total = 0;
+	int i, nall = 0;
+
+	if (QE_ISERROR(cur->setup(nq, cap)))
+		return(-1);
+	curnq = nq;
+	running = 1;
+	started = 0;
+	for(i = 0; i < np; i++){
+		memset(&wp[i], 0, sizeof(wp[i]));
+		wp[i].cpu = cpus[i % ncpu];
+		wp[i].qi = i % nq;
+		pthread_create(&wp[i].tid, NULL, producer, &wp[i]);
+	}
+	for(i = 0; i < nc; i++){
+		memset(&wc[i], 0, sizeof(wc[i]));
+		wc[i].cpu = cpus[(np + i) % ncpu];
+		wc[i].qi = i % nq;
+		pthread_create(&wc[i].tid, NULL, consumer, &wc[i]);
+	}
+	t0 = nsnow();
+	started = 1;
+	usleep(msec * 1000);
+	running = 0;
+	t1 = nsnow();
+	for(i = 0; i < np; i++)
+		pthread_join(wp[i].tid, NULL);
+	for(i = 0; i < nc; i++)
+		pthread_join(wc[i].tid, NULL);
+	cur->teardown();
+
+	/* merge the latency samples of both roles */
+	for(i = 0; i < np; i++){
+		memcpy(&all[nall], wp[i].lat, wp[i].nlat * sizeof(all[0]));
+		nall += wp[i].nlat;
+	}
+	for(i = 0; i < nc; i++){
+		memcpy(&all[nall], wc[i].lat, wc[i].nlat * sizeof(all[0]));
+		nall += wc[i].nlat;
+		total += wc[i].ops;
+	}
+	qsort(all, nall, sizeof(all[0]), cmpu);
+
+	printf("%-8s %3d %3d %4d %6d %12.0f %7u %7u %7u %6.3f %6.3f\n",
+		cur->name, np, nc, nq, cap,
+		total / ((t1 - t0) / 1e9),
+		nall ? all[nall / 2] : 0,
+		nall ? all[(int)(nall * 0.99)] : 0,
+		nall ? all[(int)(nall * 0.999)] : 0,
+		jain(wp, np), jain(wc, nc));
+	fflush(stdout);
+	return(0);
+}
+
+/* thread counts double up to, and always include, the maximum */
+static int nextthr(int n, int max)
+{
+	if (n == max)
+		return(max + 1);
+	return(2 * n > max ? max : 2 * n);
+}
+
+int main(int argc, char **argv)
+{
+	static const int nqs[] = { 1, 4, 16 };
+	static const int caps[] = { 64, 1024, 16384 };
+	const char *only = NULL;
+	int maxthr = 0, msec = 200;
+	int v, np, nc, i, j, c;
+	cpu_set_t set;
+
+	while((c = getopt(argc, argv, "t:d:v:")) != -1)
+		switch(c){
+		case 't':	maxthr = atoi(optarg);	break;
+		case 'd':	msec = atoi(optarg);	break;
+		case 'v':	only = optarg;		break;
+		default:
+			fprintf(stderr,
+			    "usage: qbench [-t maxthreads] [-d msec] [-v variant]\n");
+			return(1);
+		}
+
+	/* find the CPUs we may use; threads are pinned round robin */
+	CPU_ZERO(&set);
+	(void) sched_getaffinity(0, sizeof(set), &set);
+	for(c = 0; c < CPU_SETSIZE && ncpu < 1024; c++)
+		if (CPU_ISSET(c, &set))
+			cpus[ncpu++] = c;
+	if (ncpu == 0)
+		cpus[ncpu++] = 0;
+	if (maxthr <= 0)
+		maxthr = ncpu;
+	if (maxthr > MAXTHR)
+		maxthr = MAXTHR;
+
+	printf("# %d cpus, %d ms per point, latency in ns\n", ncpu, msec);
+	printf("%-8s %3s %3s %4s %6s %12s %7s %7s %7s %6s %6s\n",
+		"variant", "P", "C", "nq", "cap", "elts/s",
+		"p50", "p99", "p999", "fairP", "fairC");
+	for(v = 0; v < NVARIANTS; v++){
+		if (only != NULL && strcmp(only, variants[v].name) != 0)
+			continue;
+		cur = &variants[v];
+		for(np = 1; np <= maxthr; np = nextthr(np, maxthr))
+			for(nc = 1; nc <= maxthr; nc = nextthr(nc, maxthr))
+				for(i = 0; i < (int)(sizeof(nqs)/sizeof(nqs[0])); i++)
+					for(j = 0; j < (int)(sizeof(caps)/sizeof(caps[0])); j++)
+						if (run(np, nc, nqs[i], caps[j], msec) < 0)
+							return(1);
+	}
+	return(0);
+}
@@ -0,0 +1,86 @@
+/*
+ * walbench.c		group commit benchmark for durable queues
+ *
+ * Puts elements on a durable queue (create_durable_queue()) for a
+ * fixed time at each of a range of group commit batch sizes, taking
+ * them off again as it goes so the queue never fills, and reports
+ * elements per second and syncs per second. The log lives in the
+ * given directory, which should be on the local file system to be
+ * measured.
+ *
+ * Usage: walbench [-d millisecs] [directory]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "../qlib.h"
+
+static unsigned long long nsnow(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return((unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+int main(int argc, char **argv)
+{
+	static const int batches[] = { 1, 4, 16, 64, 256, 1024, 4096 };
+	const char *dir = "/tmp";
+	char path[1024];
+	struct qwalopts o;
+	unsigned long long t0, t1, end;
+	long n;
+	int i, c, rv, msec = 1000;
+	QTICKET t;
+
+	while((c = getopt(argc, argv, "d:")) != -1)
+		switch(c){
+		case 'd':	msec = atoi(optarg);	break;
+		default:
+			fprintf(stderr, "usage: walbench [-d msec] [directory]\n");
+			return(1);
+		}
+	if (optind < argc)
+		dir = argv[optind];
+	(void) snprintf(path, sizeof(path), "%s/walbench.%d.log", dir, (int) getpid());
+
+	printf("# log %s, %d ms per batch size\n", path, msec);
+	printf("%6s %12s %10s %10s\n", "batch", "elts/s", "syncs/s", "ns/elt");
+	for(i = 0; i < (int)(sizeof(batches)/sizeof(batches[0])); i++){
+		(void) unlink(path);
+		memset(&o, 0, sizeof(o));
+		o.batch = batches[i];
+		o.maxdelay = 1000000000L;	/* only the batch size counts */
+		/* a QTICKET is unsigned, so test the result before storing it */
+		if (QE_ISERROR(rv = create_durable_queue(path, 1024, &o))){
+			fprintf(stderr, "walbench: %s\n", qe_errbuf);
+			return(1);
+		}
+		t = rv;
+
+		/* one put and one take per element: two log records */
+		t0 = nsnow();
+		end = t0 + msec * 1000000ULL;
+		for(n = 0; (n & 255) != 0 || nsnow() < end; n++)
+			if (QE_ISERROR(put_on_queue(t, (int) n)) ||
+			    QE_ISERROR(take_off_queue(t))){
+				fprintf(stderr, "walbench: %s\n", qe_errbuf);
+				return(1);
+			}
+		(void) queue_commit(t);
+		t1 = nsnow();
+		(void) delete_queue(t);
+
+		printf("%6d %12.0f %10.0f %10.0f\n", batches[i],
+			n / ((t1 - t0) / 1e9),
+			/* puts alternate with takes: two records an element */
+			(2.0 * n / batches[i]) / ((t1 - t0) / 1e9),
+			(double) (t1 - t0) / n);
+		fflush(stdout);
+	}
+	(void) unlink(path);
+	return(0);
+}
@@ -0,0 +1,142 @@
+/*
+ * walfail.c		failed group commit check for durable queues
+ *
+ * Makes group commits of a durable queue (create_durable_queue())
+ * fail, by lowering the process's file size limit so the log can't
+ * grow (at first part way through a record, so a write is cut
+ * short), and carries on putting and taking through the failures
+ * and after the limit is lifted. The put or take whose commit fails
+ * must not happen, and must leave nothing of itself in the log; so
+ * at the end the log, replayed, must give back exactly the elements
+ * the successful calls leave in the queue. Exits 0 if it does.
+ *
+ * Usage: walfail [directory]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include "../qlib.h"
+
+#define SIZE	64		/* capacity of the queue */
+#define NOPS	200		/* calls made while commits can fail */
+
+static int model[SIZE];		/* what the queue should hold */
+static int mhead, mcount;	/* ... its front, and how many */
+
+static struct rlimit orig;	/* the file size limit we started with */
+
+/* lower the file size limit to lim bytes, or (lim 0) put it back */
+static void fsize(rlim_t lim)
+{
+	struct rlimit rl = orig;
+
+	if (lim != 0)
+		rl.rlim_cur = lim;
+	if (setrlimit(RLIMIT_FSIZE, &rl) < 0){
+		perror("walfail: setrlimit");
+		exit(1);
+	}
+}
+
+/* one call: a put of n, or a take; returns 1 if it failed */
+static int op(QTICKET t, int put, int n)
+{
+	int rv;
+
+	if (put){
+		if (mcount == SIZE)
+			return(0);
+		if (QE_ISERROR(rv = put_on_queue(t, n)))
+			return(1);
+		model[(mhead + mcount++) % SIZE] = n;
+		return(0);
+	}
+	if (mcount == 0)
+		return(0);
+	if (QE_ISERROR(rv = take_off_queue(t)))
+		return(1);
+	if (rv != model[mhead]){
+		fprintf(stderr, "walfail: took %d, wanted %d\n", rv, model[mhead]);
+		exit(1);
+	}
+	mhead = (mhead + 1) % SIZE;
+	mcount--;
+	return(0);
+}
+
+int main(int argc, char **argv)
+{
+	const char *dir = argc > 1 ? argv[1] : "/tmp";
+	char path[1024];
+	struct qwalopts o;
+	QTICKET t;
+	int i, rv, nfail = 0;
+
+	(void) snprintf(path, sizeof(path), "%s/walfail.%d.log", dir, (int) getpid());
+	(void) unlink(path);
+	(void) getrlimit(RLIMIT_FSIZE, &orig);
+	(void) signal(SIGXFSZ, SIG_IGN);
+	memset(&o, 0, sizeof(o));
+	o.batch = 4;
+	o.maxdelay = 1000000000L;	/* commit on the batch size only */
+	if (QE_ISERROR(rv = create_durable_queue(path, SIZE, &o))){
+		fprintf(stderr, "walfail: %s\n", qe_errbuf);
+		return(1);
+	}
+	t = rv;
+
+	/* two full batches go in: 64 bytes of log */
+	for(i = 0; i < 8; i++)
+		if (op(t, 1, i)){
+			fprintf(stderr, "walfail: %s\n", qe_errbuf);
+			return(1);
+		}
+
+	/*
+	 * room for a record and a half more: the next commit writes
+	 * part of its batch and fails; then puts and runs of takes
+	 * (which fold into one record) go on failing at each commit
+	 */
+	fsize(64 + 12);
+	for(i = 0; i < NOPS; i++)
+		nfail += op(t, i % 3 == 0, 100 + i);
+	fsize(0);
+	if (nfail == 0){
+		fprintf(stderr, "walfail: no commit failed\n");
+		return(1);
+	}
+
+	/* and afterwards, with room, everything must work again */
+	for(i = 0; i < NOPS; i++)
+		if (op(t, i % 3 != 2, 1000 + i)){
+			fprintf(stderr, "walfail: after lifting limit: %s\n", qe_errbuf);
+			return(1);
+		}
+	if (QE_ISERROR(queue_commit(t)) || QE_ISERROR(delete_queue(t))){
+		fprintf(stderr, "walfail: %s\n", qe_errbuf);
+		return(1);
+	}
+
+	/* the log must give back just what the model holds */
+	if (QE_ISERROR(rv = create_durable_queue(path, SIZE, &o))){
+		fprintf(stderr, "walfail: replay: %s\n", qe_errbuf);
+		return(1);
+	}
+	t = rv;
+	for(i = 0; mcount > 0; i++)
+		if (op(t, 0, 0)){
+			fprintf(stderr, "walfail: replay short by %d\n", mcount);
+			return(1);
+		}
+	if (take_off_queue(t) != QE_EMPTY){
+		fprintf(stderr, "walfail: replay has elements to spare\n");
+		return(1);
+	}
+	(void) delete_queue(t);
+	(void) unlink(path);
+	printf("walfail: ok (%d commits failed, %d elements replayed)\n", nfail, i);
+	return(0);
+}
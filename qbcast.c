@@ -0,0 +1,301 @@
+/*
+ * qbcast.c
+ *
+ * Broadcast rings, behind the broadcast queues of create_bcast_queue()
+ * in qlib.c: one writer thread puts each element on the ring once,
+ * and every subscriber reads every element from the ring itself,
+ * at its own pace, rather than from a copy in a queue of its own.
+ * The writer may not get a whole ring ahead of the slowest
+ * subscriber, so no element is overwritten before all have read it
+ * (in the manner of the LMAX Disruptor).
+ *
+ * Internal Representation:
+ * Elements are numbered from 0 as they are put; element i lives in
+ * ring[i & mask]. The writer publishes cursor, the number of the
+ * next element it will put, and each subscriber publishes seq, the
+ * number of the next element it will read, each on a cache line of
+ * its own; a subscriber slot not in use holds BFREE. The writer
+ * may put element i once every seq is past i - size; rather than
+ * look at every subscriber on every put, it keeps gate, the least
+ * seq when it last looked, and looks again only when that says the
+ * ring is full. Likewise a subscriber keeps avail, the cursor when
+ * it last looked. So in the steady state the writer touches only
+ * its own line and the ring, and a subscriber only its own line,
+ * the ring and, once per batch it finds, the writer's. Stores of
+ * elements come before the release store of cursor that publishes
+ * them, and reads of them before the release store of the seq that
+ * frees their slots, so the ring itself needs no atomics.
+ *
+ * Subscribing and unsubscribing take a small lock, which the writer
+ * also takes when it looks at the subscribers; so a new subscriber
+ * is seen before the writer can overwrite anything it may read.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include "qlib.h"
+#include "qpriv.h"
+
+#define BLINE	64		/* bytes in a cache line */
+#define BFREE	LLONG_MAX	/* seq of a subscriber slot not in use */
+
+/*
+ * a subscriber
+ */
+struct qbsub {
+	_Alignas(BLINE) atomic_llong seq;	/* next element to read */
+	long long avail;			/* cursor when last looked */
+};
+
+/*
+ * a broadcast ring
+ */
+struct qbcast {
+	_Alignas(BLINE) atomic_llong cursor;	/* next element to put */
+	_Alignas(BLINE) long long next;		/* the writer's copy of it */
+	long long gate;				/* least seq when last looked */
+	_Alignas(BLINE) atomic_flag lock;	/* guards the subscriber set */
+	long long mask;				/* slots - 1 */
+	int nsub;				/* subscriber slots */
+	int *ring;				/* the elements */
+	struct qbsub *sub;			/* the subscribers */
+};
+
+/* take and drop the subscriber lock */
+static void sublock(struct qbcast *b)
+{
+	while(atomic_flag_test_and_set_explicit(&b->lock, memory_order_acquire))
+		;
+}
+
+static void subunlock(struct qbcast *b)
+{
+	atomic_flag_clear_explicit(&b->lock, memory_order_release);
+}
+
+/*
+ * make a broadcast ring
+ *
+ * PARAMETERS:	int size	least capacity (rounded up to a
+ *				power of two)
+ *		int nsub	most subscribers at once
+ *		struct qbcast **bp	where to put it
+ * RETURNED:	int		error code
+ * ERRORS:	QE_INVALIDSIZE	size or nsub is not positive, or too big
+ *		QE_NOROOM	no memory
+ *				(qe_errbuf has descriptive string)
+ * EXCEPTIONS:	none
+ */
+int qbcast_open(int size, int nsub, struct qbcast **bp)
+{
+	register struct qbcast *b;	/* new ring */
+	register long long n;		/* its capacity */
+	register int i;			/* counter */
+	void *p;			/* aligned block for it */
+
+	if (size <= 0 || size > (1 << 30) || nsub <= 0 || nsub > 1024){
+		ERRBUF3("qbcast_open: invalid size (%d) or subscribers (%d)",
+								size, nsub);
+		return(QE_INVALIDSIZE);
+	}
+	for(n = 1; n < size; n <<= 1)
+		;
+	if (posix_memalign(&p, BLINE, sizeof(struct qbcast)) != 0){
+		ERRBUF("qbcast_open: malloc: no more memory");
+		return(QE_NOROOM);
+	}
+	b = p;
+	if ((b->ring = malloc(n * sizeof(int))) == NULL ||
+	    posix_memalign(&p, BLINE, nsub * sizeof(struct qbsub)) != 0){
+		ERRBUF("qbcast_open: malloc: no more memory");
+		(void) free(b->ring);
+		(void) free(b);
+		return(QE_NOROOM);
+	}
+	b->sub = p;
+	atomic_init(&b->cursor, 0);
+	b->next = b->gate = 0;
+	atomic_flag_clear(&b->lock);
+	b->mask = n - 1;
+	b->nsub = nsub;
+	for(i = 0; i < nsub; i++){
+		atomic_init(&b->sub[i].seq, BFREE);
+		b->sub[i].avail = 0;
+	}
+	*bp = b;
+	return(QE_NONE);
+}
+
+/*
+ * the least seq of the subscribers, or next if there are none
+ * (caller holds the lock)
+ */
+static long long bgate(struct qbcast *b)
+{
+	register long long g = b->next;	/* least so far */
+	register long long s;		/* a subscriber's seq */
+	register int i;			/* counter */
+
+	for(i = 0; i < b->nsub; i++)
+		if ((s = atomic_load_explicit(&b->sub[i].seq,
+					memory_order_acquire)) < g)
+			g = s;
+	return(g);
+}
+
+/*
+ * put an element on the ring; the writer only
+ *
+ * PARAMETERS:	struct qbcast *b	the ring
+ *		int n		element to put
+ * RETURNED:	int		error code
+ * ERRORS:	QE_TOOFULL	the slowest subscriber has not yet
+ *				read the element in the slot
+ * EXCEPTIONS:	none
+ */
+int qbcast_put(struct qbcast *b, int n)
+{
+	register long long i = b->next;	/* number of this element */
+
+	if (i - b->gate > b->mask){
+		/* full when last looked; look again */
+		sublock(b);
+		b->gate = bgate(b);
+		subunlock(b);
+		if (i - b->gate > b->mask){
+			ERRBUF2("qbcast_put: ring full (max %lld elts)",
+								b->mask + 1);
+			return(QE_TOOFULL);
+		}
+	}
+	b->ring[i & b->mask] = n;
+	b->next = i + 1;
+	atomic_store_explicit(&b->cursor, i + 1, memory_order_release);
+	return(QE_NONE);
+}
+
+/*
+ * read the next element for a subscriber; that subscriber's
+ * thread only
+ *
+ * PARAMETERS:	struct qbcast *b	the ring
+ *		int s		the subscriber
+ *		int *n		where to put the element
+ * RETURNED:	int		error code
+ * ERRORS:	QE_BADPARAM	no such subscriber
+ *		QE_EMPTY	subscriber has read every element put
+ * EXCEPTIONS:	none
+ */
+int qbcast_take(struct qbcast *b, int s, int *n)
+{
+	register struct qbsub *u;	/* the subscriber */
+	register long long i;		/* number of its next element */
+
+	if (s < 0 || s >= b->nsub ||
+	    (i = atomic_load_explicit(&(u = &b->sub[s])->seq,
+				memory_order_relaxed)) == BFREE){
+		ERRBUF2("qbcast_take: no subscriber %d", s);
+		return(QE_BADPARAM);
+	}
+	if (i >= u->avail &&
+	    i >= (u->avail = atomic_load_explicit(&b->cursor,
+				memory_order_acquire))){
+		ERRBUF("qbcast_take: nothing new");
+		return(QE_EMPTY);
+	}
+	*n = b->ring[i & b->mask];
+	atomic_store_explicit(&u->seq, i + 1, memory_order_release);
+	return(QE_NONE);
+}
+
+/*
+ * add a subscriber; it sees the elements put from now on
+ *
+ * PARAMETERS:	struct qbcast *b	the ring
+ * RETURNED:	int		the subscriber (>= 0), or error code
+ * ERRORS:	QE_TOOMANYQS	every subscriber slot is in use
+ * EXCEPTIONS:	none
+ */
+int qbcast_subscribe(struct qbcast *b)
+{
+	register int i;		/* subscriber slot */
+	register long long c;	/* where it starts */
+
+	sublock(b);
+	for(i = 0; i < b->nsub; i++)
+		if (atomic_load_explicit(&b->sub[i].seq,
+					memory_order_relaxed) == BFREE)
+			break;
+	if (i == b->nsub){
+		subunlock(b);
+		ERRBUF2("qbcast_subscribe: too many subscribers (max %d)",
+								b->nsub);
+		return(QE_TOOMANYQS);
+	}
+	c = atomic_load_explicit(&b->cursor, memory_order_acquire);
+	b->sub[i].avail = c;
+	atomic_store_explicit(&b->sub[i].seq, c, memory_order_relaxed);
+	subunlock(b);
+	return(i);
+}
+
+/*
+ * drop a subscriber, so it no longer holds the writer back
+ *
+ * PARAMETERS:	struct qbcast *b	the ring
+ *		int s		the subscriber
+ * RETURNED:	int		error code
+ * ERRORS:	QE_BADPARAM	no such subscriber
+ * EXCEPTIONS:	none
+ */
+int qbcast_unsubscribe(struct qbcast *b, int s)
+{
+	if (s < 0 || s >= b->nsub ||
+	    atomic_load_explicit(&b->sub[s].seq, memory_order_relaxed) == BFREE){
+		ERRBUF2("qbcast_unsubscribe: no subscriber %d", s);
+		return(QE_BADPARAM);
+	}
+	sublock(b);
+	atomic_store_explicit(&b->sub[s].seq, BFREE, memory_order_release);
+	subunlock(b);
+	return(QE_NONE);
+}
+
+/*
+ * number of elements the slowest subscriber has yet to read;
+ * only a hint while the ring is in use
+ */
+int qbcast_count(struct qbcast *b)
+{
+	register long long c;	/* the cursor */
+	register long long g;	/* least seq */
+	register long long s;	/* a subscriber's seq */
+	register int i;		/* counter */
+
+	g = c = atomic_load_explicit(&b->cursor, memory_order_acquire);
+	for(i = 0; i < b->nsub; i++)
+		if ((s = atomic_load_explicit(&b->sub[i].seq,
+					memory_order_relaxed)) < g)
+			g = s;
+	return((int) (c - g));
+}
+
+/*
+ * capacity of a broadcast ring
+ */
+int qbcast_size(struct qbcast *b)
+{
+	return((int) (b->mask + 1));
+}
+
+/*
+ * free a broadcast ring; nobody may be using it
+ */
+void qbcast_close(struct qbcast *b)
+{
+	(void) free(b->sub);
+	(void) free(b->ring);
+	(void) free(b);
+}
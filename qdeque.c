@@ -0,0 +1,214 @@
+/*
+ * qdeque.c
+ *
+ * Work-stealing deques (Chase and Lev), behind the deques of
+ * create_deque() in qlib.c. Each deque has one owner thread, which
+ * pushes and pops at the bottom like a stack, and any number of
+ * thieves, which steal from the top; so a pool of workers each
+ * owning a deque mostly works alone on its own, newest task first
+ * while its data is still in cache, and an idle worker takes the
+ * oldest (usually biggest) task of a busy one.
+ *
+ * Internal Representation:
+ * Two free-running counters, top (the next element to steal) and
+ * bottom (the next free slot), on cache lines of their own; element
+ * i lives in ring[i & mask] and bottom - top is the depth. Only the
+ * owner writes bottom, so push and pop use plain loads and stores
+ * plus fences; a compare-and-swap on top is needed only by thieves,
+ * and by the owner when it pops the last element, racing them for
+ * it. The memory orders are those proved correct for C11 by Le,
+ * Pop, Cohen and Zappa Nardelli ("Correct and Efficient Work-
+ * Stealing for Weak Memory Models", PPoPP 2013). The ring is fixed
+ * in size, so nothing is ever freed while a thief may be reading
+ * it; a push on a full deque fails and the owner should run the
+ * task itself.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include "qlib.h"
+#include "qpriv.h"
+
+#define DQLINE	64		/* bytes in a cache line */
+
+/*
+ * a deque
+ */
+struct qdeque {
+	_Alignas(DQLINE) atomic_llong top;	/* next element to steal */
+	_Alignas(DQLINE) atomic_llong bottom;	/* next free slot */
+	_Alignas(DQLINE) long long mask;	/* slots - 1 */
+	atomic_int *ring;			/* the elements */
+};
+
+/*
+ * make a deque
+ *
+ * PARAMETERS:	int size	least capacity (rounded up to a
+ *				power of two)
+ *		struct qdeque **dp	where to put it
+ * RETURNED:	int		error code
+ * ERRORS:	QE_INVALIDSIZE	size is not positive, or too big
+ *		QE_NOROOM	no memory
+ *				(qe_errbuf has descriptive string)
+ * EXCEPTIONS:	none
+ */
+int qdeque_open(int size, struct qdeque **dp)
+{
+	register struct qdeque *d;	/* new deque */
+	register long long n;		/* its capacity */
+	void *p;			/* aligned block for it */
+
+	if (size <= 0 || size > (1 << 30)){
+		ERRBUF2("qdeque_open: invalid size (%d)", size);
+		return(QE_INVALIDSIZE);
+	}
+	for(n = 1; n < size; n <<= 1)
+		;
+	if (posix_memalign(&p, DQLINE, sizeof(struct qdeque)) != 0){
+		ERRBUF("qdeque_open: malloc: no more memory");
+		return(QE_NOROOM);
+	}
+	d = p;
+	if ((d->ring = malloc(n * sizeof(atomic_int))) == NULL){
+		ERRBUF("qdeque_open: malloc: no more memory");
+		(void) free(d);
+		return(QE_NOROOM);
+	}
+	atomic_init(&d->top, 0);
+	atomic_init(&d->bottom, 0);
+	d->mask = n - 1;
+	*dp = d;
+	return(QE_NONE);
+}
+
+/*
+ * push an element on the bottom; owner only
+ *
+ * PARAMETERS:	struct qdeque *d	the deque
+ *		int n		element to push
+ * RETURNED:	int		error code
+ * ERRORS:	QE_TOOFULL	deque is full
+ * EXCEPTIONS:	none
+ */
+int qdeque_push(struct qdeque *d, int n)
+{
+	register long long b, t;	/* bottom and top */
+
+	b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+	t = atomic_load_explicit(&d->top, memory_order_acquire);
+	if (b - t > d->mask){
+		ERRBUF2("qdeque_push: deque full (max %lld elts)", d->mask + 1);
+		return(QE_TOOFULL);
+	}
+	atomic_store_explicit(&d->ring[b & d->mask], n, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+	return(QE_NONE);
+}
+
+/*
+ * pop the element on the bottom, the one pushed last; owner only
+ *
+ * PARAMETERS:	struct qdeque *d	the deque
+ *		int *n		where to put it
+ * RETURNED:	int		error code
+ * ERRORS:	QE_EMPTY	deque is empty (or a thief got the last
+ *				element first)
+ * EXCEPTIONS:	none
+ */
+int qdeque_pop(struct qdeque *d, int *n)
+{
+	register long long b, t;	/* bottom and top */
+	long long tt;			/* top, for the compare-and-swap */
+	register int rv = QE_NONE;	/* error code */
+
+	/* claim the bottom slot first, then see if thieves got there */
+	b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+	atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	t = atomic_load_explicit(&d->top, memory_order_relaxed);
+	if (t <= b){
+		*n = atomic_load_explicit(&d->ring[b & d->mask], memory_order_relaxed);
+		if (t == b){
+			/* the last one: race the thieves for it */
+			tt = t;
+			if (!atomic_compare_exchange_strong_explicit(&d->top,
+					&tt, t + 1, memory_order_seq_cst,
+					memory_order_relaxed))
+				rv = QE_EMPTY;
+			atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+		}
+	}
+	else{
+		rv = QE_EMPTY;
+		atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+	}
+	if (rv == QE_EMPTY)
+		ERRBUF("qdeque_pop: deque empty");
+	return(rv);
+}
+
+/*
+ * steal the element on the top, the one pushed first; any thread
+ * a thief that loses a race for an element tries again, so this
+ * fails only when the deque is empty
+ *
+ * PARAMETERS:	struct qdeque *d	the deque
+ *		int *n		where to put it
+ * RETURNED:	int		error code
+ * ERRORS:	QE_EMPTY	deque is empty
+ * EXCEPTIONS:	none
+ */
+int qdeque_steal(struct qdeque *d, int *n)
+{
+	long long t;		/* top */
+	register long long b;	/* bottom */
+	register int x;		/* element at the top */
+
+	for(;;){
+		t = atomic_load_explicit(&d->top, memory_order_acquire);
+		atomic_thread_fence(memory_order_seq_cst);
+		b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+		if (t >= b){
+			ERRBUF("qdeque_steal: deque empty");
+			return(QE_EMPTY);
+		}
+		x = atomic_load_explicit(&d->ring[t & d->mask], memory_order_relaxed);
+		if (atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+				memory_order_seq_cst, memory_order_relaxed)){
+			*n = x;
+			return(QE_NONE);
+		}
+	}
+}
+
+/*
+ * number of elements in a deque; only a hint while it is in use
+ */
+int qdeque_count(struct qdeque *d)
+{
+	register long long n;	/* bottom - top */
+
+	n = atomic_load_explicit(&d->bottom, memory_order_relaxed) -
+			atomic_load_explicit(&d->top, memory_order_relaxed);
+	return(n < 0 ? 0 : (int) n);
+}
+
+/*
+ * capacity of a deque
+ */
+int qdeque_size(struct qdeque *d)
+{
+	return((int) (d->mask + 1));
+}
+
+/*
+ * free a deque; nobody may be using it
+ */
+void qdeque_close(struct qdeque *d)
+{
+	(void) free(d->ring);
+	(void) free(d);
+}
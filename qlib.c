@@ -4,15 +4,29 @@
  *
  * Implement a very robust "queue of integers" module. This
  * code could safely be used in any program. This package allows
- * up to MAXQ queues of up to MAXELT elements of type QELT.
+ * up to MAXQ queues, each of a capacity fixed when it is created,
+ * of elements of type QELT.
  *
  * Internal Representation:
  * An array of pointers queues[] contains pointers to each
  * queue; the pointer is NULL if the queue has not been created.
  * Creation is from the lowest index up. The queue structure
- * (type QUEUE) contains the queue array, a head index, a count
- * of elements, and a ticket number (see "External Representation"
- * below).
+ * (type QUEUE) contains the queue array, its capacity, a head
+ * index, a count of elements, and a ticket number (see "External
+ * Representation" below). A priority queue (kind QK_PRIO) keeps a
+ * d-ary heap in place of the ring (see create_prio_queue()); a lane
+ * queue (kind QK_LANES) cuts the ring into one ring per priority
+ * (see create_lane_queue()); a deque (kind QK_DEQUE) is a work-
+ * stealing deque (see create_deque() and qdeque.c); a delay queue
+ * (kind QK_DELAY) keeps a timing wheel (see create_delay_queue()
+ * and qtwheel.c); a broadcast queue (kind QK_BCAST) is a ring every
+ * subscriber reads all of (see create_bcast_queue() and qbcast.c);
+ * a sharded queue (kind QK_SHARD) is a ring per CPU (see
+ * create_shard_queue() and qshard.c); a partitioned queue (kind
+ * QK_PART) is a ring per partition of a key space (see
+ * create_part_queue() and qpart.c). A scheduler (kind QK_SCHED)
+ * holds no elements but serves those of the queues attached to it
+ * (see create_sched()).
  *
  * External Representation
  * All queues are referenced by "tickets" which (to the caller)
@@ -29,40 +43,177 @@
  * perhaps ...)
  */
 #include <stdio.h>
+#include <string.h>
 #include <strings.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include "qlib.h"
+#include "qpriv.h"
 
 /*
  * various macros
  */
-#define DEBUG			/* includes a queue lister for debugging */
-#define IOFFSET	0x1221		/* used to hide index number in ticket */
-#define NOFFSET	0x0502		/* used to hide nonce in ticket */
-#define EMPTY	-1		/* illegal index to show nothing in queue */
+#if !defined(QSTATS) && !defined(QNOSTATS)
+#define QSTATS			/* keeps per-queue counters (queue_stats);
+				   -DQNOSTATS leaves them out */
+#endif
+/* #define QLATENCY */		/* times elements in queue (queue_latency) */
+#if !defined(QTRACE) && !defined(QNOTRACE)
+#define QTRACE			/* static tracepoints (see qtrace.h);
+				   -DQNOTRACE leaves them out */
+#endif
+#define QFMAGIC	0x514c4631	/* "QLF1": file holds a queue */
+#define QFHDR	4096		/* file header size; ring follows */
+#define QSMAGIC	0x51534e31	/* "QSN1": file holds a snapshot */
+#define QSBUF	(1 << 16)	/* bytes read at a time on restore */
+#define QSIOV	1024		/* buffers per writev() (at most IOV_MAX,
+				   which is 1024 on Linux) */
+#define QHARITY	4		/* default children per heap node */
+#define QHMAXAR	8		/* most children per heap node */
+#define QLINE	64		/* bytes in a cache line */
+#define QLMAX	32		/* most lanes (bits in a lane mask) */
+#define QDTICK	1000		/* default delay queue tick, usecs */
+#define QNEVER	(~0ULL)		/* expiry of an element that never does */
+
+#include "qtrace.h"
+
+/*
+ * the header of a file-backed queue (see create_file_queue())
+ * head and count are published together as one 64-bit word, so
+ * whatever moment a crash happens at, the file holds a head and
+ * count that belong together
+ */
+struct qfile {
+	unsigned int magic;		/* QFMAGIC once set up */
+	int size;			/* capacity of the ring */
+	QTICKET ticket;			/* last ticket issued for it */
+	atomic_ullong state;		/* head << 32 | count */
+};
 
 /*
  * the queue structure
  */
 typedef int QELT;		/* type of element being queued */
+struct qhent {			/* an entry of a priority queue's heap */
+	int prio;		/* its priority; least comes off first */
+	QELT elt;		/* the element */
+};
+struct qlane {			/* a lane of a lane queue */
+	int head;		/* head index in the lane */
+	int count;		/* number of elements in the lane */
+};
 typedef struct queue {
 	QTICKET ticket;		/* contains unique queue ID */
+	int kind;		/* QK_FIFO, QK_PRIO, QK_LANES, ... */
 	QELT *que;	/* the actual queue */
+	struct qhent *heap;	/* QK_PRIO: the heap, in place of que */
+	int arity;		/* QK_PRIO: children per heap node */
+	struct qlane *lanes;	/* QK_LANES: lane i is que[i*lsize ..] */
+	int nlanes;		/* QK_LANES: how many */
+	int lsize;		/* QK_LANES: capacity of each */
+	unsigned int lmask;	/* QK_LANES: bit i set if lane i has elts */
+	struct qdeque *dq;	/* QK_DEQUE: the deque, in place of que */
+	struct qtwheel *tw;	/* QK_DELAY: the wheel, in place of que */
+	struct qbcast *bc;	/* QK_BCAST: the ring, in place of que */
+	struct qshard *sh;	/* QK_SHARD: the shards, in place of que */
+	struct qpart *pt;	/* QK_PART: the partitions, in place of que */
+	struct queue *ahead, *atail;	/* QK_SCHED: attached queues with
+				   elements, in the order they are served */
+	struct queue *sch;	/* scheduler it is attached to, or NULL */
+	struct queue *anext;	/* next on that one's active list */
+	int active;		/* 1 if on it */
+	int weight;		/* elements served per turn */
+	int deficit;		/* elements left in this turn */
+	int size;		/* capacity of que */
 	int head;		/* head iundex in que of the queue */
 	int count;		/* number of elements in queue */
+	unsigned long long born;	/* clkns() when it was created */
+	struct qfile *pf;	/* mapped file header, NULL if in memory */
+	struct qwal *wal;	/* write-ahead log, NULL if none */
+	struct qspill *sp;	/* overflow file, NULL if none */
+	unsigned long long *exp;	/* clkns() each element expires at,
+				   NULL if none do (see queue_set_ttl()) */
+	long ttl;		/* usecs put_on_queue gives, 0 for ever */
+	int expmono;		/* 1 if exp never falls, head to tail */
+	unsigned long long tbint;	/* ns per token of its token bucket,
+				   0 if it has none (see queue_set_rate()) */
+	unsigned long long tbtol;	/* ns of tokens the bucket holds,
+				   less one */
+	unsigned long long tbtat;	/* clkns() the bucket is next full */
+	int wmhi, wmlo;		/* watermarks (see queue_set_watermarks()) */
+	int wmup;		/* count that crosses the high one next,
+				   INT_MAX if none can */
+	int wmdown;		/* count that crosses the low one next,
+				   -1 if none can */
+	QWMFN wmfn;		/* told of crossings, NULL if nothing is */
+	void *wmarg;		/* ... and its argument */
+#ifdef QSTATS
+	struct qstats stats;	/* counters; only the caller touches them */
+#endif
+#ifdef QLATENCY
+	unsigned long long *stamp;	/* clock when each element was put */
+	unsigned long long lmin, lmax;	/* extremes of the stays, in ticks */
+	unsigned long *hist;	/* histogram of stays (see lbucket()) */
+#endif
 } QUEUE;
 
+/*
+ * true of the kinds of queue that have calls of their own instead
+ * of take_off_queue and the like: those threads share, and
+ * schedulers
+ */
+#define QOWNCALLS(q)	((q)->kind == QK_DEQUE || (q)->kind == QK_BCAST || \
+			 (q)->kind == QK_SHARD || (q)->kind == QK_PART || \
+			 (q)->kind == QK_SCHED)
+
+/*
+ * statistics counting; plain increments, as a queue is only
+ * ever manipulated by one caller at a time, and compiled out
+ * altogether without QSTATS
+ */
+#ifdef QSTATS
+#define STATINC(q,f)	((q)->stats.f++)
+#define STATHIWAT(q)	do { if ((q)->count > (q)->stats.hiwater) \
+				(q)->stats.hiwater = (q)->count; } while(0)
+#else
+#define STATINC(q,f)
+#define STATHIWAT(q)	do { } while(0)
+#endif
+
+/*
+ * make head and count of a file-backed queue durable (as far as
+ * a process crash goes); element stores come before this, so a
+ * recovered queue never holds a slot that was not written
+ */
+#define QPUBLISH(q)	do { if ((q)->pf != NULL) \
+		atomic_store_explicit(&(q)->pf->state, \
+		    ((unsigned long long) (q)->head << 32) | (q)->count, \
+		    memory_order_release); } while(0)
+
+/*
+ * tell whoever is watching a queue's watermarks if its count has
+ * just crossed one; between crossings, two comparisons
+ */
+#define QWATCH(q)	do { if ((q)->count >= (q)->wmup || \
+			     (q)->count <= (q)->wmdown) \
+				qwmark(q); } while(0)
+
 /*
  * error handling
  * all errors are returned as an integer code, and a string
  * amplifying the error is saved in here; this can then be
- * printed
+ * printed; each thread has its own (see create_deque())
  */
-char qe_errbuf[256] = "no error";	/* the error message buffer */
-					/* macros to fill it */
-#define ERRBUF(str)	(void) strncpy(qe_errbuf, str, sizeof(qe_errbuf))
-#define ERRBUF2(str,n)		(void) sprintf(qe_errbuf, str, n)
-#define ERRBUF3(str,n,m)	(void) sprintf(qe_errbuf, str, n, m)
+_Thread_local char qe_errbuf[256] = "no error";	/* the error message buffer */
+					/* macros to fill it are in qpriv.h */
 
 /*
  * global variables
@@ -71,10 +222,103 @@ static QUEUE **queues;		/* the queues */
 					/* nonce generator -- this MUST be */
 static unsigned int noncectr = 1;	/* non-zero always 		   */
 
-static int MAXELT = 0;
-
 static int MAXQ = 0;
 
+/*
+ * the monotonic clock, in nanoseconds
+ */
+static unsigned long long clkns(void)
+{
+	struct timespec ts;
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+	return((unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+#ifdef QLATENCY
+/*
+ * the clock used to time elements
+ * on x86 this is the time stamp counter, which costs a few
+ * nanoseconds to read; elsewhere the monotonic clock; ticks are
+ * turned into nanoseconds only when somebody asks for them, by
+ * comparing against the monotonic clock reading taken when the
+ * first stamp was needed
+ */
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define clkticks()	__rdtsc()
+#else
+#define clkticks()	clkns()
+#endif
+
+static unsigned long long clkt0;	/* ticks at calibration start */
+static unsigned long long clkn0;	/* nanoseconds at the same time */
+
+/*
+ * nanoseconds per tick; if we began calibrating under a
+ * millisecond ago, wait a little so the ratio means something
+ */
+static double clkscale(void)
+{
+	unsigned long long t, n;
+
+	while((n = clkns()) - clkn0 < 1000000)
+		;
+	t = clkticks();
+	return(t == clkt0 ? 1.0 : (double) (n - clkn0) / (t - clkt0));
+}
+
+/*
+ * log-linear histogram of stays
+ * values under 8 ticks have a bucket each; above that, every
+ * power of two is cut into 8 equal buckets, so a bucket is never
+ * wider than 1/8 of its lower bound; 64-bit values need 496
+ * buckets
+ */
+#define LSUB	3			/* log2 of buckets per octave */
+#define NLBUCKET	((64 - LSUB + 1) << LSUB)
+
+static int lbucket(unsigned long long v)
+{
+	register int e;		/* position of top bit of v */
+
+	if (v < (1 << LSUB))
+		return((int) v);
+	e = 63 - __builtin_clzll(v);
+	return(((e - LSUB + 1) << LSUB) + (int) ((v >> (e - LSUB)) & ((1 << LSUB) - 1)));
+}
+
+/* midpoint of a bucket; inverse of lbucket() */
+static unsigned long long lvalue(int b)
+{
+	register int e;		/* position of top bit of the bucket */
+	unsigned long long lo;	/* smallest value in the bucket */
+
+	if (b < (1 << LSUB))
+		return(b);
+	e = (b >> LSUB) + LSUB - 1;
+	lo = ((unsigned long long) ((1 << LSUB) | (b & ((1 << LSUB) - 1)))) << (e - LSUB);
+	return(lo + ((1ULL << (e - LSUB)) >> 1));
+}
+#endif
+
+#ifdef QLATENCY
+/*
+ * record how long the element in que[n] (or heap[n]) sat there
+ */
+static void lstay(QUEUE *q, int n)
+{
+	unsigned long long d = clkticks() - q->stamp[n];
+
+	q->hist[lbucket(d)]++;
+	if (d < q->lmin)
+		q->lmin = d;
+	if (d > q->lmax)
+		q->lmax = d;
+}
+#endif
+
 /*
  * generate a ticket number
  * this is an integer:
@@ -128,6 +372,37 @@ static QTICKET qtktref(unsigned int index)
 	return((QTICKET) ((high << 16) | low));
 }
 
+/*
+ * check a queue for internal consistency; readref() does this
+ * for every operation, and recovery of a file-backed queue does
+ * it for what it finds in the file
+ *
+ * PARAMETERS:	QUEUE *q	queue to check
+ *		char *who	name of caller, for the error message
+ * RETURNED:	int		error code
+ * ERRORS:	QE_INTINCON	queue is internally inconsistent because:
+ *				* head or count is out of range
+ *				* nonce is 0
+ *				(qe_errbuf has disambiguating string)
+ * EXCEPTIONS:	none
+ */
+static int qcheck(QUEUE *q, const char *who)
+{
+	if (q->head < 0 || q->head >= q->size ||
+		q->count < 0 || q->count > q->size){
+		(void) sprintf(qe_errbuf,
+			"%s: internal inconsistency: head=%u,count=%u",
+					who, q->head, q->count);
+		return(QE_INTINCON);
+	}
+	if (((q->ticket)&0xffff) == 0){
+		(void) sprintf(qe_errbuf,
+			"%s: internal inconsistency: nonce=0", who);
+		return(QE_INTINCON);
+	}
+	return(QE_NONE);
+}
+
 /*
  * check a ticket number and turn it into an index
  *
@@ -147,7 +422,7 @@ static QTICKET qtktref(unsigned int index)
 static int readref(QTICKET qno)
 {
 	register unsigned index;	/* index of current queue */
-	register QUEUE *q;		/* pointer to queue structure */
+	register int rv;		/* result of consistency check */
 
 	/* get the index number and check it for validity */
 	index = ((qno >> 16) & 0xffff) - IOFFSET;
@@ -176,21 +451,123 @@ static int readref(QTICKET qno)
 	/*
 	 * check for internal consistencies
 	 */
-	if ((q = queues[index])->head < 0 || q->head >= MAXELT ||
-		q->count < 0 || q->count > MAXELT){
-		ERRBUF3("readref: internal inconsistency: head=%u,count=%u",
-					q->head, q->count);
-		return(QE_INTINCON);
-	}
-	if (((q->ticket)&0xffff) == 0){
-		ERRBUF("readref: internal inconsistency: nonce=0");
-		return(QE_INTINCON);
-	}
+	if (QE_ISERROR(rv = qcheck(queues[index], "readref")))
+		return(rv);
 
 	/* all's well -- return index */
 	return(index);
 }
 
+/*
+ * allocate and initialize a queue structure, all but the ticket
+ *
+ * PARAMETERS:	int size	maximum size of the queue
+ *		char *who	name of caller, for the error message
+ * RETURNED:	QUEUE *		the queue, or NULL if no memory
+ *				(qe_errbuf has descriptive string)
+ * EXCEPTIONS:	none
+ */
+static QUEUE *qalloc(int size, const char *who)
+{
+	register QUEUE *q;	/* the new queue */
+
+	if ((q = malloc(sizeof(QUEUE))) == NULL ||
+	    (q->que = (QELT *)malloc(size * sizeof(QELT))) == NULL){
+		(void) free(q);
+		(void) sprintf(qe_errbuf, "%s: malloc: no more memory", who);
+		return(NULL);
+	}
+#ifdef QLATENCY
+	q->stamp = malloc(size * sizeof(unsigned long long));
+	q->hist = calloc(NLBUCKET, sizeof(unsigned long));
+	if (q->stamp == NULL || q->hist == NULL){
+		(void) free(q->stamp);
+		(void) free(q->hist);
+		(void) free(q->que);
+		(void) free(q);
+		(void) sprintf(qe_errbuf, "%s: malloc: no more memory", who);
+		return(NULL);
+	}
+	q->lmin = ~0ULL;
+	q->lmax = 0;
+	if (clkn0 == 0){
+		clkn0 = clkns();
+		clkt0 = clkticks();
+	}
+#endif
+
+	/* now initialize queue entry */
+	q->ticket = 0;
+	q->kind = QK_FIFO;
+	q->heap = NULL;
+	q->arity = 0;
+	q->lanes = NULL;
+	q->nlanes = q->lsize = 0;
+	q->lmask = 0;
+	q->dq = NULL;
+	q->tw = NULL;
+	q->bc = NULL;
+	q->sh = NULL;
+	q->pt = NULL;
+	q->ahead = q->atail = NULL;
+	q->sch = q->anext = NULL;
+	q->active = q->weight = q->deficit = 0;
+	q->size = size;
+	q->head = q->count = 0;
+	q->born = clkns();
+	q->pf = NULL;
+	q->wal = NULL;
+	q->sp = NULL;
+	q->exp = NULL;
+	q->ttl = 0;
+	q->expmono = 1;
+	q->tbint = q->tbtol = q->tbtat = 0;
+	q->wmhi = q->wmup = INT_MAX;
+	q->wmlo = q->wmdown = -1;
+	q->wmfn = NULL;
+	q->wmarg = NULL;
+#ifdef QSTATS
+	(void) memset(&q->stats, 0, sizeof(struct qstats));
+#endif
+	return(q);
+}
+
+/*
+ * release the memory of a queue structure
+ * a file-backed queue's ring is unmapped rather than freed; any
+ * log or spill file must be closed by the caller
+ *
+ * PARAMETERS:	QUEUE *q	the queue
+ * RETURNED:	nothing
+ * EXCEPTIONS:	none
+ */
+static void qfree(QUEUE *q)
+{
+#ifdef QLATENCY
+	(void) free(q->stamp);
+	(void) free(q->hist);
+#endif
+	if (q->pf != NULL)
+		(void) munmap(q->pf, QFHDR + q->size * sizeof(QELT));
+	else
+		(void) free(q->que);
+	if (q->heap != NULL)
+		(void) free(q->heap - (q->arity - 1));
+	(void) free(q->lanes);
+	(void) free(q->exp);
+	if (q->dq != NULL)
+		qdeque_close(q->dq);
+	if (q->tw != NULL)
+		qtw_close(q->tw);
+	if (q->bc != NULL)
+		qbcast_close(q->bc);
+	if (q->sh != NULL)
+		qshard_close(q->sh);
+	if (q->pt != NULL)
+		qpart_close(q->pt);
+	(void) free(q);
+}
+
 /*
  * create a new queue
  *
@@ -207,17 +584,20 @@ QTICKET create_queue(int size)
 {
 	register int cur;	/* index of current queue */
 	register int tkt;	/* new ticket for current queue */
+	register QUEUE *q;	/* the new queue */
 
 	if(MAXQ <= 0){
         if ((queues = (QUEUE **)malloc((MAXQ + 1)* sizeof(QUEUE *))) == NULL){
             ERRBUF("create_queue: malloc: no more memory");
+            QPROBE3(error, 0, QE_NOROOM, "create_queue");
             return(QE_NOROOM);
         }
-        MAXQ++;
+        queues[MAXQ++] = NULL;
 	}
 
 	if(size <= 0){
         ERRBUF2("create_queue: invalid size (%d)", size);
+		QPROBE3(error, 0, QE_INVALIDSIZE, "create_queue");
 		return(QE_INVALIDSIZE);
 	}
 
@@ -228,37 +608,99 @@ QTICKET create_queue(int size)
 	if (cur == MAXQ){
         if((queues = (QUEUE **)realloc(queues, (MAXQ + 1) * sizeof(QUEUE *))) == NULL){
             ERRBUF2("create_queue: too many queues (max %d)", MAXQ);
+            QPROBE3(error, 0, QE_TOOMANYQS, "create_queue");
             return(QE_TOOMANYQS);
 		}
-        MAXQ++;
+        queues[MAXQ++] = NULL;
 	}
 
 	/* allocate a new queue */
-	if ((queues[cur] = malloc(sizeof(QUEUE))) == NULL){
-		ERRBUF("create_queue: malloc: no more memory");
+	if ((q = qalloc(size, "create_queue")) == NULL){
+		QPROBE3(error, 0, QE_NOROOM, "create_queue");
 		return(QE_NOROOM);
 	}
 
 	/* generate ticket */
 	if (QE_ISERROR(tkt = qtktref(cur))){
 		/* error in ticket generation -- abend procedure */
-		(void) free(queues[cur]);
-		queues[cur] = NULL;
+		qfree(q);
+		QPROBE3(error, 0, tkt, "create_queue");
 		return(tkt);
 	}
+	q->ticket = tkt;
+	queues[cur] = q;
 
-    // Dynamically allocate memory for the array
-    if ((queues[cur]->que = (QELT *)malloc(size * sizeof(QELT))) == NULL){
-        ERRBUF("create_queue: malloc: no more memory");
-		return(QE_NOROOM);
-    }
-    MAXELT = size;
+	QPROBE2(create, tkt, size);
+	return(tkt);
+}
 
-	/* now initialize queue entry */
-	queues[cur]->head = queues[cur]->count = 0;
-	queues[cur]->ticket = tkt;
+/*
+ * schedulers
+ * A scheduler keeps the queues attached to it that have elements
+ * on its active list, linked through anext; a put that finds its
+ * queue attached but not active links it on the end, and the
+ * scheduler unlinks a queue it finds empty. So the scheduler only
+ * ever looks at queues with something to take, however many are
+ * attached. It serves them by deficit round robin: the queue at
+ * the head of the list is given weight elements' worth of credit
+ * (its deficit), and served until that is spent or it is empty,
+ * then goes to the end of the list; as every element costs the
+ * same, each turn serves weight elements.
+ */
 
-	return(tkt);
+/*
+ * put a queue on the end of its scheduler's active list
+ */
+static void sactivate(QUEUE *q)
+{
+	register QUEUE *s = q->sch;	/* the scheduler */
+
+	q->anext = NULL;
+	if (s->atail != NULL)
+		s->atail->anext = q;
+	else
+		s->ahead = q;
+	s->atail = q;
+	q->active = 1;
+	q->deficit = 0;
+}
+
+/*
+ * take a queue off its scheduler's active list, and detach it
+ * from the scheduler altogether if all is set
+ */
+static void sunlink(QUEUE *q, int all)
+{
+	register QUEUE *s = q->sch;	/* the scheduler */
+	register QUEUE **pp;		/* link pointing at q */
+	register QUEUE *prev = NULL;	/* queue before it */
+
+	if (q->active){
+		for(pp = &s->ahead; *pp != q; pp = &(*pp)->anext)
+			prev = *pp;
+		*pp = q->anext;
+		if (s->atail == q)
+			s->atail = prev;
+		q->anext = NULL;
+		q->active = 0;
+		q->deficit = 0;
+	}
+	if (all)
+		q->sch = NULL;
+}
+#define sdetach(q)	sunlink(q, 1)
+
+/*
+ * number of queues on a scheduler's active list
+ */
+static int sactive(QUEUE *s)
+{
+	register QUEUE *q;	/* queue on it */
+	register int n = 0;	/* how many so far */
+
+	for(q = s->ahead; q != NULL; q = q->anext)
+		n++;
+	return(n);
 }
 
 /*
@@ -275,163 +717,3526 @@ QTICKET create_queue(int size)
 int delete_queue(QTICKET qno)
 {
 	register int cur;	/* index of current queue */
+	register int i;		/* index of a queue attached to it */
 
 	/*
 	 * check that qno refers to an existing queue;
 	 * readref sets error code
 	 */
-	if (QE_ISERROR(cur = readref(qno)))
+	if (QE_ISERROR(cur = readref(qno))){
+		QPROBE3(error, qno, cur, "delete_queue");
 		return(cur);
+	}
 
 	/*
 	 * free the queue and reset the array element
 	 */
-    (void) free(queues[cur]->que);
-	(void) free(queues[cur]);
+	QPROBE2(delete, qno, queues[cur]->count);
+	if (queues[cur]->sch != NULL)
+		sdetach(queues[cur]);
+	if (queues[cur]->kind == QK_SCHED)
+		for(i = 0; i < MAXQ; i++)
+			if (queues[i] != NULL && queues[i]->sch == queues[cur])
+				sdetach(queues[i]);
+	if (queues[cur]->wal != NULL)
+		(void) qwal_close(queues[cur]->wal);
+	if (queues[cur]->sp != NULL)
+		qspill_close(queues[cur]->sp);
+	qfree(queues[cur]);
 	queues[cur] = NULL;
 
 	return(QE_NONE);
 }
 
 /*
- * add an element to an existing queue
+ * refill the ring of a spilling queue from its spill file
  *
- * PARAMETERS:	QTICKET qno	ticket for the queue involved
+ * PARAMETERS:	QUEUE *q	the queue
+ * RETURNED:	int		error code
+ * ERRORS:	QE_NOROOM	spill file can't be read (from
+ *				qspill_refill())
+ * EXCEPTIONS:	none
+ */
+static int spillin(QUEUE *q)
+{
+	register int k;		/* elements moved */
+
+	if (QE_ISERROR(k = qspill_refill(q->sp, q->que, q->size,
+						q->head, &q->count)))
+		return(k);
+#ifdef QLATENCY
+	/* their stay starts over: time in the file is not counted */
+	while(k > 0)
+		q->stamp[(q->head + q->count - k--) % q->size] = clkticks();
+#endif
+	return(QE_NONE);
+}
+
+/*
+ * a queue's count has crossed a watermark (see QWATCH): arm the
+ * other one, and say so; the high one is not looked at again
+ * until the count has fallen to the low one, nor the low one until
+ * it has risen to the high one, so a count that wavers about either
+ * is reported once
+ *
+ * PARAMETERS:	QUEUE *q	the queue
+ * RETURNED:	nothing
+ * EXCEPTIONS:	none
+ */
+static void qwmark(QUEUE *q)
+{
+	if (q->count >= q->wmup){
+		q->wmup = INT_MAX;
+		q->wmdown = q->wmlo;
+		(*q->wmfn)(q->ticket, QWM_HIGH, q->wmarg);
+	}
+	else{
+		q->wmdown = -1;
+		q->wmup = q->wmhi;
+		(*q->wmfn)(q->ticket, QWM_LOW, q->wmarg);
+	}
+}
+
+/*
+ * drop the run of expired elements at the front of a queue with
+ * expiries, all in one step: while expiries rise from head to tail
+ * (as they do when every element gets the same time to live) the
+ * end of the run is found by binary search, otherwise by walking it
+ *
+ * PARAMETERS:	QUEUE *q	the queue (with q->exp set)
+ * RETURNED:	int		error code
+ * ERRORS:	QE_NOROOM	queue is durable and its log can't be
+ *				written (from qwal_append()); those
+ *				logged before that are dropped
+ * EXCEPTIONS:	none
+ */
+#define QEXP(q,i)	((q)->exp[((q)->head + (i)) % (q)->size])
+static int qexpire(QUEUE *q)
+{
+	unsigned long long now;	/* the time */
+	register int lo, hi;	/* the run ends in [lo, hi] */
+	register int mid;	/* middle of that */
+	register int k;		/* elements logged */
+	register int rv = 0;	/* error code */
+	register int ck = 0;	/* 1 if the log wants a checkpoint */
+
+	if (q->count == 0 || q->exp[q->head] > (now = clkns()))
+		return(QE_NONE);
+	if (q->expmono)
+		for(lo = 1, hi = q->count; lo < hi; ){
+			mid = lo + (hi - lo) / 2;
+			if (QEXP(q, mid) <= now)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+	else
+		for(lo = 1; lo < q->count && QEXP(q, lo) <= now; lo++)
+			;
+
+	/* log them as takes, if the queue is durable */
+	if (q->wal != NULL)
+		for(k = 0; k < lo; k++){
+			if (QE_ISERROR(rv = qwal_append(q->wal, QW_TAKE, 0))){
+				lo = k;
+				break;
+			}
+			ck |= rv;
+		}
+	q->head = (q->head + lo) % q->size;
+	if ((q->count -= lo) == 0)
+		q->expmono = 1;
+#ifdef QSTATS
+	q->stats.expired += lo;
+#endif
+	QPUBLISH(q);
+	QWATCH(q);
+	if (ck > 0)
+		(void) qwal_checkpoint(q->wal, q->que, q->size, q->head, q->count);
+	return(QE_ISERROR(rv) ? rv : QE_NONE);
+}
+
+/*
+ * the expiry of an element put now, given its time to live
+ * (0 for ever), and whether expiries still rise along the queue
+ * once it is at the back (at the front if front is set)
+ */
+static unsigned long long qexpiry(QUEUE *q, long ttl, int front)
+{
+	register unsigned long long e;	/* the expiry */
+
+	e = ttl > 0 ? clkns() + ttl * 1000ULL : QNEVER;
+	if (q->count == 0)
+		q->expmono = 1;
+	else if (front ? e > q->exp[q->head] : e < QEXP(q, q->count - 1))
+		q->expmono = 0;
+	return(e);
+}
+
+/*
+ * see whether a take from a queue with a token bucket may go
+ * ahead, by the generic cell rate algorithm: rather than a count
+ * of tokens that would need topping up, the bucket is kept as the
+ * time it will next be full, each token taken pushing that one
+ * interval on, and a take may go ahead unless that time is more
+ * than the bucket holds ahead of now. The caller stores the new
+ * time once it has the element, so a take that fails for want of
+ * one spends nothing
+ *
+ * PARAMETERS:	QUEUE *q	the queue (with q->tbint set)
+ *		const char *who	caller, for qe_errbuf
+ *		unsigned long long *tat	where to put the new time
+ * RETURNED:	int		error code
+ * ERRORS:	QE_NOTYET	the bucket is empty
+ *				(qe_errbuf has descriptive string)
+ * EXCEPTIONS:	none
+ */
+static int qthrottle(QUEUE *q, const char *who, unsigned long long *tat)
+{
+	register unsigned long long now = clkns();	/* the time */
+
+	if (q->tbtat > now + q->tbtol){
+		(void) sprintf(qe_errbuf, "%s: rate limited, no token yet", who);
+		STATINC(q, throttled);
+		return(QE_NOTYET);
+	}
+	*tat = (q->tbtat > now ? q->tbtat : now) + q->tbint;
+	return(QE_NONE);
+}
+
+/*
+ * append an element to a FIFO queue (for put_on_queue and
+ * put_on_queue_ttl, which have checked the ticket and kind)
+ *
+ * PARAMETERS:	QUEUE *q	the queue
  *		int n		element to be appended
+ *		long ttl	its time to live, if the queue has
+ *				expiries
  * RETURNED:	int		error code
- * ERRORS:	QE_BADPARAM	parameter refers to deleted, unallocated,
- *				or invalid queue (from readref()).
- * 		QE_INTINCON	queue is internally inconsistent (from
- *				readref()).
- *		QE_TOOFULL	queue has MAXELT elements and a new one can't
- *				be added
+ * ERRORS:	as put_on_queue
  * EXCEPTIONS:	none
  */
-int put_on_queue(QTICKET qno, int n)
+static int qput(QUEUE *q, int n, long ttl)
 {
-	register int cur;	/* index of current queue */
-	register QUEUE *q;	/* pointer to queue structure */
+	register QTICKET qno = q->ticket;	/* for the probes */
+	register int ck = 0;	/* 1 if the log wants a checkpoint */
 
-	/*
-	 * check that qno refers to an existing queue;
-	 * readref sets error code
-	 */
-	if (QE_ISERROR(cur = readref(qno)))
-		return(cur);
+	(void) qno;		/* only the probes want it */
 
 	/*
 	 * add new element to tail of queue
 	 */
-	if ((q = queues[cur])->count == MAXELT){
+	if (q->sp != NULL && (q->count == q->size || qspill_count(q->sp) > 0)){
+		/* it spills, and the ring is full or older elements are
+		   in the file already: this one goes after them */
+		if (QE_ISERROR(ck = qspill_put(q->sp, n))){
+			QPROBE3(error, qno, ck, "put_on_queue");
+			return(ck);
+		}
+		STATINC(q, enqueued);
+		STATINC(q, spilled);
+		QPROBE3(put, qno, q->count, -1);
+	}
+	else if (q->count == q->size){
 		/* queue is full; give error */
-		ERRBUF2("put_on_queue: queue full (max %d elts)", MAXELT);
+		ERRBUF2("put_on_queue: queue full (max %d elts)", q->size);
+		STATINC(q, full);
+		QPROBE3(error, qno, QE_TOOFULL, "put_on_queue");
 		return(QE_TOOFULL);
 	}
 	else{
+		/* log it first, if the queue is durable */
+		if (q->wal != NULL && QE_ISERROR(ck = qwal_append(q->wal, QW_PUT, n)))
+			return(ck);
 		/* append element to end */
-		q->que[(q->head+q->count)%MAXELT] = n;
+#ifdef QLATENCY
+		q->stamp[(q->head+q->count)%q->size] = clkticks();
+#endif
+		if (q->exp != NULL)
+			q->exp[(q->head+q->count)%q->size] = qexpiry(q, ttl, 0);
+		q->que[(q->head+q->count)%q->size] = n;
 		/* one more in the queue */
 		q->count++;
+		STATINC(q, enqueued);
+		STATHIWAT(q);
+		QPUBLISH(q);
+		QPROBE3(put, qno, q->count, (q->head+q->count-1)%q->size);
+		if (ck > 0)
+			(void) qwal_checkpoint(q->wal, q->que, q->size,
+							q->head, q->count);
+		QWATCH(q);
 	}
 
+	if (q->sch != NULL && !q->active)
+		sactivate(q);
 	return(QE_NONE);
 }
 
 /*
- * take an element off the front of an existing queue
+ * add an element to an existing queue
  *
  * PARAMETERS:	QTICKET qno	ticket for the queue involved
+ *		int n		element to be appended
  * RETURNED:	int		error code
- * ERRORS:	QE_BADPARAM	bogus parameter because:
- *				* parameter refers to deleted, unallocated,
- *				  or invalid queue (from readref())
- *				* pointer points to NULL address for
- *				  returned element
- *				(qe_errbuf has descriptive string)
+ * ERRORS:	QE_BADPARAM	parameter refers to deleted, unallocated,
+ *				or invalid queue (from readref()).
  * 		QE_INTINCON	queue is internally inconsistent (from
  *				readref()).
- *		QE_EMPTY	queue has no elements so none can be retrieved
+ *		QE_TOOFULL	queue has size elements and a new one can't
+ *				be added (and it does not spill)
+ *		QE_NOROOM	queue is durable and its log can't be
+ *				written (from qwal_append()), or it
+ *				spills and its spill file can't be
+ *				written (from qspill_put())
  * EXCEPTIONS:	none
  */
-int take_off_queue(QTICKET qno)
+int put_on_queue(QTICKET qno, int n)
 {
 	register int cur;	/* index of current queue */
 	register QUEUE *q;	/* pointer to queue structure */
-	register int n;		/* index of element to be returned */
 
 	/*
 	 * check that qno refers to an existing queue;
 	 * readref sets error code
 	 */
-	if (QE_ISERROR(cur = readref(qno)))
+	if (QE_ISERROR(cur = readref(qno))){
+		QPROBE3(error, qno, cur, "put_on_queue");
 		return(cur);
-
-	/*
-	 * now pop the element at the head of the queue
-	 */
-	if ((q = queues[cur])->count == 0){
-		/* it's empty */
-		ERRBUF("take_off_queue: queue empty");
-		return(QE_EMPTY);
-	}
-	else{
-		/* get the last element */
-		q->count--;
-		n = q->head;
-		q->head = (q->head + 1) % MAXELT;
-		return(q->que[n]);
 	}
 
-	/* should never reach here (sure ...) */
-	ERRBUF("take_off_queue: reached end of routine despite no path there");
-	return(QE_INTINCON);
-
+	q = queues[cur];
+	if (q->kind != QK_FIFO){
+		ERRBUF("put_on_queue: not a FIFO queue");
+		QPROBE3(error, qno, QE_WRONGKIND, "put_on_queue");
+		return(QE_WRONGKIND);
+	}
+	return(qput(q, n, q->ttl));
 }
 
-/********** D E B U G     D E B U G     D E B U G      D E B U G ************/
-#ifdef DEBUG
 /*
- * list elements of queue to stdout (DEBUGGING ONLY)
+ * add an element to an existing queue that has expiries (see
+ * queue_set_ttl()), with its own time to live
  *
- * PARAMETERS:	QTICKET qno	ticket for the queue to be listed
+ * PARAMETERS:	QTICKET qno	ticket for the queue involved
+ *		int n		element to be appended
+ *		long ttl	microseconds until it expires (0 for
+ *				never)
  * RETURNED:	int		error code
  * ERRORS:	QE_BADPARAM	parameter refers to deleted, unallocated,
- *				or invalid queue (from readref())
+ *				or invalid queue (from readref()), or
+ *				ttl is negative
  * 		QE_INTINCON	queue is internally inconsistent (from
  *				readref()).
+ *		QE_WRONGKIND	queue has no expiries
+ *		QE_TOOFULL	queue has size elements and a new one can't
+ *				be added
+ *		QE_NOROOM	queue is durable and its log can't be
+ *				written (from qwal_append())
  * EXCEPTIONS:	none
  */
-int list_queue(QTICKET qno)
+int put_on_queue_ttl(QTICKET qno, int n, long ttl)
 {
 	register int cur;	/* index of current queue */
-	register int l;		/* index of queue elements */
-	register int m;		/* index of last element in queue */
 	register QUEUE *q;	/* pointer to queue structure */
 
 	/*
 	 * check that qno refers to an existing queue;
 	 * readref sets error code
 	 */
-	if (QE_ISERROR(cur = readref(qno)))
+	if (QE_ISERROR(cur = readref(qno))){
+		QPROBE3(error, qno, cur, "put_on_queue_ttl");
 		return(cur);
+	}
 
-	/*
-	 * list the queue's contents
-	 */
-	/* print header (queue index and nonce) */
 	q = queues[cur];
-	printf("queue (index=%u, nonce=%u, count=%d, start=%d): ",
-				cur, qno&0xffff, q->count, q->head);
-	/* print the queue */
-	if ((l = q->head) != EMPTY){
-		m = (q->head + q->count) % MAXELT;
-		do{
-			printf("%d ", q->que[l]);
-			l = (l + 1) % MAXELT;
-		} while(l != m);
-	}
-	putchar('\n');
-
-	return(QE_NONE);
+	if (q->exp == NULL){
+		ERRBUF("put_on_queue_ttl: queue has no expiries");
+		QPROBE3(error, qno, QE_WRONGKIND, "put_on_queue_ttl");
+		return(QE_WRONGKIND);
+	}
+	if (ttl < 0){
+		ERRBUF2("put_on_queue_ttl: invalid ttl (%ld)", ttl);
+		QPROBE3(error, qno, QE_BADPARAM, "put_on_queue_ttl");
+		return(QE_BADPARAM);
+	}
+	return(qput(q, n, ttl));
 }
+
+
+/*
+ * priority queues
+ * The heap is an array of entries with the root at heap[0] and
+ * the children of heap[i] at heap[d*i+1] .. heap[d*i+d]. A d of 4
+ * makes the heap half as deep as a binary one, and the d children
+ * compared at each level of a take lie side by side; the array
+ * starts d-1 entries into a cache-line-aligned block, so each
+ * family of children starts a multiple of d entries in, and for
+ * d of 2, 4 or 8 (which divide the 8 entries of a line) fills part
+ * of one cache line rather than straddling two; for other d some
+ * families do straddle. Entries move into the hole left by a put or
+ * take instead of being swapped, so each level costs one copy.
+ * Elements of equal priority come off in no particular order.
+ */
+
+/*
+ * move an entry up from the hole at the end of the heap to where
+ * it belongs
+ *
+ * PARAMETERS:	QUEUE *q	the queue (count not yet incremented)
+ *		int n		element to insert
+ *		int prio	its priority
+ * RETURNED:	int		index of the entry in the heap
+ * EXCEPTIONS:	none
+ */
+static int hpush(QUEUE *q, int n, int prio)
+{
+	register struct qhent *h = q->heap;	/* the heap */
+	register int i;				/* the hole */
+	register int p;				/* its parent */
+
+	for(i = q->count; i > 0 && h[p = (i - 1) / q->arity].prio > prio; i = p){
+		h[i] = h[p];
+#ifdef QLATENCY
+		q->stamp[i] = q->stamp[p];
 #endif
+	}
+	h[i].prio = prio;
+	h[i].elt = n;
+#ifdef QLATENCY
+	q->stamp[i] = clkticks();
+#endif
+	return(i);
+}
+
+/*
+ * fill the hole the root left by moving the last entry down from
+ * the root to where it belongs
+ *
+ * PARAMETERS:	QUEUE *q	the queue (count already decremented,
+ *				so the last entry is heap[count])
+ * RETURNED:	nothing
+ * EXCEPTIONS:	none
+ */
+static void hpop(QUEUE *q)
+{
+	register struct qhent *h = q->heap;	/* the heap */
+	register int i = 0;			/* the hole */
+	register int c;				/* its first child */
+	register int m;				/* its least child */
+	register int e;				/* one past its last child */
+	struct qhent last;			/* entry being placed */
+#ifdef QLATENCY
+	unsigned long long lstamp = q->stamp[q->count];
+#endif
+
+	last = h[q->count];
+	while((c = i * q->arity + 1) < q->count){
+		e = c + q->arity < q->count ? c + q->arity : q->count;
+		for(m = c++; c < e; c++)
+			if (h[c].prio < h[m].prio)
+				m = c;
+		if (h[m].prio >= last.prio)
+			break;
+		h[i] = h[m];
+#ifdef QLATENCY
+		q->stamp[i] = q->stamp[m];
+#endif
+		i = m;
+	}
+	h[i] = last;
+#ifdef QLATENCY
+	q->stamp[i] = lstamp;
+#endif
+}
+
+/*
+ * create a new priority queue: put_on_prio_queue gives each element
+ * a priority, and take_off_queue returns the one of least priority
+ * (put_on_queue is refused)
+ *
+ * PARAMETERS:	int size	maximum size of the queue
+ *		int arity	children per heap node, 2 to 8 (0 for 4)
+ * RETURNED:	QTICKET		token (if > 0); error number (if < 0)
+ * ERRORS:	QE_BADPARAM	arity out of range
+ *		QE_NOROOM	no memory for the heap
+ *		(and those of create_queue())
+ *				(qe_errbuf has descriptive string)
+ * EXCEPTIONS:	none
+ */
+QTICKET create_prio_queue(int size, int arity)
+{
+	register QUEUE *q;	/* new queue */
+	register int tkt;	/* its ticket */
+	void *p;		/* the aligned block for the heap */
+
+	if (arity == 0)
+		arity = QHARITY;
+	if (arity < 2 || arity > QHMAXAR){
+		ERRBUF3("create_prio_queue: arity %d not in 2 .. %d", arity, QHMAXAR);
+		return(QE_BADPARAM);
+	}
+	if (QE_ISERROR(tkt = create_queue(size)))
+		return(tkt);
+	q = queues[readref(tkt)];
+
+	/* the heap takes the place of the ring */
+	if (posix_memalign(&p, QLINE, (size + arity - 1) * sizeof(struct qhent)) != 0){
+		ERRBUF("create_prio_queue: malloc: no more memory");
+		(void) delete_queue(tkt);
+		return(QE_NOROOM);
+	}
+	(void) free(q->que);
+	q->que = NULL;
+	q->heap = (struct qhent *) p + (arity - 1);
+	q->arity = arity;
+	q->kind = QK_PRIO;
+
+	return(tkt);
+}
+
+/*
+ * create a new lane queue: a FIFO ring (a lane) for each of a
+ * few priorities, 0 the most urgent. put_on_prio_queue appends
+ * an element to the lane of its priority, and take_off_queue
+ * takes from the first lane with anything in it, found in one
+ * instruction as the lowest bit set in a mask of non-empty lanes;
+ * so elements of one priority stay in order, and both cost the
+ * same however many lanes there are (put_on_queue is refused).
+ * The lanes are cut from one ring of nlanes * size elements.
+ *
+ * PARAMETERS:	int size	maximum size of each lane
+ *		int nlanes	number of lanes, 1 to 32
+ * RETURNED:	QTICKET		token (if > 0); error number (if < 0)
+ * ERRORS:	QE_BADPARAM	nlanes out of range
+ *		QE_INVALIDSIZE	invalid size, or too big for that many
+ *				lanes
+ *		QE_NOROOM	no memory for the lanes
+ *		(and those of create_queue())
+ *				(qe_errbuf has descriptive string)
+ * EXCEPTIONS:	none
+ */
+QTICKET create_lane_queue(int size, int nlanes)
+{
+	register QUEUE *q;	/* new queue */
+	register int tkt;	/* its ticket */
+
+	if (nlanes < 1 || nlanes > QLMAX){
+		ERRBUF3("create_lane_queue: %d lanes not in 1 .. %d", nlanes, QLMAX);
+		return(QE_BADPARAM);
+	}
+	if (size <= 0 || size > 0x7fffffff / nlanes){
+		ERRBUF2("create_lane_queue: invalid size (%d)", size);
+		return(QE_INVALIDSIZE);
+	}
+	if (QE_ISERROR(tkt = create_queue(size * nlanes)))
+		return(tkt);
+	q = queues[readref(tkt)];
+
+	if ((q->lanes = calloc(nlanes, sizeof(struct qlane))) == NULL){
+		ERRBUF("create_lane_queue: malloc: no more memory");
+		(void) delete_queue(tkt);
+		return(QE_NOROOM);
+	}
+	q->nlanes = nlanes;
+	q->lsize = size;
+	q->kind = QK_LANES;
+
+	return(tkt);
+}
+
+/*
+ * add an element to an existing priority or lane queue
+ *
+ * PARAMETERS:	QTICKET qno	ticket for the queue involved
+ *		int n		element to be added
+ *		int prio	its priority (least comes off first);
+ *				for a lane queue, its lane
+ * RETURNED:	int		error code
+ * ERRORS:	QE_BADTICKET	parameter refers to deleted, unallocated,
+ *				or invalid queue (from readref()).
+ * 		QE_INTINCON	queue is internally inconsistent (from
+ *				readref()).
+ *		QE_WRONGKIND	not a priority or lane queue
+ *		QE_BADPARAM	no lane of that priority
+ *		QE_TOOFULL	queue (or lane) is full and a new element
+ *				can't be added
+ * EXCEPTIONS:	none
+ */
+int put_on_prio_queue(QTICKET qno, int n, int prio)
+{
+	register int cur;	/* index of current queue */
+	register QUEUE *q;	/* pointer to queue structure */
+	register int i;		/* where the element went */
+
+	/*
+	 * check that qno refers to an existing queue;
+	 * readref sets error code
+	 */
+	if (QE_ISERROR(cur = readref(qno))){
+		QPROBE3(error, qno, cur, "put_on_prio_queue");
+		return(cur);
+	}
+
+	q = queues[cur];
+	if (q->kind != QK_PRIO && q->kind != QK_LANES){
+		ERRBUF("put_on_prio_queue: not a priority or lane queue");
+		QPROBE3(error, qno, QE_WRONGKIND, "put_on_prio_queue");
+		return(QE_WRONGKIND);
+	}
+	if (q->kind == QK_LANES && (prio < 0 || prio >= q->nlanes)){
+		ERRBUF3("put_on_prio_queue: no lane %d (%d lanes)", prio, q->nlanes);
+		QPROBE3(error, qno, QE_BADPARAM, "put_on_prio_queue");
+		return(QE_BADPARAM);
+	}
+	if (q->kind == QK_LANES ? q->lanes[prio].count == q->lsize
+						: q->count == q->size){
+		/* queue is full; give error */
+		ERRBUF2("put_on_prio_queue: queue full (max %d elts)",
+				q->kind == QK_LANES ? q->lsize : q->size);
+		STATINC(q, full);
+		QPROBE3(error, qno, QE_TOOFULL, "put_on_prio_queue");
+		return(QE_TOOFULL);
+	}
+
+	if (q->kind == QK_LANES){
+		/* append to the tail of the lane, and mark it non-empty */
+		i = prio * q->lsize +
+			(q->lanes[prio].head + q->lanes[prio].count) % q->lsize;
+		q->que[i] = n;
+#ifdef QLATENCY
+		q->stamp[i] = clkticks();
+#endif
+		q->lanes[prio].count++;
+		q->lmask |= 1U << prio;
+	}
+	else
+		i = hpush(q, n, prio);
+	q->count++;
+	STATINC(q, enqueued);
+	STATHIWAT(q);
+	QPROBE3(put, qno, q->count, i);
+	(void) i;		/* only the probe wants it */
+	QWATCH(q);
+	if (q->sch != NULL && !q->active)
+		sactivate(q);
+	return(QE_NONE);
+}
+
+/*
+ * take an element off the front of an existing queue; for a
+ * priority queue, the front is the element of least priority, for
+ * a lane queue, the head of the most urgent non-empty lane, and
+ * for a delay queue, the first element to become ready (if it has);
+ * expired elements (see queue_set_ttl()) are dropped on the way,
+ * and a queue with a token bucket spends a token on the element
+ *
+ * PARAMETERS:	QTICKET qno	ticket for the queue involved
+ * RETURNED:	int		error code
+ * ERRORS:	QE_BADPARAM	bogus parameter because:
+ *				* parameter refers to deleted, unallocated,
+ *				  or invalid queue (from readref())
+ *				* pointer points to NULL address for
+ *				  returned element
+ *				(qe_errbuf has descriptive string)
+ * 		QE_INTINCON	queue is internally inconsistent (from
+ *				readref()).
+ *		QE_WRONGKIND	queue is a deque, or broadcast, sharded
+ *				or partitioned, or a scheduler
+ *		QE_EMPTY	queue has no elements so none can be retrieved
+ *		QE_NOTYET	delay queue has no element ready yet,
+ *				or the queue's token bucket is empty
+ *				(see queue_set_rate())
+ *		QE_NOROOM	queue is durable and its log can't be
+ *				written (from qwal_append()), or it
+ *				spills and its spill file can't be read
+ *				(from qspill_refill())
+ * EXCEPTIONS:	none
+ */
+int take_off_queue(QTICKET qno)
+{
+	register int cur;	/* index of current queue */
+	register QUEUE *q;	/* pointer to queue structure */
+	register int n;		/* index of element to be returned */
+	register int ck = 0;	/* 1 if the log wants a checkpoint */
+	int elt;		/* the element */
+	register struct qlane *l = NULL;	/* lane it comes from */
+	unsigned long long tat = 0;	/* token bucket time, once taken from */
+
+	/*
+	 * check that qno refers to an existing queue;
+	 * readref sets error code
+	 */
+	if (QE_ISERROR(cur = readref(qno))){
+		QPROBE3(error, qno, cur, "take_off_queue");
+		return(cur);
+	}
+
+	/*
+	 * now pop the element at the head of the queue; a spilling
+	 * queue whose ring has run dry (because an earlier refill
+	 * failed) tries again first, and one with expiries drops
+	 * the expired elements at the front first
+	 */
+	q = queues[cur];
+	if (QOWNCALLS(q)){
+		ERRBUF("take_off_queue: this kind of queue has calls of its own");
+		QPROBE3(error, qno, QE_WRONGKIND, "take_off_queue");
+		return(QE_WRONGKIND);
+	}
+	if (q->exp != NULL && QE_ISERROR(ck = qexpire(q))){
+		QPROBE3(error, qno, ck, "take_off_queue");
+		return(ck);
+	}
+	if (q->count == 0 && q->sp != NULL && qspill_count(q->sp) > 0 &&
+						QE_ISERROR(ck = spillin(q))){
+		QPROBE3(error, qno, ck, "take_off_queue");
+		return(ck);
+	}
+	if (q->count == 0){
+		/* it's empty */
+		ERRBUF("take_off_queue: queue empty");
+		STATINC(q, empty);
+		QPROBE3(error, qno, QE_EMPTY, "take_off_queue");
+		return(QE_EMPTY);
+	}
+	if (q->tbint != 0 &&
+	    QE_ISERROR(ck = qthrottle(q, "take_off_queue", &tat))){
+		QPROBE3(error, qno, ck, "take_off_queue");
+		return(ck);
+	}
+	if (q->kind == QK_DELAY){
+		/* only an element whose time has come */
+		if (QE_ISERROR(ck = qtw_take(q->tw, clkns(), 1, &elt))){
+			QPROBE3(error, qno, ck, "take_off_queue");
+			return(ck);
+		}
+		if (q->tbint != 0)
+			q->tbtat = tat;
+		q->count--;
+		STATINC(q, dequeued);
+		QPROBE3(take, qno, q->count, -1);
+		QWATCH(q);
+		return(elt);
+	}
+	else{
+		/* log it first, if the queue is durable */
+		if (q->wal != NULL && QE_ISERROR(ck = qwal_append(q->wal, QW_TAKE, 0)))
+			return(ck);
+		if (q->tbint != 0)
+			q->tbtat = tat;
+		/* get the last element */
+		q->count--;
+		STATINC(q, dequeued);
+		n = q->head;
+		if (q->kind == QK_LANES){
+			/* the first non-empty lane is the lowest bit set */
+			l = &q->lanes[__builtin_ctz(q->lmask)];
+			n = (l - q->lanes) * q->lsize + l->head;
+		}
+#ifdef QLATENCY
+		lstay(q, n);
+#endif
+		if (q->kind == QK_PRIO){
+			/* the root; the last entry fills the hole */
+			elt = q->heap[0].elt;
+			hpop(q);
+		}
+		else if (q->kind == QK_LANES){
+			elt = q->que[n];
+			l->head = (l->head + 1) % q->lsize;
+			if (--l->count == 0)
+				q->lmask &= ~(1U << (l - q->lanes));
+		}
+		else{
+			elt = q->que[n];
+			q->head = (q->head + 1) % q->size;
+		}
+		QPUBLISH(q);
+		QPROBE3(take, qno, q->count, n);
+		if (ck > 0)
+			(void) qwal_checkpoint(q->wal, q->que, q->size,
+							q->head, q->count);
+		/*
+		 * once the ring is half empty, top it up from the spill
+		 * file, so elements come back in large runs; if that
+		 * fails, the next take tries again
+		 */
+		if (q->sp != NULL && q->count <= q->size / 2 &&
+						qspill_count(q->sp) > 0)
+			(void) spillin(q);
+		QWATCH(q);
+		return(elt);
+	}
+
+	/* should never reach here (sure ...) */
+	ERRBUF("take_off_queue: reached end of routine despite no path there");
+	return(QE_INTINCON);
+
+}
+
+/*
+ * create a new delay queue: put_on_delay_queue gives each element
+ * a delay, and take_off_queue returns only elements whose delay
+ * is up, first the one that became ready first, and fails with
+ * QE_NOTYET while none has. The elements wait in a hierarchical
+ * timing wheel (see qtwheel.c), so putting one and moving it along
+ * take constant time however many are waiting; delays are rounded
+ * up to whole ticks, so an element is never ready early but may
+ * be up to a tick late (put_on_queue is refused).
+ *
+ * PARAMETERS:	int size	maximum size of the queue
+ *		long tick	wheel tick, in microseconds (0 for 1000)
+ * RETURNED:	QTICKET		token (if > 0); error number (if < 0)
+ * ERRORS:	QE_BADPARAM	tick is negative
+ *		QE_NOROOM	no memory for the wheel
+ *		(and those of create_queue())
+ *				(qe_errbuf has descriptive string)
+ * EXCEPTIONS:	none
+ */
+QTICKET create_delay_queue(int size, long tick)
+{
+	register QUEUE *q;	/* new queue */
+	register int tkt;	/* its ticket */
+	register int rv;	/* error code */
+	struct qtwheel *w;	/* the wheel */
+
+	if (tick < 0){
+		ERRBUF2("create_delay_queue: invalid tick (%ld)", tick);
+		return(QE_BADPARAM);
+	}
+	if (tick == 0)
+		tick = QDTICK;
+	if (QE_ISERROR(tkt = create_queue(size)))
+		return(tkt);
+	q = queues[readref(tkt)];
+
+	/* the wheel takes the place of the ring */
+	if (QE_ISERROR(rv = qtw_open(size, clkns(), tick * 1000ULL, &w))){
+		(void) delete_queue(tkt);
+		return(rv);
+	}
+	(void) free(q->que);
+	q->que = NULL;
+	q->tw = w;
+	q->kind = QK_DELAY;
+
+	return(tkt);
+}
+
+/*
+ * add an element to an existing delay queue
+ *
+ * PARAMETERS:	QTICKET qno	ticket for the queue involved
+ *		int n		element to be added
+ *		long delay	microseconds until it is ready
+ * RETURNED:	int		error code
+ * ERRORS:	QE_BADTICKET	parameter refers to deleted, unallocated,
+ *				or invalid queue (from readref()).
+ * 		QE_INTINCON	queue is internally inconsistent (from
+ *				readref()).
+ *		QE_WRONGKIND	not a delay queue
+ *		QE_BADPARAM	delay is negative
+ *		QE_TOOFULL	queue has size elements and a new one can't
+ *				be added
+ * EXCEPTIONS:	none
+ */
+int put_on_delay_queue(QTICKET qno, int n, long delay)
+{
+	register int cur;	/* index of current queue */
+	register QUEUE *q;	/* pointer to queue structure */
+
+	/*
+	 * check that qno refers to an existing queue;
+	 * readref sets error code
+	 */
+	if (QE_ISERROR(cur = readref(qno))){
+		QPROBE3(error, qno, cur, "put_on_delay_queue");
+		return(cur);
+	}
+
+	q = queues[cur];
+	if (q->kind != QK_DELAY){
+		ERRBUF("put_on_delay_queue: not a delay queue");
+		QPROBE3(error, qno, QE_WRONGKIND, "put_on_delay_queue");
+		return(QE_WRONGKIND);
+	}
+	if (delay < 0){
+		ERRBUF2("put_on_delay_queue: invalid delay (%ld)", delay);
+		QPROBE3(error, qno, QE_BADPARAM, "put_on_delay_queue");
+		return(QE_BADPARAM);
+	}
+	if (q->count == q->size){
+		/* queue is full; give error */
+		ERRBUF2("put_on_delay_queue: queue full (max %d elts)", q->size);
+		STATINC(q, full);
+		QPROBE3(error, qno, QE_TOOFULL, "put_on_delay_queue");
+		return(QE_TOOFULL);
+	}
+
+	qtw_put(q->tw, n, clkns() + delay * 1000ULL);
+	q->count++;
+	STATINC(q, enqueued);
+	STATHIWAT(q);
+	QPROBE3(put, qno, q->count, -1);
+	QWATCH(q);
+	return(QE_NONE);
+}
+
+/*
+ * create a new work-stealing deque (see qdeque.c): its owner thread
+ * pushes and pops elements at one end with deque_push and
+ * deque_pop, newest first, and other threads steal from the other
+ * end with deque_steal, oldest first. Unlike the rest of the
+ * library, those three may be called by many threads at once, as
+ * long as no queue is created or deleted meanwhile: so create the
+ * deques before starting the threads, and delete them after.
+ * Nothing else applies to a deque, and no statistics or latencies
+ * are kept for it.
+ *
+ * PARAMETERS:	int size	maximum size of the deque (rounded up
+ *				to a power of two)
+ * RETURNED:	QTICKET		token (if > 0); error number (if < 0)
+ * ERRORS:	QE_INVALIDSIZE	invalid size
+ *		QE_NOROOM	no memory for the deque
+ *		(and those of create_queue())
+ *				(qe_errbuf has descriptive string)
+ * EXCEPTIONS:	none
+ */
+QTICKET create_deque(int size)
+{
+	register QUEUE *q;	/* new queue */
+	register int tkt;	/* its ticket */
+	register int rv;	/* error code */
+	struct qdeque *d;	/* the deque */
+
+	if (QE_ISERROR(rv = qdeque_open(size, &d)))
+		return(rv);
+	if (QE_ISERROR(tkt = create_queue(1))){
+		qdeque_close(d);
+		return(tkt);
+	}
+	q = queues[readref(tkt)];
+	q->dq = d;
+	q->size = qdeque_size(d);
+	q->kind = QK_DEQUE;
+
+	return(tkt);
+}
+
+/*
+ * check a ticket refers to a deque and turn it into an index
+ *
+ * PARAMETERS:	QTICKET qno	ticket for the deque
+ *		char *who	name of caller, for the error message
+ * RETURNED:	int		index from the ticket, or error code
+ * ERRORS:	QE_WRONGKIND	not a deque
+ *		(and those of readref())
+ * EXCEPTIONS:	none
+ */
+static int dqref(QTICKET qno, const char *who)
+{
+	register int cur;	/* index of current queue */
+
+	if (QE_ISERROR(cur = readref(qno))){
+		QPROBE3(error, qno, cur, who);
+		return(cur);
+	}
+	if (queues[cur]->kind != QK_DEQUE){
+		(void) sprintf(qe_errbuf, "%s: not a deque", who);
+		QPROBE3(error, qno, QE_WRONGKIND, who);
+		return(QE_WRONGKIND);
+	}
+	return(cur);
+}
+
+/*
+ * push an element on a deque; its owner only
+ *
+ * PARAMETERS:	QTICKET qno	ticket for the deque
+ *		int n		element to push
+ * RETURNED:	int		error code
+ * ERRORS:	QE_BADTICKET	parameter refers to deleted, unallocated,
+ *				or invalid queue (from readref()).
+ * 		QE_INTINCON	queue is internally inconsistent (from
+ *				readref()).
+ *		QE_WRONGKIND	not a deque
+ *		QE_TOOFULL	deque is full (from qdeque_push())
+ * EXCEPTIONS:	none
+ */
+int deque_push(QTICKET qno, int n)
+{
+	register int cur;	/* index of the deque */
+
+	if (QE_ISERROR(cur = dqref(qno, "deque_push")))
+		return(cur);
+	return(qdeque_push(queues[cur]->dq, n));
+}
+
+/*
+ * pop the element pushed last on a deque; its owner only
+ *
+ * PARAMETERS:	QTICKET qno	ticket for the deque
+ * RETURNED:	int		element or error code
+ * ERRORS:	QE_BADTICKET	parameter refers to deleted, unallocated,
+ *				or invalid queue (from readref()).
+ * 		QE_INTINCON	queue is internally inconsistent (from
+ *				readref()).
+ *		QE_WRONGKIND	not a deque
+ *		QE_EMPTY	deque is empty (from qdeque_pop())
+ * EXCEPTIONS:	none
+ */
+int deque_pop(QTICKET qno)
+{
+	register int cur;	/* index of the deque */
+	int n;			/* the element */
+
+	if (QE_ISERROR(cur = dqref(qno, "deque_pop")))
+		return(cur);
+	if (QE_ISERROR(cur = qdeque_pop(queues[cur]->dq, &n)))
+		return(cur);
+	return(n);
+}
+
+/*
+ * steal the element pushed first on a deque; any thread
+ *
+ * PARAMETERS:	QTICKET qno	ticket for the deque
+ * RETURNED:	int		element or error code
+ * ERRORS:	QE_BADTICKET	parameter refers to deleted, unallocated,
+ *				or invalid queue (from readref()).
+ * 		QE_INTINCON	queue is internally inconsistent (from
+ *				readref()).
+ *		QE_WRONGKIND	not a deque
+ *		QE_EMPTY	deque is empty (from qdeque_steal())
+ * EXCEPTIONS:	none
+ */
+int deque_steal(QTICKET qno)
+{
+	register int cur;	/* index of the deque */
+	int n;			/* the element */
+
+	if (QE_ISERROR(cur = dqref(qno, "deque_steal")))
+		return(cur);
+	if (QE_ISERROR(cur = qdeque_steal(queues[cur]->dq, &n)))
+		return(cur);
+	return(n);
+}
+
+/*
+ * create a new broadcast queue (see qbcast.c): one writer thread
+ * puts elements on it with bcast_put, and each subscriber (see
+ * bcast_subscribe) takes every element put after it subscribed
+ * with bcast_take, in order, reading them all from the one ring
+ * instead of each from a copy. The writer is held back (bcast_put
+ * fails with QE_TOOFULL) while the slowest subscriber is a whole
+ * ring behind. As with deques, the writer and the subscribers may
+ * each run in a thread of their own, as long as no queue is
+ * created or deleted meanwhile; nothing else applies to a broadcast
+ * queue, and no statistics or latencies are kept for it.
+ *
+ * PARAMETERS:	int size	maximum size of the queue (rounded up
+ *				to a power of two)
+ *		int nsub	most subscribers at once
+ * RETURNED:	QTICKET		token (if > 0); error number (if < 0)
+ * ERRORS:	QE_INVALIDSIZE	invalid size or number of subscribers
+ *		QE_NOROOM	no memory for the ring
+ *		(and those of create_queue())
+ *				(qe_errbuf has descriptive string)
+ * EXCEPTIONS:	none
+ */
+QTICKET create_bcast_queue(int size, int nsub)
+{
+	register QUEUE *q;	/* new queue */
+	register int tkt;	/* its ticket */
+	register int rv;	/* error code */
+	struct qbcast *b;	/* the ring */
+
+	if (QE_ISERROR(rv = qbcast_open(size, nsub, &b)))
+		return(rv);
+	if (QE_ISERROR(tkt = create_queue(1))){
+		qbcast_close(b);
+		return(tkt);
+	}
+	q = queues[readref(tkt)];
+	q->bc = b;
+	q->size = qbcast_size(b);
+	q->kind = QK_BCAST;
+
+	return(tkt);
+}
+
+/*
+ * check a ticket refers to a broadcast queue and turn it into
+ * its ring
+ *
+ * PARAMETERS:	QTICKET qno	ticket for the queue
+ *		char *who	name of caller, for the error message
+ *		struct qbcast **bp	where to put the ring
+ * RETURNED:	int		error code
+ * ERRORS:	QE_WRONGKIND	not a broadcast queue
+ *		(and those of readref())
+ * EXCEPTIONS:	none
+ */
+static int bcref(QTICKET qno, const char *who, struct qbcast **bp)
+{
+	register int cur;	/* index of current queue */
+
+	if (QE_ISERROR(cur = readref(qno))){
+		QPROBE3(error, qno, cur, who);
+		return(cur);
+	}
+	if (queues[cur]->kind != QK_BCAST){
+		(void) sprintf(qe_errbuf, "%s: not a broadcast queue", who);
+		QPROBE3(error, qno, QE_WRONGKIND, who);
+		return(QE_WRONGKIND);
+	}
+	*bp = queues[cur]->bc;
+	return(QE_NONE);
+}
+
+/*
+ * add a subscriber to a broadcast queue; it takes the elements put
+ * from now on
+ *
+ * PARAMETERS:	QTICKET qno	ticket for the queue
+ * RETURNED:	int		subscriber number (>= 0) or error code
+ * ERRORS:	QE_BADTICKET	parameter refers to deleted, unallocated,
+ *				or invalid queue (from readref()).
+ * 		QE_INTINCON	queue is internally inconsistent (from
+ *				readref()).
+ *		QE_WRONGKIND	not a broadcast queue
+ *		QE_TOOMANYQS	queue has its most subscribers already
+ *				(from qbcast_subscribe())
+ * EXCEPTIONS:	none
+ */
+int bcast_subscribe(QTICKET qno)
+{
+	register int rv;	/* error code */
+	struct qbcast *b;	/* the ring */
+
+	if (QE_ISERROR(rv = bcref(qno, "bcast_subscribe", &b)))
+		return(rv);
+	return(qbcast_subscribe(b));
+}
+
+/*
+ * drop a subscriber from a broadcast queue, so it holds the writer
+ * back no more; the subscriber must not be taking meanwhile
+ *
+ * PARAMETERS:	QTICKET qno	ticket for the queue
+ *		int sub		the subscriber
+ * RETURNED:	int		error code
+ * ERRORS:	QE_BADTICKET	parameter refers to deleted, unallocated,
+ *				or invalid queue (from readref()).
+ * 		QE_INTINCON	queue is internally inconsistent (from
+ *				readref()).
+ *		QE_WRONGKIND	not a broadcast queue
+ *		QE_BADPARAM	no such subscriber (from
+ *				qbcast_unsubscribe())
+ * EXCEPTIONS:	none
+ */
+int bcast_unsubscribe(QTICKET qno, int sub)
+{
+	register int rv;	/* error code */
+	struct qbcast *b;	/* the ring */
+
+	if (QE_ISERROR(rv = bcref(qno, "bcast_unsubscribe", &b)))
+		return(rv);
+	return(qbcast_unsubscribe(b, sub));
+}
+
+/*
+ * put an element on a broadcast queue; the writer only
+ *
+ * PARAMETERS:	QTICKET qno	ticket for the queue
+ *		int n		element to put
+ * RETURNED:	int		error code
+ * ERRORS:	QE_BADTICKET	parameter refers to deleted, unallocated,
+ *				or invalid queue (from readref()).
+ * 		QE_INTINCON	queue is internally inconsistent (from
+ *				readref()).
+ *		QE_WRONGKIND	not a broadcast queue
+ *		QE_TOOFULL	the slowest subscriber is a ring behind
+ *				(from qbcast_put())
+ * EXCEPTIONS:	none
+ */
+int bcast_put(QTICKET qno, int n)
+{
+	register int rv;	/* error code */
+	struct qbcast *b;	/* the ring */
+
+	if (QE_ISERROR(rv = bcref(qno, "bcast_put", &b)))
+		return(rv);
+	return(qbcast_put(b, n));
+}
+
+/*
+ * take the next element for a subscriber of a broadcast queue;
+ * that subscriber only
+ *
+ * PARAMETERS:	QTICKET qno	ticket for the queue
+ *		int sub		the subscriber
+ * RETURNED:	int		element or error code
+ * ERRORS:	QE_BADTICKET	parameter refers to deleted, unallocated,
+ *				or invalid queue (from readref()).
+ * 		QE_INTINCON	queue is internally inconsistent (from
+ *				readref()).
+ *		QE_WRONGKIND	not a broadcast queue
+ *		QE_BADPARAM	no such subscriber (from qbcast_take())
+ *		QE_EMPTY	subscriber has taken every element put
+ *				(from qbcast_take())
+ * EXCEPTIONS:	none
+ */
+int bcast_take(QTICKET qno, int sub)
+{
+	register int rv;	/* error code */
+	struct qbcast *b;	/* the ring */
+	int n;			/* the element */
+
+	if (QE_ISERROR(rv = bcref(qno, "bcast_take", &b)))
+		return(rv);
+	if (QE_ISERROR(rv = qbcast_take(b, sub, &n)))
+		return(rv);
+	return(n);
+}
+
+/*
+ * create a new sharded queue (see qshard.c): a ring per CPU, or
+ * per shard asked for. shard_put puts an element on the shard of
+ * the CPU the caller is on, and shard_take takes from that shard
+ * first and steals from the others when it is empty; so the queue
+ * is not FIFO as a whole. What is promised is that no element is
+ * lost or taken twice, and that elements put from one CPU on to
+ * its own shard come off in the order they were put. When that
+ * shard is full a put goes on the next shard with room, and may
+ * come off before elements put earlier; elements put from
+ * different CPUs, or by a thread that moved between CPUs, likewise
+ * come off in any order. As with deques, any number of threads may
+ * put and take at once, as long as no queue is created or deleted
+ * meanwhile; nothing else applies to a sharded queue, and no
+ * statistics or latencies are kept for it.
+ *
+ * PARAMETERS:	int size	maximum size of the queue (shared out
+ *				among the shards, each rounded up to a
+ *				power of two)
+ *		int nshard	number of shards (0 for one per CPU)
+ * RETURNED:	QTICKET		token (if > 0); error number (if < 0)
+ * ERRORS:	QE_INVALIDSIZE	invalid size or number of shards
+ *		QE_NOROOM	no memory for the shards
+ *		(and those of create_queue())
+ *				(qe_errbuf has descriptive string)
+ * EXCEPTIONS:	none
+ */
+QTICKET create_shard_queue(int size, int nshard)
+{
+	register QUEUE *q;	/* new queue */
+	register int tkt;	/* its ticket */
+	register int rv;	/* error code */
+	struct qshard *s;	/* the shards */
+
+	if (QE_ISERROR(rv = qshard_open(size, nshard, &s)))
+		return(rv);
+	if (QE_ISERROR(tkt = create_queue(1))){
+		qshard_close(s);
+		return(tkt);
+	}
+	q = queues[readref(tkt)];
+	q->sh = s;
+	q->size = qshard_size(s);
+	q->kind = QK_SHARD;
+
+	return(tkt);
+}
+
+/*
+ * check a ticket refers to a sharded queue and turn it into its
+ * shards
+ *
+ * PARAMETERS:	QTICKET qno	ticket for the queue
+ *		char *who	name of caller, for the error message
+ *		struct qshard **sp	where to put the shards
+ * RETURNED:	int		error code
+ * ERRORS:	QE_WRONGKIND	not a sharded queue
+ *		(and those of readref())
+ * EXCEPTIONS:	none
+ */
+static int shref(QTICKET qno, const char *who, struct qshard **sp)
+{
+	register int cur;	/* index of current queue */
+
+	if (QE_ISERROR(cur = readref(qno))){
+		QPROBE3(error, qno, cur, who);
+		return(cur);
+	}
+	if (queues[cur]->kind != QK_SHARD){
+		(void) sprintf(qe_errbuf, "%s: not a sharded queue", who);
+		QPROBE3(error, qno, QE_WRONGKIND, who);
+		return(QE_WRONGKIND);
+	}
+	*sp = queues[cur]->sh;
+	return(QE_NONE);
+}
+
+/*
+ * put an element on a sharded queue; any thread
+ *
+ * PARAMETERS:	QTICKET qno	ticket for the queue
+ *		int n		element to put
+ * RETURNED:	int		error code
+ * ERRORS:	QE_BADTICKET	parameter refers to deleted, unallocated,
+ *				or invalid queue (from readref()).
+ * 		QE_INTINCON	queue is internally inconsistent (from
+ *				readref()).
+ *		QE_WRONGKIND	not a sharded queue
+ *		QE_TOOFULL	every shard is full (from qshard_put())
+ * EXCEPTIONS:	none
+ */
+int shard_put(QTICKET qno, int n)
+{
+	register int rv;	/* error code */
+	struct qshard *s;	/* the shards */
+
+	if (QE_ISERROR(rv = shref(qno, "shard_put", &s)))
+		return(rv);
+	return(qshard_put(s, n));
+}
+
+/*
+ * take an element off a sharded queue; any thread
+ *
+ * PARAMETERS:	QTICKET qno	ticket for the queue
+ * RETURNED:	int		element or error code
+ * ERRORS:	QE_BADTICKET	parameter refers to deleted, unallocated,
+ *				or invalid queue (from readref()).
+ * 		QE_INTINCON	queue is internally inconsistent (from
+ *				readref()).
+ *		QE_WRONGKIND	not a sharded queue
+ *		QE_EMPTY	every shard is empty (from qshard_take())
+ * EXCEPTIONS:	none
+ */
+int shard_take(QTICKET qno)
+{
+	register int rv;	/* error code */
+	struct qshard *s;	/* the shards */
+	int n;			/* the element */
+
+	if (QE_ISERROR(rv = shref(qno, "shard_take", &s)))
+		return(rv);
+	if (QE_ISERROR(rv = qshard_take(s, &n)))
+		return(rv);
+	return(n);
+}
+
+/*
+ * create a new partitioned queue (see qpart.c): put_on_part_queue
+ * gives each element a key, and the key's hash picks the partition,
+ * a FIFO ring, it goes on; so elements with the same key come off
+ * in the order they were put. The partitions are shared out among
+ * the members of a consumer group: member m of a group of g owns
+ * partitions m, m+g, m+2g, ..., and takes from them, and only
+ * them, with part_take, so different keys are consumed in
+ * parallel and each key by one member at a time. One thread may
+ * put while each member takes in a thread of its own, as long as
+ * no queue is created or deleted meanwhile; to change the size of
+ * the group, stop every member first. Nothing else applies to a
+ * partitioned queue, and no statistics or latencies are kept for
+ * it.
+ *
+ * PARAMETERS:	int size	maximum size of each partition
+ *				(rounded up to a power of two)
+ *		int npart	number of partitions
+ * RETURNED:	QTICKET		token (if > 0); error number (if < 0)
+ * ERRORS:	QE_INVALIDSIZE	invalid size or number of partitions
+ *		QE_NOROOM	no memory for the partitions
+ *		(and those of create_queue())
+ *				(qe_errbuf has descriptive string)
+ * EXCEPTIONS:	none
+ */
+QTICKET create_part_queue(int size, int npart)
+{
+	register QUEUE *q;	/* new queue */
+	register int tkt;	/* its ticket */
+	register int rv;	/* error code */
+	struct qpart *t;	/* the partitions */
+
+	if (QE_ISERROR(rv = qpart_open(size, npart, &t)))
+		return(rv);
+	if (QE_ISERROR(tkt = create_queue(1))){
+		qpart_close(t);
+		return(tkt);
+	}
+	q = queues[readref(tkt)];
+	q->pt = t;
+	q->size = qpart_size(t);
+	q->kind = QK_PART;
+
+	return(tkt);
+}
+
+/*
+ * check a ticket refers to a partitioned queue and turn it into
+ * its partitions
+ *
+ * PARAMETERS:	QTICKET qno	ticket for the queue
+ *		char *who	name of caller, for the error message
+ *		struct qpart **tp	where to put the partitions
+ * RETURNED:	int		error code
+ * ERRORS:	QE_WRONGKIND	not a partitioned queue
+ *		(and those of readref())
+ * EXCEPTIONS:	none
+ */
+static int ptref(QTICKET qno, const char *who, struct qpart **tp)
+{
+	register int cur;	/* index of current queue */
+
+	if (QE_ISERROR(cur = readref(qno))){
+		QPROBE3(error, qno, cur, who);
+		return(cur);
+	}
+	if (queues[cur]->kind != QK_PART){
+		(void) sprintf(qe_errbuf, "%s: not a partitioned queue", who);
+		QPROBE3(error, qno, QE_WRONGKIND, who);
+		return(QE_WRONGKIND);
+	}
+	*tp = queues[cur]->pt;
+	return(QE_NONE);
+}
+
+/*
+ * put an element with a key on a partitioned queue; the producer
+ * only
+ *
+ * PARAMETERS:	QTICKET qno	ticket for the queue
+ *		int key		key picking the partition
+ *		int n		element to put
+ * RETURNED:	int		error code
+ * ERRORS:	QE_BADTICKET	parameter refers to deleted, unallocated,
+ *				or invalid queue (from readref()).
+ * 		QE_INTINCON	queue is internally inconsistent (from
+ *				readref()).
+ *		QE_WRONGKIND	not a partitioned queue
+ *		QE_TOOFULL	the key's partition is full (from
+ *				qpart_put())
+ * EXCEPTIONS:	none
+ */
+int put_on_part_queue(QTICKET qno, int key, int n)
+{
+	register int rv;	/* error code */
+	struct qpart *t;	/* the partitions */
+
+	if (QE_ISERROR(rv = ptref(qno, "put_on_part_queue", &t)))
+		return(rv);
+	return(qpart_put(t, key, n));
+}
+
+/*
+ * take an element off a partitioned queue for one member of a
+ * consumer group, from the partitions it owns in turn; that
+ * member only
+ *
+ * PARAMETERS:	QTICKET qno	ticket for the queue
+ *		int member	the member taking (0 .. ngroup-1)
+ *		int ngroup	members in the group
+ * RETURNED:	int		element or error code
+ * ERRORS:	QE_BADTICKET	parameter refers to deleted, unallocated,
+ *				or invalid queue (from readref()).
+ * 		QE_INTINCON	queue is internally inconsistent (from
+ *				readref()).
+ *		QE_WRONGKIND	not a partitioned queue
+ *		QE_BADPARAM	member is not in the group, or owns no
+ *				partition (from qpart_take())
+ *		QE_EMPTY	its partitions are empty (from
+ *				qpart_take())
+ * EXCEPTIONS:	none
+ */
+int part_take(QTICKET qno, int member, int ngroup)
+{
+	register int rv;	/* error code */
+	struct qpart *t;	/* the partitions */
+	int n;			/* the element */
+
+	if (QE_ISERROR(rv = ptref(qno, "part_take", &t)))
+		return(rv);
+	if (QE_ISERROR(rv = qpart_take(t, member, ngroup, &n)))
+		return(rv);
+	return(n);
+}
+
+/*
+ * the partition of a partitioned queue a key goes to, so a caller
+ * can tell which member of a group will see it
+ *
+ * PARAMETERS:	QTICKET qno	ticket for the queue
+ *		int key		the key
+ * RETURNED:	int		partition number or error code
+ * ERRORS:	QE_BADTICKET	parameter refers to deleted, unallocated,
+ *				or invalid queue (from readref()).
+ * 		QE_INTINCON	queue is internally inconsistent (from
+ *				readref()).
+ *		QE_WRONGKIND	not a partitioned queue
+ * EXCEPTIONS:	none
+ */
+int part_of_key(QTICKET qno, int key)
+{
+	register int rv;	/* error code */
+	struct qpart *t;	/* the partitions */
+
+	if (QE_ISERROR(rv = ptref(qno, "part_of_key", &t)))
+		return(rv);
+	return(qpart_of(t, key));
+}
+
+/*
+ * create a new scheduler: it holds no elements itself, but queues
+ * attached to it with sched_attach are served by sched_take, in
+ * deficit round robin order by their weights (see "schedulers"
+ * above), at a cost per element that does not grow with the
+ * number of queues attached. Its count (as queue_dump reports it)
+ * is the number of attached queues with elements. Deleting it
+ * detaches them; deleting an attached queue detaches that one.
+ *
+ * PARAMETERS:	none
+ * RETURNED:	QTICKET		token (if > 0); error number (if < 0)
+ * ERRORS:	those of create_queue()
+ *				(qe_errbuf has descriptive string)
+ * EXCEPTIONS:	none
+ */
+QTICKET create_sched(void)
+{
+	register int tkt;	/* its ticket */
+
+	if (QE_ISERROR(tkt = create_queue(1)))
+		return(tkt);
+	queues[readref(tkt)]->kind = QK_SCHED;
+	return(tkt);
+}
+
+/*
+ * attach a queue to a scheduler, or change its weight if it is
+ * attached already
+ *
+ * PARAMETERS:	QTICKET sno	ticket for the scheduler
+ *		QTICKET qno	ticket for the queue
+ *		int weight	elements it is served per turn
+ * RETURNED:	int		error code
+ * ERRORS:	QE_BADTICKET	either refers to deleted, unallocated,
+ *				or invalid queue (from readref()).
+ * 		QE_INTINCON	either is internally inconsistent (from
+ *				readref()).
+ *		QE_WRONGKIND	sno is not a scheduler, or qno is not a
+ *				FIFO, priority or lane queue
+ *		QE_BADPARAM	weight is not positive, or the queue is
+ *				attached to another scheduler
+ * EXCEPTIONS:	none
+ */
+int sched_attach(QTICKET sno, QTICKET qno, int weight)
+{
+	register int cur;	/* index of current queue */
+	register QUEUE *s;	/* the scheduler */
+	register QUEUE *q;	/* the queue */
+
+	if (QE_ISERROR(cur = readref(sno)))
+		return(cur);
+	s = queues[cur];
+	if (QE_ISERROR(cur = readref(qno)))
+		return(cur);
+	q = queues[cur];
+
+	if (s->kind != QK_SCHED){
+		ERRBUF("sched_attach: not a scheduler");
+		return(QE_WRONGKIND);
+	}
+	if (q->kind != QK_FIFO && q->kind != QK_PRIO && q->kind != QK_LANES){
+		ERRBUF("sched_attach: only FIFO, priority and lane queues attach");
+		return(QE_WRONGKIND);
+	}
+	if (weight <= 0){
+		ERRBUF2("sched_attach: invalid weight (%d)", weight);
+		return(QE_BADPARAM);
+	}
+	if (q->sch != NULL && q->sch != s){
+		ERRBUF("sched_attach: queue attached to another scheduler");
+		return(QE_BADPARAM);
+	}
+
+	q->weight = weight;
+	if (q->sch == NULL){
+		q->sch = s;
+		if (q->count > 0 || (q->sp != NULL && qspill_count(q->sp) > 0))
+			sactivate(q);
+	}
+	return(QE_NONE);
+}
+
+/*
+ * detach a queue from the scheduler it is attached to, if any
+ *
+ * PARAMETERS:	QTICKET qno	ticket for the queue
+ * RETURNED:	int		error code
+ * ERRORS:	QE_BADTICKET	parameter refers to deleted, unallocated,
+ *				or invalid queue (from readref()).
+ * 		QE_INTINCON	queue is internally inconsistent (from
+ *				readref()).
+ * EXCEPTIONS:	none
+ */
+int sched_detach(QTICKET qno)
+{
+	register int cur;	/* index of current queue */
+
+	if (QE_ISERROR(cur = readref(qno)))
+		return(cur);
+	if (queues[cur]->sch != NULL)
+		sdetach(queues[cur]);
+	return(QE_NONE);
+}
+
+/*
+ * take the next element a scheduler serves, from the queue at the
+ * head of its active list, as take_off_queue would take it
+ *
+ * PARAMETERS:	QTICKET sno	ticket for the scheduler
+ *		QTICKET *from	where to put the ticket of the queue
+ *				it came from (NULL if not wanted)
+ * RETURNED:	int		element or error code
+ * ERRORS:	QE_BADTICKET	parameter refers to deleted, unallocated,
+ *				or invalid queue (from readref()).
+ * 		QE_INTINCON	queue is internally inconsistent (from
+ *				readref()).
+ *		QE_WRONGKIND	not a scheduler
+ *		QE_EMPTY	no attached queue has elements
+ *		QE_NOTYET	every attached queue with elements is
+ *				out of tokens (see queue_set_rate())
+ *		(and those of take_off_queue(), but QE_EMPTY)
+ * EXCEPTIONS:	none
+ */
+int sched_take(QTICKET sno, QTICKET *from)
+{
+	register int cur;	/* index of current queue */
+	register QUEUE *s;	/* the scheduler */
+	register QUEUE *q;	/* the queue being served */
+	register int elt;	/* the element */
+	register QUEUE *limited = NULL;	/* first queue out of tokens */
+
+	if (QE_ISERROR(cur = readref(sno))){
+		QPROBE3(error, sno, cur, "sched_take");
+		return(cur);
+	}
+	s = queues[cur];
+	if (s->kind != QK_SCHED){
+		ERRBUF("sched_take: not a scheduler");
+		QPROBE3(error, sno, QE_WRONGKIND, "sched_take");
+		return(QE_WRONGKIND);
+	}
+
+	while((q = s->ahead) != NULL){
+		/* a queue starting its turn gets its credit */
+		if (q->deficit == 0)
+			q->deficit = q->weight;
+		if (QE_ISERROR(elt = take_off_queue(q->ticket))){
+			if (elt == QE_NOTYET){
+				/*
+				 * rate limited: its turn is over; once
+				 * round to it again, all left are limited
+				 */
+				if (q == limited)
+					return(QE_NOTYET);
+				if (limited == NULL)
+					limited = q;
+				q->deficit = 0;
+				if (q->anext != NULL){
+					s->ahead = q->anext;
+					q->anext = NULL;
+					s->atail->anext = q;
+					s->atail = q;
+				}
+				continue;
+			}
+			if (elt != QE_EMPTY)
+				return(elt);
+			/* its elements expired, say; no longer active */
+			sunlink(q, 0);
+			continue;
+		}
+		if (from != NULL)
+			*from = q->ticket;
+		STATINC(s, dequeued);
+		if (q->count == 0 && (q->sp == NULL || qspill_count(q->sp) == 0))
+			sunlink(q, 0);
+		else if (--q->deficit == 0 && q->anext != NULL){
+			/* turn over: to the end of the list */
+			s->ahead = q->anext;
+			q->anext = NULL;
+			s->atail->anext = q;
+			s->atail = q;
+		}
+		return(elt);
+	}
+	ERRBUF("sched_take: no queue has elements");
+	STATINC(s, empty);
+	return(QE_EMPTY);
+}
+
+/*
+ * put an element on the front of an existing queue, so it is the
+ * next one taken (to requeue work that failed, say)
+ *
+ * PARAMETERS:	QTICKET qno	ticket for the queue involved
+ *		int n		element to be prepended
+ * RETURNED:	int		error code
+ * ERRORS:	QE_BADTICKET	parameter refers to deleted, unallocated,
+ *				or invalid queue (from readref()).
+ * 		QE_INTINCON	queue is internally inconsistent (from
+ *				readref()).
+ *		QE_WRONGKIND	not a FIFO queue
+ *		QE_TOOFULL	queue has size elements and a new one can't
+ *				be added (the ring, if it spills)
+ *		QE_NOROOM	queue is durable and its log can't be
+ *				written (from qwal_append())
+ * EXCEPTIONS:	none
+ */
+int queue_push_front(QTICKET qno, int n)
+{
+	register int cur;	/* index of current queue */
+	register QUEUE *q;	/* pointer to queue structure */
+	register int ck = 0;	/* 1 if the log wants a checkpoint */
+
+	/*
+	 * check that qno refers to an existing queue;
+	 * readref sets error code
+	 */
+	if (QE_ISERROR(cur = readref(qno))){
+		QPROBE3(error, qno, cur, "queue_push_front");
+		return(cur);
+	}
+
+	q = queues[cur];
+	if (q->kind != QK_FIFO){
+		ERRBUF("queue_push_front: not a FIFO queue");
+		QPROBE3(error, qno, QE_WRONGKIND, "queue_push_front");
+		return(QE_WRONGKIND);
+	}
+	if (q->count == q->size){
+		/* queue is full; give error */
+		ERRBUF2("queue_push_front: queue full (max %d elts)", q->size);
+		STATINC(q, full);
+		QPROBE3(error, qno, QE_TOOFULL, "queue_push_front");
+		return(QE_TOOFULL);
+	}
+
+	/* log it first, if the queue is durable */
+	if (q->wal != NULL && QE_ISERROR(ck = qwal_append(q->wal, QW_PUSH, n)))
+		return(ck);
+	/* the slot before the head becomes the head */
+	if (q->exp != NULL)
+		q->exp[(q->head + q->size - 1) % q->size] = qexpiry(q, q->ttl, 1);
+	q->head = (q->head + q->size - 1) % q->size;
+#ifdef QLATENCY
+	q->stamp[q->head] = clkticks();
+#endif
+	q->que[q->head] = n;
+	q->count++;
+	STATINC(q, enqueued);
+	STATHIWAT(q);
+	QPUBLISH(q);
+	QPROBE3(put, qno, q->count, q->head);
+	if (ck > 0)
+		(void) qwal_checkpoint(q->wal, q->que, q->size, q->head, q->count);
+	QWATCH(q);
+	if (q->sch != NULL && !q->active)
+		sactivate(q);
+
+	return(QE_NONE);
+}
+
+/*
+ * take the element off the back of an existing queue, the one
+ * put on last (whose data is likeliest still to be in cache);
+ * as with take_off_queue, expired elements at the front are
+ * dropped first, so the back is never expired while expiries
+ * rise along the queue, and a queue with a token bucket spends
+ * a token on the element
+ *
+ * PARAMETERS:	QTICKET qno	ticket for the queue involved
+ * RETURNED:	int		element or error code
+ * ERRORS:	QE_BADTICKET	parameter refers to deleted, unallocated,
+ *				or invalid queue (from readref()).
+ * 		QE_INTINCON	queue is internally inconsistent (from
+ *				readref()).
+ *		QE_WRONGKIND	not a FIFO queue
+ *		QE_EMPTY	queue has no elements so none can be retrieved
+ *		QE_NOTYET	the queue's token bucket is empty
+ *				(see queue_set_rate())
+ *		QE_NOROOM	queue is durable and its log can't be
+ *				written (from qwal_append()), or it
+ *				spills and its spill file can't be read
+ *				(from qspill_back())
+ * EXCEPTIONS:	none
+ */
+int queue_pop_back(QTICKET qno)
+{
+	register int cur;	/* index of current queue */
+	register QUEUE *q;	/* pointer to queue structure */
+	register int n;		/* index of element to be returned */
+	register int ck = 0;	/* 1 if the log wants a checkpoint */
+	int elt;		/* the element */
+	unsigned long long tat = 0;	/* token bucket time, once taken from */
+
+	/*
+	 * check that qno refers to an existing queue;
+	 * readref sets error code
+	 */
+	if (QE_ISERROR(cur = readref(qno))){
+		QPROBE3(error, qno, cur, "queue_pop_back");
+		return(cur);
+	}
+
+	q = queues[cur];
+	if (q->kind != QK_FIFO){
+		ERRBUF("queue_pop_back: not a FIFO queue");
+		QPROBE3(error, qno, QE_WRONGKIND, "queue_pop_back");
+		return(QE_WRONGKIND);
+	}
+
+	/* if the queue spills, the back is in the spill file */
+	if (q->sp != NULL && qspill_count(q->sp) > 0){
+		if ((q->tbint != 0 &&
+		    QE_ISERROR(ck = qthrottle(q, "queue_pop_back", &tat))) ||
+		    QE_ISERROR(ck = qspill_back(q->sp, 1, &elt))){
+			QPROBE3(error, qno, ck, "queue_pop_back");
+			return(ck);
+		}
+		if (q->tbint != 0)
+			q->tbtat = tat;
+		STATINC(q, dequeued);
+		QPROBE3(take, qno, q->count, -1);
+		return(elt);
+	}
+	if (q->exp != NULL && QE_ISERROR(ck = qexpire(q))){
+		QPROBE3(error, qno, ck, "queue_pop_back");
+		return(ck);
+	}
+	if (q->count == 0){
+		/* it's empty */
+		ERRBUF("queue_pop_back: queue empty");
+		STATINC(q, empty);
+		QPROBE3(error, qno, QE_EMPTY, "queue_pop_back");
+		return(QE_EMPTY);
+	}
+	if (q->tbint != 0 &&
+	    QE_ISERROR(ck = qthrottle(q, "queue_pop_back", &tat))){
+		QPROBE3(error, qno, ck, "queue_pop_back");
+		return(ck);
+	}
+
+	/* log it first, if the queue is durable */
+	if (q->wal != NULL && QE_ISERROR(ck = qwal_append(q->wal, QW_POP, 0)))
+		return(ck);
+	if (q->tbint != 0)
+		q->tbtat = tat;
+	q->count--;
+	STATINC(q, dequeued);
+	n = (q->head + q->count) % q->size;
+#ifdef QLATENCY
+	lstay(q, n);
+#endif
+	elt = q->que[n];
+	QPUBLISH(q);
+	QPROBE3(take, qno, q->count, n);
+	if (ck > 0)
+		(void) qwal_checkpoint(q->wal, q->que, q->size, q->head, q->count);
+	QWATCH(q);
+	return(elt);
+}
+
+/*
+ * look at the element take_off_queue would return next, leaving
+ * it there
+ *
+ * PARAMETERS:	QTICKET qno	ticket for the queue involved
+ * RETURNED:	int		element or error code
+ * ERRORS:	QE_BADTICKET	parameter refers to deleted, unallocated,
+ *				or invalid queue (from readref()).
+ * 		QE_INTINCON	queue is internally inconsistent (from
+ *				readref()).
+ *		QE_WRONGKIND	queue is a deque, or broadcast, sharded
+ *				or partitioned, or a scheduler
+ *		QE_EMPTY	queue has no elements
+ *		QE_NOTYET	delay queue has no element ready yet
+ *		QE_NOROOM	it spills and its spill file can't be
+ *				read (from qspill_refill()), or it is
+ *				durable and expired elements can't be
+ *				logged (from qwal_append())
+ * EXCEPTIONS:	none
+ */
+int queue_peek_front(QTICKET qno)
+{
+	register int cur;	/* index of current queue */
+	register QUEUE *q;	/* pointer to queue structure */
+	register int rv;	/* error code */
+	int elt;		/* the element, of a delay queue */
+
+	/*
+	 * check that qno refers to an existing queue;
+	 * readref sets error code
+	 */
+	if (QE_ISERROR(cur = readref(qno)))
+		return(cur);
+
+	/*
+	 * as in take_off_queue, a dry ring that spills refills first,
+	 * and expired elements are dropped
+	 */
+	q = queues[cur];
+	if (QOWNCALLS(q)){
+		ERRBUF("queue_peek_front: this kind of queue has calls of its own");
+		return(QE_WRONGKIND);
+	}
+	if (q->exp != NULL && QE_ISERROR(rv = qexpire(q)))
+		return(rv);
+	if (q->count == 0 && q->sp != NULL && qspill_count(q->sp) > 0 &&
+						QE_ISERROR(rv = spillin(q)))
+		return(rv);
+	if (q->count == 0){
+		ERRBUF("queue_peek_front: queue empty");
+		return(QE_EMPTY);
+	}
+
+	switch(q->kind){
+	case QK_DELAY:
+		if (QE_ISERROR(rv = qtw_take(q->tw, clkns(), 0, &elt)))
+			return(rv);
+		return(elt);
+	case QK_PRIO:
+		return(q->heap[0].elt);
+	case QK_LANES:
+		rv = __builtin_ctz(q->lmask);
+		return(q->que[rv * q->lsize + q->lanes[rv].head]);
+	default:
+		return(q->que[q->head]);
+	}
+}
+
+/*
+ * look at the element queue_pop_back would return next, leaving
+ * it there
+ *
+ * PARAMETERS:	QTICKET qno	ticket for the queue involved
+ * RETURNED:	int		element or error code
+ * ERRORS:	QE_BADTICKET	parameter refers to deleted, unallocated,
+ *				or invalid queue (from readref()).
+ * 		QE_INTINCON	queue is internally inconsistent (from
+ *				readref()).
+ *		QE_WRONGKIND	not a FIFO queue
+ *		QE_EMPTY	queue has no elements
+ *		QE_NOROOM	it spills and its spill file can't be
+ *				read (from qspill_back())
+ * EXCEPTIONS:	none
+ */
+int queue_peek_back(QTICKET qno)
+{
+	register int cur;	/* index of current queue */
+	register QUEUE *q;	/* pointer to queue structure */
+	register int rv;	/* error code */
+	int elt;		/* the element */
+
+	/*
+	 * check that qno refers to an existing queue;
+	 * readref sets error code
+	 */
+	if (QE_ISERROR(cur = readref(qno)))
+		return(cur);
+
+	q = queues[cur];
+	if (q->kind != QK_FIFO){
+		ERRBUF("queue_peek_back: not a FIFO queue");
+		return(QE_WRONGKIND);
+	}
+	if (q->sp != NULL && qspill_count(q->sp) > 0){
+		if (QE_ISERROR(rv = qspill_back(q->sp, 0, &elt)))
+			return(rv);
+		return(elt);
+	}
+	if (q->count == 0){
+		ERRBUF("queue_peek_back: queue empty");
+		return(QE_EMPTY);
+	}
+	return(q->que[(q->head + q->count - 1) % q->size]);
+}
+
+/*
+ * look at an element of an existing FIFO queue without taking it:
+ * the i-th from the front (0 is the one take_off_queue would get);
+ * expired elements at the front are dropped first, as with
+ * queue_peek_front. Elements in a spill file are not counted.
+ *
+ * PARAMETERS:	QTICKET qno	ticket for the queue involved
+ *		int i		position from the front
+ * RETURNED:	int		element or error code
+ * ERRORS:	QE_BADTICKET	parameter refers to deleted, unallocated,
+ *				or invalid queue (from readref()).
+ * 		QE_INTINCON	queue is internally inconsistent (from
+ *				readref()).
+ *		QE_WRONGKIND	not a FIFO queue
+ *		QE_BADPARAM	no element i in the queue
+ *		QE_NOROOM	queue is durable and expired elements
+ *				can't be logged (from qwal_append())
+ *				(qe_errbuf has descriptive string)
+ * EXCEPTIONS:	none
+ */
+int queue_at(QTICKET qno, int i)
+{
+	register int cur;	/* index of current queue */
+	register QUEUE *q;	/* pointer to queue structure */
+	register int rv;	/* error code */
+
+	/*
+	 * check that qno refers to an existing queue;
+	 * readref sets error code
+	 */
+	if (QE_ISERROR(cur = readref(qno)))
+		return(cur);
+
+	q = queues[cur];
+	if (q->kind != QK_FIFO){
+		ERRBUF("queue_at: not a FIFO queue");
+		return(QE_WRONGKIND);
+	}
+	if (q->exp != NULL && QE_ISERROR(rv = qexpire(q)))
+		return(rv);
+	if (i < 0 || i >= q->count){
+		ERRBUF3("queue_at: no element %d (queue has %d)", i, q->count);
+		return(QE_BADPARAM);
+	}
+	return(q->que[(q->head + i) % q->size]);
+}
+
+/*
+ * get at the elements of an existing FIFO queue in place, to scan
+ * them without taking any: the ring holds them, front to back, in
+ * at most two runs, sp->p[0][0 .. sp->n[0]-1] and then
+ * sp->p[1][0 .. sp->n[1]-1] (an unused run has n 0), so
+ *
+ *	for(i = 0; i < 2; i++)
+ *		for(j = 0; j < sp->n[i]; j++)
+ *			... sp->p[i][j] ...
+ *
+ * visits them in the order take_off_queue would return them. They
+ * are not copied, so the runs are good only until the queue is
+ * next changed, and must not be written. Expired elements at the
+ * front are dropped first; elements in a spill file are not seen.
+ *
+ * PARAMETERS:	QTICKET qno	ticket for the queue involved
+ *		struct qspans *sp	where to put the runs
+ * RETURNED:	int		number of elements, or error code
+ * ERRORS:	QE_BADPARAM	sp is NULL
+ *		QE_BADTICKET	parameter refers to deleted, unallocated,
+ *				or invalid queue (from readref()).
+ * 		QE_INTINCON	queue is internally inconsistent (from
+ *				readref()).
+ *		QE_WRONGKIND	not a FIFO queue
+ *		QE_NOROOM	queue is durable and expired elements
+ *				can't be logged (from qwal_append())
+ *				(qe_errbuf has descriptive string)
+ * EXCEPTIONS:	none
+ */
+int queue_spans(QTICKET qno, struct qspans *sp)
+{
+	register int cur;	/* index of current queue */
+	register QUEUE *q;	/* pointer to queue structure */
+	register int rv;	/* error code */
+
+	if (sp == NULL){
+		ERRBUF("queue_spans: NULL pointer for spans");
+		return(QE_BADPARAM);
+	}
+
+	/*
+	 * check that qno refers to an existing queue;
+	 * readref sets error code
+	 */
+	if (QE_ISERROR(cur = readref(qno)))
+		return(cur);
+
+	q = queues[cur];
+	if (q->kind != QK_FIFO){
+		ERRBUF("queue_spans: not a FIFO queue");
+		return(QE_WRONGKIND);
+	}
+	if (q->exp != NULL && QE_ISERROR(rv = qexpire(q)))
+		return(rv);
+	sp->p[0] = q->que + q->head;
+	if (q->head + q->count <= q->size){
+		sp->n[0] = q->count;
+		sp->p[1] = q->que;
+		sp->n[1] = 0;
+	}
+	else{
+		sp->n[0] = q->size - q->head;
+		sp->p[1] = q->que;
+		sp->n[1] = q->count - sp->n[0];
+	}
+	return(q->count);
+}
+
+/*
+ * copy k entries of width w from a ring of ssize entries, starting
+ * at entry si, to one of dsize, starting at di, wrapping round
+ * either as need be, in as few memmove()s as that allows; the two
+ * may be the same ring, if the entries move toward its front
+ */
+static void ringcpy(void *dst, int dsize, int di, const void *src, int ssize,
+						int si, int k, size_t w)
+{
+	register int c;		/* entries in this piece */
+
+	while(k > 0){
+		c = k;
+		if (c > ssize - si)
+			c = ssize - si;
+		if (c > dsize - di)
+			c = dsize - di;
+		(void) memmove((char *) dst + di * w, (const char *) src + si * w,
+								c * w);
+		k -= c;
+		if ((si += c) == ssize)
+			si = 0;
+		if ((di += c) == dsize)
+			di = 0;
+	}
+}
+
+/*
+ * move elements from the front of one FIFO queue to the back of
+ * another, in order, as that many take_off_queue and put_on_queue
+ * calls would but with the tickets checked once and the elements
+ * copied in bulk (to rebalance work, or drain the queue of a worker
+ * that has died). Moving everything into an empty queue of the
+ * same capacity just swaps the rings. Elements take their expiries
+ * with them if both queues have expiries; in a queue with them from
+ * one without, they never expire. Expired elements are dropped
+ * from the source first; no tokens are spent (see queue_set_rate()).
+ * Either every element asked for is moved, or none is.
+ *
+ * PARAMETERS:	QTICKET src	ticket for the queue to take from
+ *		QTICKET dst	ticket for the queue to put on
+ *		int n		elements to move (0 for all)
+ * RETURNED:	int		elements moved, or error code
+ * ERRORS:	QE_BADTICKET	either parameter refers to deleted,
+ *				unallocated, or invalid queue (from
+ *				readref()).
+ * 		QE_INTINCON	either queue is internally inconsistent
+ *				(from readref()).
+ *		QE_BADPARAM	n is negative, or src and dst are the
+ *				same queue
+ *		QE_WRONGKIND	either is not a FIFO queue
+ *		QE_NOTSUPP	either is durable or spills
+ *		QE_TOOFULL	dst has no room for them
+ *				(qe_errbuf has descriptive string)
+ * EXCEPTIONS:	none
+ */
+int queue_transfer(QTICKET src, QTICKET dst, int n)
+{
+	register int cur;	/* index of a queue */
+	register QUEUE *s;	/* the queue taken from */
+	register QUEUE *d;	/* the queue put on */
+	register int k;		/* elements to move */
+	register int di;	/* index of the first in d */
+	register int i;		/* counter */
+	register int rv;	/* error code */
+	QELT *tq;		/* for swapping rings */
+	unsigned long long *te;	/* ... and expiries */
+
+	/*
+	 * check that src and dst refer to existing queues;
+	 * readref sets error code
+	 */
+	if (QE_ISERROR(cur = readref(src)))
+		return(cur);
+	s = queues[cur];
+	if (QE_ISERROR(cur = readref(dst)))
+		return(cur);
+	d = queues[cur];
+
+	if (n < 0 || s == d){
+		ERRBUF2("queue_transfer: invalid count (%d) or same queue", n);
+		return(QE_BADPARAM);
+	}
+	if (s->kind != QK_FIFO || d->kind != QK_FIFO){
+		ERRBUF("queue_transfer: not a FIFO queue");
+		return(QE_WRONGKIND);
+	}
+	if (s->wal != NULL || d->wal != NULL || s->sp != NULL || d->sp != NULL){
+		ERRBUF("queue_transfer: durable or spilling queue");
+		return(QE_NOTSUPP);
+	}
+	if (s->exp != NULL && QE_ISERROR(rv = qexpire(s)))
+		return(rv);
+	k = n == 0 || n > s->count ? s->count : n;
+	if (k > d->size - d->count){
+		ERRBUF3("queue_transfer: no room for %d elts (max %d elts)",
+								k, d->size);
+		STATINC(d, full);
+		return(QE_TOOFULL);
+	}
+	if (k == 0)
+		return(0);
+
+	if (d->count == 0 && k == s->count && s->size == d->size &&
+	    s->pf == NULL && d->pf == NULL && (s->exp == NULL) == (d->exp == NULL)){
+		/* all of it, into an empty ring just like it: swap rings */
+		tq = d->que, d->que = s->que, s->que = tq;
+		te = d->exp, d->exp = s->exp, s->exp = te;
+#ifdef QLATENCY
+		te = d->stamp, d->stamp = s->stamp, s->stamp = te;
+#endif
+		d->head = s->head;
+		d->expmono = s->expmono;
+		s->head = 0;
+	}
+	else{
+		di = (d->head + d->count) % d->size;
+		ringcpy(d->que, d->size, di, s->que, s->size, s->head, k,
+								sizeof(QELT));
+#ifdef QLATENCY
+		ringcpy(d->stamp, d->size, di, s->stamp, s->size, s->head, k,
+						sizeof(unsigned long long));
+#endif
+		if (d->exp != NULL && s->exp != NULL){
+			if (d->count == 0)
+				d->expmono = 1;
+			if (!s->expmono || (d->count > 0 &&
+			    QEXP(d, d->count - 1) > s->exp[s->head]))
+				d->expmono = 0;
+			ringcpy(d->exp, d->size, di, s->exp, s->size, s->head,
+					k, sizeof(unsigned long long));
+		}
+		else if (d->exp != NULL)
+			for(i = 0; i < k; i++)
+				d->exp[(di + i) % d->size] = QNEVER;
+		s->head = (s->head + k) % s->size;
+	}
+	d->count += k;
+	if ((s->count -= k) == 0)
+		s->expmono = 1;
+#ifdef QSTATS
+	s->stats.dequeued += k;
+	d->stats.enqueued += k;
+#endif
+	STATHIWAT(d);
+
+	/* d first: a crash in between leaves them in both files, not neither */
+	QPUBLISH(d);
+	QPUBLISH(s);
+	QWATCH(s);
+	QWATCH(d);
+	if (d->sch != NULL && !d->active)
+		sactivate(d);
+	return(k);
+}
+
+/*
+ * position (from the front) of the first element of a FIFO queue
+ * at or after position i whose value is in [lo, hi], or the count
+ * if there is none; the ring is searched in at most two runs
+ */
+static int qfind(QUEUE *q, int i, int lo, int hi)
+{
+	register int p = (q->head + i) % q->size;	/* where i is */
+	register int n;					/* in the first run */
+	register int k;					/* found at */
+
+	if ((n = q->count - i) > q->size - p)
+		n = q->size - p;
+	if ((k = qscan(q->que + p, n, lo, hi)) < n)
+		return(i + k);
+	return(i + n + qscan(q->que, q->count - i - n, lo, hi));
+}
+
+/*
+ * find an element of an existing FIFO queue by value, without
+ * taking it; the ring is searched a vector at a time where the
+ * CPU allows (see qscan.c). Expired elements at the front are
+ * dropped first; elements in a spill file are not searched.
+ *
+ * PARAMETERS:	QTICKET qno	ticket for the queue involved
+ *		int value	value to look for
+ * RETURNED:	int		position of the first element with
+ *				that value from the front (as queue_at()
+ *				takes it), or error code
+ * ERRORS:	QE_BADTICKET	parameter refers to deleted, unallocated,
+ *				or invalid queue (from readref()).
+ * 		QE_INTINCON	queue is internally inconsistent (from
+ *				readref()).
+ *		QE_WRONGKIND	not a FIFO queue
+ *		QE_NOTFOUND	no element has that value
+ *		QE_NOROOM	queue is durable and expired elements
+ *				can't be logged (from qwal_append())
+ *				(qe_errbuf has descriptive string)
+ * EXCEPTIONS:	none
+ */
+int queue_find(QTICKET qno, int value)
+{
+	register int cur;	/* index of current queue */
+	register QUEUE *q;	/* pointer to queue structure */
+	register int i;		/* where it is */
+
+	/*
+	 * check that qno refers to an existing queue;
+	 * readref sets error code
+	 */
+	if (QE_ISERROR(cur = readref(qno)))
+		return(cur);
+
+	q = queues[cur];
+	if (q->kind != QK_FIFO){
+		ERRBUF("queue_find: not a FIFO queue");
+		return(QE_WRONGKIND);
+	}
+	if (q->exp != NULL && QE_ISERROR(i = qexpire(q)))
+		return(i);
+	if ((i = qfind(q, 0, value, value)) == q->count){
+		ERRBUF2("queue_find: no element %d in queue", value);
+		return(QE_NOTFOUND);
+	}
+	return(i);
+}
+
+/*
+ * remove every element of an existing FIFO queue whose value is in
+ * a range (lo == hi for one value), keeping the rest in order; the
+ * elements are searched for a vector at a time where the CPU allows
+ * (see qscan.c), and those between are moved up in runs, in place.
+ * Elements removed count as taken in the statistics. Expired
+ * elements at the front are dropped first; elements in a spill
+ * file are not searched. A durable queue's log is checkpointed
+ * afterwards; should a file-backed queue's process die part way,
+ * the file may hold some elements twice, but loses none.
+ *
+ * PARAMETERS:	QTICKET qno	ticket for the queue involved
+ *		int lo		least value to remove
+ *		int hi		greatest value to remove
+ * RETURNED:	int		number of elements removed, or error
+ *				code
+ * ERRORS:	QE_BADTICKET	parameter refers to deleted, unallocated,
+ *				or invalid queue (from readref()).
+ * 		QE_INTINCON	queue is internally inconsistent (from
+ *				readref()).
+ *		QE_WRONGKIND	not a FIFO queue
+ *		QE_BADPARAM	lo is greater than hi
+ *		QE_NOROOM	queue is durable and its log can't be
+ *				written (from qwal_append() or
+ *				qwal_checkpoint()); the elements are
+ *				gone, but the log still holds them
+ *				(qe_errbuf has descriptive string)
+ * EXCEPTIONS:	none
+ */
+int queue_remove_if(QTICKET qno, int lo, int hi)
+{
+	register int cur;	/* index of current queue */
+	register QUEUE *q;	/* pointer to queue structure */
+	register int i, j;	/* run kept is [i, j) */
+	register int k;		/* where the next run kept goes */
+	register int n;		/* elements removed */
+	register int rv;	/* error code */
+
+	/*
+	 * check that qno refers to an existing queue;
+	 * readref sets error code
+	 */
+	if (QE_ISERROR(cur = readref(qno)))
+		return(cur);
+
+	q = queues[cur];
+	if (q->kind != QK_FIFO){
+		ERRBUF("queue_remove_if: not a FIFO queue");
+		return(QE_WRONGKIND);
+	}
+	if (lo > hi){
+		ERRBUF3("queue_remove_if: invalid range (%d to %d)", lo, hi);
+		return(QE_BADPARAM);
+	}
+	if (q->exp != NULL && QE_ISERROR(rv = qexpire(q)))
+		return(rv);
+	if ((k = qfind(q, 0, lo, hi)) == q->count)
+		return(0);
+
+	/*
+	 * move each run between elements removed up to follow the
+	 * last run kept; the head stays where it is, so every element
+	 * kept is always somewhere in the ring
+	 */
+	for(i = k + 1; i < q->count; i = j + 1){
+		/* when many go, the next one often does too; no search */
+		if ((unsigned int) q->que[(q->head + i) % q->size] - lo <=
+						(unsigned int) hi - lo){
+			j = i;
+			continue;
+		}
+		j = qfind(q, i + 1, lo, hi);
+		ringcpy(q->que, q->size, (q->head + k) % q->size,
+			q->que, q->size, (q->head + i) % q->size, j - i,
+								sizeof(QELT));
+#ifdef QLATENCY
+		ringcpy(q->stamp, q->size, (q->head + k) % q->size,
+			q->stamp, q->size, (q->head + i) % q->size, j - i,
+					sizeof(unsigned long long));
+#endif
+		if (q->exp != NULL)
+			ringcpy(q->exp, q->size, (q->head + k) % q->size,
+				q->exp, q->size, (q->head + i) % q->size, j - i,
+					sizeof(unsigned long long));
+		k += j - i;
+	}
+	n = q->count - k;
+	if ((q->count = k) == 0)
+		q->expmono = 1;
+#ifdef QSTATS
+	q->stats.dequeued += n;
+#endif
+	QPUBLISH(q);
+	QWATCH(q);
+	if (q->wal != NULL &&
+	    QE_ISERROR(rv = qwal_checkpoint(q->wal, q->que, q->size, q->head,
+							q->count)))
+		return(rv);
+	return(n);
+}
+
+/*
+ * create a queue kept in a file, or bring back the one a file holds
+ * the file has a header (struct qfile) and then the ring, and is
+ * mapped into memory, so put_on_queue and take_off_queue work on
+ * it exactly as on any queue; after storing an element they
+ * publish head and count together in the header, so when the
+ * program dies at any point, reopening the file gives back every
+ * element a put_on_queue returned for, less those a take_off_queue
+ * returned (an element being taken off when the program died may
+ * come back). What is found is checked as readref() checks every
+ * queue. This guards against the program dying, not the system:
+ * for that, call queue_sync() when it matters.
+ *
+ * PARAMETERS:	char *path	file holding the queue
+ *		int size	maximum size of the queue; for an
+ *				existing file, 0 or the size it was
+ *				created with
+ * RETURNED:	QTICKET		token (if > 0); error number (if < 0)
+ * ERRORS:	QE_BADPARAM	path is NULL, or file can't be opened
+ *		QE_INVALIDSIZE	invalid size, or not the file's size
+ *		QE_INTINCON	file does not hold a consistent queue
+ *		QE_NOROOM	file can't be sized or mapped (sys err)
+ *		(and those of create_queue())
+ *				(qe_errbuf has descriptive string)
+ * EXCEPTIONS:	none
+ */
+QTICKET create_file_queue(const char *path, int size)
+{
+	register QUEUE *q;		/* new queue */
+	register struct qfile *pf;	/* mapped file header */
+	register int tkt;		/* new ticket for the queue */
+	QUEUE old;			/* what the file holds */
+	unsigned long long st;		/* state word from the file */
+	struct stat sb;			/* to learn the file's size */
+	size_t len;			/* size of the mapping */
+	int fd;				/* the file */
+	int fresh;			/* 1 if the file is new */
+
+	if (path == NULL){
+		ERRBUF("create_file_queue: NULL path");
+		return(QE_BADPARAM);
+	}
+	if ((fd = open(path, O_RDWR|O_CREAT, 0600)) < 0 || fstat(fd, &sb) < 0){
+		ERRBUF2("create_file_queue: open: %s", strerror(errno));
+		if (fd >= 0)
+			(void) close(fd);
+		return(QE_BADPARAM);
+	}
+
+	/* size up the file: a new one gets sized, an old one checked */
+	if ((fresh = (sb.st_size == 0)) != 0){
+		if (size <= 0 || size > (0x7fffffff - QFHDR) / (int) sizeof(QELT)){
+			ERRBUF2("create_file_queue: invalid size (%d)", size);
+			(void) close(fd);
+			return(QE_INVALIDSIZE);
+		}
+		len = QFHDR + size * sizeof(QELT);
+		if (ftruncate(fd, len) < 0){
+			ERRBUF2("create_file_queue: ftruncate: %s", strerror(errno));
+			(void) close(fd);
+			return(QE_NOROOM);
+		}
+	}
+	else
+		len = sb.st_size;
+	if (len < QFHDR){
+		ERRBUF("create_file_queue: file too short to hold a queue");
+		(void) close(fd);
+		return(QE_INTINCON);
+	}
+	pf = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	(void) close(fd);
+	if (pf == MAP_FAILED){
+		ERRBUF2("create_file_queue: mmap: %s", strerror(errno));
+		return(QE_NOROOM);
+	}
+
+	if (fresh){
+		pf->size = size;
+		atomic_store_explicit(&pf->state, 0, memory_order_relaxed);
+		pf->magic = QFMAGIC;
+		old.head = old.count = 0;
+	}
+	else{
+		/* recover: the file must be a queue and agree with itself */
+		if (pf->magic != QFMAGIC || pf->size <= 0 ||
+				len != QFHDR + pf->size * sizeof(QELT)){
+			ERRBUF("create_file_queue: file does not hold a queue");
+			(void) munmap(pf, len);
+			return(QE_INTINCON);
+		}
+		if (size != 0 && size != pf->size){
+			ERRBUF3("create_file_queue: size %d, but file has %d",
+							size, pf->size);
+			(void) munmap(pf, len);
+			return(QE_INVALIDSIZE);
+		}
+		st = atomic_load_explicit(&pf->state, memory_order_acquire);
+		old.ticket = pf->ticket;
+		old.size = pf->size;
+		old.head = (int) (st >> 32);
+		old.count = (int) (st & 0xffffffff);
+		if (QE_ISERROR(tkt = qcheck(&old, "create_file_queue"))){
+			(void) munmap(pf, len);
+			return(tkt);
+		}
+	}
+
+	/*
+	 * make an ordinary queue and put the file's ring in it,
+	 * with a new ticket
+	 */
+	if (QE_ISERROR(tkt = create_queue(pf->size))){
+		(void) munmap(pf, len);
+		return(tkt);
+	}
+	q = queues[readref(tkt)];
+	(void) free(q->que);
+	q->que = (QELT *)((char *) pf + QFHDR);
+	q->head = old.head;
+	q->count = old.count;
+	q->pf = pf;
+	pf->ticket = tkt;
+	QPUBLISH(q);
+#ifdef QLATENCY
+	/* how long recovered elements waited before is lost */
+	for(fd = 0; fd < q->count; fd++)
+		q->stamp[(q->head + fd) % q->size] = clkticks();
+#endif
+
+	return(tkt);
+}
+
+/*
+ * write a file-backed queue out to its file, so it survives the
+ * system going down too; for queues in memory, nothing to do
+ *
+ * PARAMETERS:	QTICKET qno	ticket for the queue involved
+ * RETURNED:	int		error code
+ * ERRORS:	QE_BADTICKET	parameter refers to deleted, unallocated,
+ *				or invalid queue (from readref()).
+ * 		QE_INTINCON	queue is internally inconsistent (from
+ *				readref()), or it could not be written
+ * EXCEPTIONS:	none
+ */
+int queue_sync(QTICKET qno)
+{
+	register int cur;	/* index of current queue */
+	register QUEUE *q;	/* pointer to queue structure */
+
+	/*
+	 * check that qno refers to an existing queue;
+	 * readref sets error code
+	 */
+	if (QE_ISERROR(cur = readref(qno)))
+		return(cur);
+
+	if ((q = queues[cur])->pf != NULL &&
+	    msync(q->pf, QFHDR + q->size * sizeof(QELT), MS_SYNC) < 0){
+		ERRBUF2("queue_sync: msync: %s", strerror(errno));
+		return(QE_INTINCON);
+	}
+	return(QE_NONE);
+}
+
+/*
+ * create a durable queue, or bring back the one a log holds
+ * every put_on_queue and take_off_queue on the queue is first
+ * appended to a write-ahead log (see qwal.c); the log is written
+ * and synced a group of records at a time, when a group of
+ * o->batch records has gathered or its oldest record has waited
+ * o->maxdelay microseconds (looked at whenever the queue is used),
+ * or when queue_commit() is called. An element is safe once the
+ * commit after its put_on_queue is done; so acknowledge elements
+ * to whoever sent them after queue_commit(), or after enough puts
+ * to fill a batch.
+ *
+ * PARAMETERS:	char *path	the log file (created if absent)
+ *		int size	maximum size of the queue
+ *		struct qwalopts *o	group commit thresholds (NULL
+ *				for the defaults)
+ * RETURNED:	QTICKET		token (if > 0); error number (if < 0)
+ * ERRORS:	QE_BADPARAM	path is NULL, or log can't be read
+ *		QE_INTINCON	log does not fit in a queue of this size
+ *		(and those of create_queue())
+ *				(qe_errbuf has descriptive string)
+ * EXCEPTIONS:	none
+ */
+QTICKET create_durable_queue(const char *path, int size,
+					const struct qwalopts *o)
+{
+	register QUEUE *q;	/* new queue */
+	register int tkt;	/* its ticket */
+	register int rv;	/* error code */
+	struct qwal *w;		/* its log */
+	int head, count;	/* what the log holds */
+
+	if (path == NULL){
+		ERRBUF("create_durable_queue: NULL path");
+		return(QE_BADPARAM);
+	}
+	if (QE_ISERROR(tkt = create_queue(size)))
+		return(tkt);
+	q = queues[readref(tkt)];
+
+	/* replay the log straight into the ring */
+	if (QE_ISERROR(rv = qwal_open(path, o, size, q->que, &head, &count, &w))){
+		(void) delete_queue(tkt);
+		return(rv);
+	}
+	q->head = head;
+	q->count = count;
+	q->wal = w;
+#ifdef QLATENCY
+	/* how long recovered elements waited before is lost */
+	for(rv = 0; rv < count; rv++)
+		q->stamp[(head + rv) % size] = clkticks();
+#endif
+
+	return(tkt);
+}
+
+/*
+ * commit the write-ahead log of a durable queue now; when this
+ * returns, every element put on the queue so far is on disk
+ * for queues without a log, nothing to do
+ *
+ * PARAMETERS:	QTICKET qno	ticket for the queue involved
+ * RETURNED:	int		error code
+ * ERRORS:	QE_BADTICKET	parameter refers to deleted, unallocated,
+ *				or invalid queue (from readref()).
+ * 		QE_INTINCON	queue is internally inconsistent (from
+ *				readref()).
+ *		QE_NOROOM	log can't be written (from qwal_commit())
+ * EXCEPTIONS:	none
+ */
+int queue_commit(QTICKET qno)
+{
+	register int cur;	/* index of current queue */
+
+	/*
+	 * check that qno refers to an existing queue;
+	 * readref sets error code
+	 */
+	if (QE_ISERROR(cur = readref(qno)))
+		return(cur);
+
+	if (queues[cur]->wal == NULL)
+		return(QE_NONE);
+	return(qwal_commit(queues[cur]->wal));
+}
+
+/*
+ * let an in-memory queue overflow to a file: once its ring is
+ * full, put_on_queue appends elements to the file (see qspill.c)
+ * instead of failing, a block of elements to a write, and as
+ * take_off_queue drains the ring it is refilled from the file,
+ * so elements still come off in the order they went on. The file
+ * is created (or emptied) now and removed when the queue is
+ * deleted or stops spilling; it is scratch space, not a way to
+ * make the queue durable. A NULL path stops spilling, which can
+ * only be done once the file is empty.
+ *
+ * PARAMETERS:	QTICKET qno	ticket for the queue involved
+ *		char *path	the spill file, or NULL to stop
+ *		int block	elements per block (0 for 4096)
+ * RETURNED:	int		error code
+ * ERRORS:	QE_BADTICKET	parameter refers to deleted, unallocated,
+ *				or invalid queue (from readref()).
+ * 		QE_INTINCON	queue is internally inconsistent (from
+ *				readref()).
+ *		QE_NOTSUPP	queue is kept in a file or a log, or
+ *				has expiries
+ *		QE_WRONGKIND	not a FIFO queue
+ *		QE_BADPARAM	queue spills already, or file can't be
+ *				created (from qspill_open())
+ *		QE_TOOFULL	elements still in the file
+ *		QE_INVALIDSIZE	block is negative (from qspill_open())
+ *		QE_NOROOM	no memory (from qspill_open())
+ *				(qe_errbuf has descriptive string)
+ * EXCEPTIONS:	none
+ */
+int queue_set_spill(QTICKET qno, const char *path, int block)
+{
+	register int cur;	/* index of current queue */
+	register QUEUE *q;	/* pointer to queue structure */
+
+	/*
+	 * check that qno refers to an existing queue;
+	 * readref sets error code
+	 */
+	if (QE_ISERROR(cur = readref(qno)))
+		return(cur);
+	q = queues[cur];
+
+	if (path == NULL){
+		if (q->sp == NULL)
+			return(QE_NONE);
+		if (qspill_count(q->sp) > 0){
+			ERRBUF2("queue_set_spill: %ld elements still spilled",
+							qspill_count(q->sp));
+			return(QE_TOOFULL);
+		}
+		qspill_close(q->sp);
+		q->sp = NULL;
+		return(QE_NONE);
+	}
+	if (q->pf != NULL || q->wal != NULL){
+		ERRBUF("queue_set_spill: queue kept in a file or log can't spill");
+		return(QE_NOTSUPP);
+	}
+	if (q->kind != QK_FIFO){
+		ERRBUF("queue_set_spill: only FIFO queues can spill");
+		return(QE_WRONGKIND);
+	}
+	if (q->exp != NULL){
+		ERRBUF("queue_set_spill: queue with expiries can't spill");
+		return(QE_NOTSUPP);
+	}
+	if (q->sp != NULL){
+		ERRBUF("queue_set_spill: queue spills already");
+		return(QE_BADPARAM);
+	}
+	return(qspill_open(path, block, &q->sp));
+}
+
+/*
+ * give the elements of a FIFO queue a time to live: from now on
+ * each element expires ttl microseconds after it is put on (or
+ * after the time put_on_queue_ttl gives it), and take_off_queue
+ * drops expired elements rather than return them, counting them
+ * in the expired statistic. Nothing runs in the background; the
+ * expired elements at the front are dropped, however many, in one
+ * step the next time the front is looked at, and an element that
+ * expires behind one that has not waits until that one is gone.
+ * Elements already in the queue never expire, and ttl QTTL_OFF
+ * forgets all expiries. Expiries are kept in memory only: a queue
+ * brought back from a file, log or snapshot has none.
+ *
+ * PARAMETERS:	QTICKET qno	ticket for the queue involved
+ *		long ttl	microseconds each element put on lives
+ *				(0 for ever, leaving put_on_queue_ttl
+ *				to give times), or QTTL_OFF
+ * RETURNED:	int		error code
+ * ERRORS:	QE_BADTICKET	parameter refers to deleted, unallocated,
+ *				or invalid queue (from readref()).
+ * 		QE_INTINCON	queue is internally inconsistent (from
+ *				readref()).
+ *		QE_WRONGKIND	not a FIFO queue
+ *		QE_NOTSUPP	queue spills
+ *		QE_BADPARAM	ttl is negative and not QTTL_OFF
+ *		QE_NOROOM	no memory for the expiries
+ *				(qe_errbuf has descriptive string)
+ * EXCEPTIONS:	none
+ */
+int queue_set_ttl(QTICKET qno, long ttl)
+{
+	register int cur;	/* index of current queue */
+	register QUEUE *q;	/* pointer to queue structure */
+	register int i;		/* counter */
+
+	/*
+	 * check that qno refers to an existing queue;
+	 * readref sets error code
+	 */
+	if (QE_ISERROR(cur = readref(qno)))
+		return(cur);
+	q = queues[cur];
+
+	if (ttl == QTTL_OFF){
+		(void) free(q->exp);
+		q->exp = NULL;
+		q->ttl = 0;
+		return(QE_NONE);
+	}
+	if (ttl < 0){
+		ERRBUF2("queue_set_ttl: invalid ttl (%ld)", ttl);
+		return(QE_BADPARAM);
+	}
+	if (q->kind != QK_FIFO){
+		ERRBUF("queue_set_ttl: only FIFO queues can expire elements");
+		return(QE_WRONGKIND);
+	}
+	if (q->sp != NULL){
+		ERRBUF("queue_set_ttl: spilling queue can't expire elements");
+		return(QE_NOTSUPP);
+	}
+	if (q->exp == NULL){
+		if ((q->exp = malloc(q->size * sizeof(unsigned long long))) == NULL){
+			ERRBUF("queue_set_ttl: malloc: no more memory");
+			return(QE_NOROOM);
+		}
+		for(i = 0; i < q->size; i++)
+			q->exp[i] = QNEVER;
+		q->expmono = 1;
+	}
+	q->ttl = ttl;
+	return(QE_NONE);
+}
+
+/*
+ * limit the rate elements can be taken off a queue, with a token
+ * bucket: it holds burst tokens, and refills at rate tokens a
+ * second; take_off_queue and queue_pop_back spend one on each
+ * element they return and, while there are none, fail with
+ * QE_NOTYET (as does sched_take, once every queue it could serve
+ * is so limited), leaving the element where it is. The bucket
+ * starts full. Nothing runs in the background, and the bucket is
+ * only the time it will next be full, so checking it costs one
+ * read of the monotonic clock and no locks. Like expiries, the
+ * limit is kept in memory only.
+ *
+ * PARAMETERS:	QTICKET qno	ticket for the queue involved
+ *		long rate	tokens a second (0 for no limit)
+ *		int burst	tokens the bucket holds (0 for 1)
+ * RETURNED:	int		error code
+ * ERRORS:	QE_BADTICKET	parameter refers to deleted, unallocated,
+ *				or invalid queue (from readref()).
+ * 		QE_INTINCON	queue is internally inconsistent (from
+ *				readref()).
+ *		QE_WRONGKIND	queue has calls of its own instead of
+ *				take_off_queue (see create_deque())
+ *		QE_BADPARAM	rate or burst is negative, or rate is
+ *				over a billion
+ *				(qe_errbuf has descriptive string)
+ * EXCEPTIONS:	none
+ */
+int queue_set_rate(QTICKET qno, long rate, int burst)
+{
+	register int cur;	/* index of current queue */
+	register QUEUE *q;	/* pointer to queue structure */
+
+	/*
+	 * check that qno refers to an existing queue;
+	 * readref sets error code
+	 */
+	if (QE_ISERROR(cur = readref(qno)))
+		return(cur);
+	q = queues[cur];
+
+	if (rate < 0 || rate > 1000000000L || burst < 0){
+		ERRBUF3("queue_set_rate: invalid rate (%ld) or burst (%d)",
+								rate, burst);
+		return(QE_BADPARAM);
+	}
+	if (QOWNCALLS(q)){
+		ERRBUF("queue_set_rate: this kind of queue has calls of its own");
+		return(QE_WRONGKIND);
+	}
+	if (rate == 0){
+		q->tbint = q->tbtol = q->tbtat = 0;
+		return(QE_NONE);
+	}
+	if (burst == 0)
+		burst = 1;
+	q->tbint = 1000000000ULL / rate;
+	q->tbtol = (burst - 1) * q->tbint;
+	q->tbtat = clkns();
+	return(QE_NONE);
+}
+
+/*
+ * how long until a take off a queue with a token bucket can have
+ * a token (see queue_set_rate()), so a caller refused one with
+ * QE_NOTYET knows how long to sleep
+ *
+ * PARAMETERS:	QTICKET qno	ticket for the queue involved
+ * RETURNED:	int		microseconds, rounded up (0 if a token
+ *				is there now, or the queue has no limit),
+ *				or error code
+ * ERRORS:	QE_BADTICKET	parameter refers to deleted, unallocated,
+ *				or invalid queue (from readref()).
+ * 		QE_INTINCON	queue is internally inconsistent (from
+ *				readref()).
+ * EXCEPTIONS:	none
+ */
+int queue_token_wait(QTICKET qno)
+{
+	register int cur;	/* index of current queue */
+	register QUEUE *q;	/* pointer to queue structure */
+	register unsigned long long now;	/* the time */
+
+	/*
+	 * check that qno refers to an existing queue;
+	 * readref sets error code
+	 */
+	if (QE_ISERROR(cur = readref(qno)))
+		return(cur);
+	q = queues[cur];
+
+	if (q->tbint == 0 || q->tbtat <= (now = clkns()) + q->tbtol)
+		return(0);
+	return((int) ((q->tbtat - q->tbtol - now + 999) / 1000));
+}
+
+/*
+ * watch a queue's count against a high and a low watermark, for
+ * backpressure: fn(ticket, QWM_HIGH, arg) is called when a put
+ * brings the count up to high, and fn(ticket, QWM_LOW, arg) when
+ * a take (or expiry) next brings it down to low; nothing more is
+ * said until it crosses the other one, so a count hovering about
+ * either is not reported over and over. Nothing polls: each put
+ * and take compares the count against the one watermark that
+ * could be crossed next, and fn is called only on a crossing, from
+ * inside the put or take (so it must not put on or take off this
+ * queue itself). If the count is already up to high, fn is called
+ * before this returns. The count is of elements in the queue
+ * proper, not any spill file.
+ *
+ * PARAMETERS:	QTICKET qno	ticket for the queue involved
+ *		int high	count that is too many
+ *		int low		count that is few enough again
+ *		QWMFN fn	function to call (NULL to stop watching)
+ *		void *arg	its last argument
+ * RETURNED:	int		error code
+ * ERRORS:	QE_BADTICKET	parameter refers to deleted, unallocated,
+ *				or invalid queue (from readref()).
+ * 		QE_INTINCON	queue is internally inconsistent (from
+ *				readref()).
+ *		QE_WRONGKIND	queue has calls of its own instead of
+ *				put_on_queue and take_off_queue (see
+ *				create_deque())
+ *		QE_BADPARAM	not 0 <= low < high <= the capacity
+ *				(qe_errbuf has descriptive string)
+ * EXCEPTIONS:	none
+ */
+int queue_set_watermarks(QTICKET qno, int high, int low, QWMFN fn, void *arg)
+{
+	register int cur;	/* index of current queue */
+	register QUEUE *q;	/* pointer to queue structure */
+
+	/*
+	 * check that qno refers to an existing queue;
+	 * readref sets error code
+	 */
+	if (QE_ISERROR(cur = readref(qno)))
+		return(cur);
+	q = queues[cur];
+
+	if (QOWNCALLS(q)){
+		ERRBUF("queue_set_watermarks: this kind of queue has calls of its own");
+		return(QE_WRONGKIND);
+	}
+	if (fn == NULL){
+		q->wmhi = q->wmup = INT_MAX;
+		q->wmlo = q->wmdown = -1;
+		q->wmfn = NULL;
+		q->wmarg = NULL;
+		return(QE_NONE);
+	}
+	if (low < 0 || low >= high || high > q->size){
+		ERRBUF3("queue_set_watermarks: invalid high (%d) or low (%d)",
+								high, low);
+		return(QE_BADPARAM);
+	}
+	q->wmhi = q->wmup = high;
+	q->wmlo = low;
+	q->wmdown = -1;
+	q->wmfn = fn;
+	q->wmarg = arg;
+	QWATCH(q);
+	return(QE_NONE);
+}
+
+/*
+ * a snapshot (see qlib_snapshot()) is a header, then for each queue
+ * a queue header followed by its elements, oldest first
+ */
+struct qsnaphdr {
+	unsigned int magic;		/* QSMAGIC */
+	unsigned int noncectr;		/* nonce generator at the time */
+	int maxq;			/* size of queues[] at the time */
+	int nq;				/* number of queues that follow */
+};
+struct qsnapq {
+	int index;			/* slot in queues[] */
+	QTICKET ticket;			/* ticket it was issued */
+	int size;			/* capacity */
+	int count;			/* elements that follow */
+};
+
+/*
+ * write all of an array of buffers, however many writev() calls
+ * that takes; the array is used up
+ *
+ * PARAMETERS:	int fd		where to write
+ *		struct iovec *iov	buffers to write
+ *		int niov	how many
+ * RETURNED:	int		error code
+ * ERRORS:	QE_BADPARAM	write failed (sys err)
+ * EXCEPTIONS:	none
+ */
+static int writeall(int fd, struct iovec *iov, int niov)
+{
+	register ssize_t k;	/* bytes written by one call */
+
+	while(niov > 0){
+		if ((k = writev(fd, iov, niov)) < 0){
+			if (errno == EINTR)
+				continue;
+			ERRBUF2("qlib_snapshot: write: %s", strerror(errno));
+			return(QE_BADPARAM);
+		}
+		/* step over what went out */
+		while(niov > 0 && (size_t) k >= iov->iov_len){
+			k -= iov->iov_len;
+			iov++;
+			niov--;
+		}
+		if (niov > 0){
+			iov->iov_base = (char *) iov->iov_base + k;
+			iov->iov_len -= k;
+		}
+	}
+	return(QE_NONE);
+}
+
+/*
+ * write every in-memory queue, with its ticket and contents, to a
+ * file, so qlib_restore() can bring them all back later (in this
+ * process or another); the contents go straight from the rings to
+ * the file, many queues to a writev() call. Queues kept in a file
+ * or a log (create_file_queue(), create_durable_queue()) look after
+ * themselves and are left out, as are statistics and settings
+ * (spill files, expiries, rates, watermarks). Only FIFO queues can
+ * be written: if any other queue is live (priority, lanes, deque,
+ * delay, broadcast, shard, partitioned or scheduler), or a queue
+ * has elements in its spill file, nothing is.
+ *
+ * PARAMETERS:	int fd		file to write, at its current offset
+ * RETURNED:	int		number of queues written, or error code
+ * ERRORS:	QE_BADPARAM	write failed (sys err)
+ *		QE_NOTSUPP	a live queue is not a FIFO queue, or a
+ *				queue has elements in its spill file
+ *				(qe_errbuf has descriptive string)
+ *		QE_NOROOM	no memory for the queue headers
+ * EXCEPTIONS:	none
+ */
+int qlib_snapshot(int fd)
+{
+	register int cur;		/* index of current queue */
+	register QUEUE *q;		/* pointer to queue structure */
+	register int niov;		/* buffers gathered so far */
+	register int rv;		/* error code */
+	register int n;			/* queues gathered so far */
+	int first;			/* elements before the ring wraps */
+	struct qsnaphdr h;		/* file header */
+	struct qsnapq *qh;		/* queue headers */
+	struct iovec iov[QSIOV];	/* what goes in the next writev */
+
+	h.magic = QSMAGIC;
+	h.noncectr = noncectr;
+	h.maxq = MAXQ;
+	for(cur = h.nq = 0; cur < MAXQ; cur++){
+		if ((q = queues[cur]) == NULL || q->pf != NULL || q->wal != NULL)
+			continue;
+		if (q->kind != QK_FIFO){
+			ERRBUF3("qlib_snapshot: queue %u is of kind %d, not FIFO",
+							q->ticket, q->kind);
+			return(QE_NOTSUPP);
+		}
+		if (q->sp != NULL && qspill_count(q->sp) > 0){
+			ERRBUF2("qlib_snapshot: queue %u has spilled elements",
+								q->ticket);
+			return(QE_NOTSUPP);
+		}
+		h.nq++;
+	}
+	if ((qh = malloc((h.nq + 1) * sizeof(struct qsnapq))) == NULL){
+		ERRBUF("qlib_snapshot: malloc: no more memory");
+		return(QE_NOROOM);
+	}
+
+	iov[0].iov_base = &h;
+	iov[0].iov_len = sizeof(h);
+	niov = 1;
+	for(cur = n = 0; cur < MAXQ; cur++){
+		if ((q = queues[cur]) == NULL || q->pf != NULL || q->wal != NULL)
+			continue;
+		/* room for this queue's header and two spans? */
+		if (niov + 3 > QSIOV){
+			if (QE_ISERROR(rv = writeall(fd, iov, niov))){
+				(void) free(qh);
+				return(rv);
+			}
+			niov = 0;
+		}
+		qh[n].index = cur;
+		qh[n].ticket = q->ticket;
+		qh[n].size = q->size;
+		qh[n].count = q->count;
+		iov[niov].iov_base = &qh[n++];
+		iov[niov++].iov_len = sizeof(struct qsnapq);
+		if (q->count == 0)
+			continue;
+		first = q->size - q->head < q->count ? q->size - q->head : q->count;
+		iov[niov].iov_base = &q->que[q->head];
+		iov[niov++].iov_len = first * sizeof(QELT);
+		if (first < q->count){
+			iov[niov].iov_base = q->que;
+			iov[niov++].iov_len = (q->count - first) * sizeof(QELT);
+		}
+	}
+	rv = writeall(fd, iov, niov);
+	(void) free(qh);
+
+	return(QE_ISERROR(rv) ? rv : h.nq);
+}
+
+/*
+ * buffered reading for qlib_restore(): small reads come out of a
+ * buffer, big ones (queue contents) go straight to their destination
+ */
+struct qsnaprd {
+	int fd;				/* file being read */
+	int pos, len;			/* unread part of buf */
+	char buf[QSBUF];		/* what was read ahead */
+};
+
+/*
+ * read exactly n bytes
+ *
+ * PARAMETERS:	struct qsnaprd *rd	the reader
+ *		void *dst	where to put them
+ *		size_t n	how many
+ * RETURNED:	int		error code
+ * ERRORS:	QE_BADPARAM	read failed (sys err)
+ *		QE_INTINCON	file ended early
+ * EXCEPTIONS:	none
+ */
+static int readall(struct qsnaprd *rd, void *dst, size_t n)
+{
+	register ssize_t k;	/* bytes in hand or read */
+
+	/* first what is buffered */
+	k = rd->len - rd->pos < (ssize_t) n ? rd->len - rd->pos : (ssize_t) n;
+	(void) memcpy(dst, rd->buf + rd->pos, k);
+	rd->pos += k;
+	dst = (char *) dst + k;
+	n -= k;
+
+	while(n > 0){
+		/* big reads bypass the buffer */
+		if (n >= QSBUF)
+			k = read(rd->fd, dst, n);
+		else if ((k = read(rd->fd, rd->buf, QSBUF)) > 0){
+			rd->len = k;
+			rd->pos = k = (size_t) k < n ? k : (ssize_t) n;
+			(void) memcpy(dst, rd->buf, k);
+		}
+		if (k < 0 && errno == EINTR)
+			continue;
+		if (k <= 0){
+			if (k < 0)
+				ERRBUF2("qlib_restore: read: %s", strerror(errno));
+			else
+				ERRBUF("qlib_restore: snapshot is truncated");
+			return(k < 0 ? QE_BADPARAM : QE_INTINCON);
+		}
+		dst = (char *) dst + k;
+		n -= k;
+	}
+	return(QE_NONE);
+}
+
+/*
+ * bring back the queues in a snapshot made by qlib_snapshot(),
+ * in the slots they had and under the tickets they had, so tickets
+ * handed out before the snapshot work again; tickets issued later
+ * never collide with them. The slots must be free: restore into a
+ * fresh program, or one that has only made queues in other slots.
+ * Each queue's contents are read straight into its new ring. If
+ * anything goes wrong, the queues restored so far are deleted.
+ *
+ * PARAMETERS:	int fd		file to read, at its current offset
+ * RETURNED:	int		number of queues restored, or error code
+ * ERRORS:	QE_BADPARAM	read failed (sys err)
+ *		QE_INTINCON	file is not a snapshot, is truncated, or
+ *				holds an inconsistent queue
+ *		QE_BADTICKET	a slot the snapshot needs is in use
+ *		QE_NOROOM	no memory for the queues
+ *				(qe_errbuf has descriptive string)
+ * EXCEPTIONS:	none
+ */
+int qlib_restore(int fd)
+{
+	register QUEUE *q;		/* queue being restored */
+	register int i;			/* number restored */
+	register int rv = QE_NONE;	/* error code */
+	struct qsnaprd *rd;		/* reader */
+	struct qsnaphdr h;		/* file header */
+	struct qsnapq qh;		/* queue header */
+	QUEUE **nq;			/* queues[] grown to size */
+	int *done = NULL;		/* slots restored so far */
+
+	if ((rd = malloc(sizeof(struct qsnaprd))) == NULL){
+		ERRBUF("qlib_restore: malloc: no more memory");
+		return(QE_NOROOM);
+	}
+	rd->fd = fd;
+	rd->pos = rd->len = 0;
+	if (QE_ISERROR(rv = readall(rd, &h, sizeof(h))))
+		goto out;
+	if (h.magic != QSMAGIC || h.maxq < 0 || h.nq < 0 || h.nq > h.maxq ||
+	    h.maxq > 0x7fff - IOFFSET){
+		ERRBUF("qlib_restore: file is not a queue snapshot");
+		rv = QE_INTINCON;
+		goto out;
+	}
+
+	if ((done = malloc((h.nq + 1) * sizeof(int))) == NULL){
+		ERRBUF("qlib_restore: malloc: no more memory");
+		rv = QE_NOROOM;
+		goto out;
+	}
+
+	/* make queues[] as big as it was */
+	if (h.maxq > MAXQ){
+		if ((nq = realloc(queues, h.maxq * sizeof(QUEUE *))) == NULL){
+			ERRBUF("qlib_restore: malloc: no more memory");
+			rv = QE_NOROOM;
+			goto out;
+		}
+		queues = nq;
+		while(MAXQ < h.maxq)
+			queues[MAXQ++] = NULL;
+	}
+
+	for(i = 0; i < h.nq; i++){
+		if (QE_ISERROR(rv = readall(rd, &qh, sizeof(qh))))
+			break;
+		if (qh.index < 0 || qh.index >= h.maxq || qh.size <= 0 ||
+		    qh.count < 0 || qh.count > qh.size ||
+		    (qh.ticket >> 16) - IOFFSET != (unsigned) qh.index){
+			ERRBUF2("qlib_restore: queue %d of snapshot is inconsistent", i);
+			rv = QE_INTINCON;
+			break;
+		}
+		if (queues[qh.index] != NULL){
+			ERRBUF2("qlib_restore: queue slot %d already in use", qh.index);
+			rv = QE_BADTICKET;
+			break;
+		}
+		if ((q = qalloc(qh.size, "qlib_restore")) == NULL){
+			rv = QE_NOROOM;
+			break;
+		}
+		q->ticket = qh.ticket;
+		q->count = qh.count;
+		if (QE_ISERROR(rv = readall(rd, q->que, qh.count * sizeof(QELT))) ||
+		    QE_ISERROR(rv = qcheck(q, "qlib_restore"))){
+			qfree(q);
+			break;
+		}
+#ifdef QLATENCY
+		for(rv = 0; rv < q->count; rv++)
+			q->stamp[rv] = clkticks();
+		rv = QE_NONE;
+#endif
+		queues[done[i] = qh.index] = q;
+	}
+
+	if (QE_ISERROR(rv)){
+		/* undo: the snapshot's queues go back out */
+		while(--i >= 0){
+			qfree(queues[done[i]]);
+			queues[done[i]] = NULL;
+		}
+		goto out;
+	}
+	if (h.noncectr > noncectr)
+		noncectr = h.noncectr;
+	rv = h.nq;
+
+out:
+	(void) free(done);
+	(void) free(rd);
+	return(rv);
+}
+
+/*
+ * snapshot the statistics of an existing queue
+ *
+ * PARAMETERS:	QTICKET qno	ticket for the queue involved
+ *		struct qstats *st	where to put the counters
+ * RETURNED:	int		error code
+ * ERRORS:	QE_BADPARAM	st is NULL
+ *		QE_BADTICKET	parameter refers to deleted, unallocated,
+ *				or invalid queue (from readref()).
+ * 		QE_INTINCON	queue is internally inconsistent (from
+ *				readref()).
+ *		QE_NOTSUPP	library compiled without QSTATS
+ * EXCEPTIONS:	none
+ */
+int queue_stats(QTICKET qno, struct qstats *st)
+{
+	register int cur;	/* index of current queue */
+
+	if (st == NULL){
+		ERRBUF("queue_stats: NULL pointer for statistics");
+		return(QE_BADPARAM);
+	}
+
+	/*
+	 * check that qno refers to an existing queue;
+	 * readref sets error code
+	 */
+	if (QE_ISERROR(cur = readref(qno)))
+		return(cur);
+
+#ifdef QSTATS
+	*st = queues[cur]->stats;
+	return(QE_NONE);
+#else
+	ERRBUF("queue_stats: statistics not compiled in (need QSTATS)");
+	return(QE_NOTSUPP);
+#endif
+}
+
+/*
+ * compute how long elements stayed in an existing queue
+ * the histogram is read without stopping the queue's users, so
+ * a snapshot taken while elements are being taken off may be
+ * off by the elements in flight
+ *
+ * PARAMETERS:	QTICKET qno	ticket for the queue involved
+ *		struct qlatency *lt	where to put the figures
+ * RETURNED:	int		error code
+ * ERRORS:	QE_BADPARAM	lt is NULL
+ *		QE_BADTICKET	parameter refers to deleted, unallocated,
+ *				or invalid queue (from readref()).
+ * 		QE_INTINCON	queue is internally inconsistent (from
+ *				readref()).
+ *		QE_NOTSUPP	library compiled without QLATENCY
+ * EXCEPTIONS:	none
+ */
+int queue_latency(QTICKET qno, struct qlatency *lt)
+{
+	register int cur;	/* index of current queue */
+#ifdef QLATENCY
+	register QUEUE *q;	/* pointer to queue structure */
+	register int b;		/* current histogram bucket */
+	unsigned long seen;	/* elements in buckets so far */
+	unsigned long long *pp;	/* next percentile to fill in */
+	double scale;		/* nanoseconds per tick */
+	static const double pct[] = { 0.50, 0.99, 0.999 };
+	int i;
+#endif
+
+	if (lt == NULL){
+		ERRBUF("queue_latency: NULL pointer for latencies");
+		return(QE_BADPARAM);
+	}
+
+	/*
+	 * check that qno refers to an existing queue;
+	 * readref sets error code
+	 */
+	if (QE_ISERROR(cur = readref(qno)))
+		return(cur);
+
+#ifdef QLATENCY
+	q = queues[cur];
+	(void) memset(lt, 0, sizeof(struct qlatency));
+	for(b = 0; b < NLBUCKET; b++)
+		lt->count += q->hist[b];
+	if (lt->count == 0)
+		return(QE_NONE);
+
+	/* walk the buckets once, picking off each percentile */
+	scale = clkscale();
+	pp = &lt->p50;
+	seen = 0;
+	for(b = i = 0; b < NLBUCKET && i < 3; b++){
+		seen += q->hist[b];
+		while(i < 3 && seen > pct[i] * lt->count){
+			pp[i++] = (unsigned long long) (lvalue(b) * scale);
+		}
+	}
+	lt->min = (unsigned long long) (q->lmin * scale);
+	lt->max = (unsigned long long) (q->lmax * scale);
+
+	/* a bucket midpoint may lie outside what was actually seen */
+	for(i = 0; i < 3; i++)
+		if (pp[i] < lt->min)
+			pp[i] = lt->min;
+		else if (pp[i] > lt->max)
+			pp[i] = lt->max;
+	return(QE_NONE);
+#else
+	ERRBUF("queue_latency: latencies not compiled in (need QLATENCY)");
+	return(QE_NOTSUPP);
+#endif
+}
+
+/*
+ * describe every live queue
+ * this walks queues[] without stopping anybody, so each entry
+ * is consistent only to the extent the queue was not being
+ * changed while it was read; entries come out in index order
+ *
+ * PARAMETERS:	struct qinfo *buf	where to put the descriptions
+ *		int nbuf		number of entries in buf
+ * RETURNED:	int		number of live queues (may exceed nbuf,
+ *				in which case only the first nbuf are
+ *				described) or error code
+ * ERRORS:	QE_BADPARAM	buf is NULL but nbuf > 0, or nbuf < 0
+ * EXCEPTIONS:	none
+ */
+int queue_dump(struct qinfo *buf, int nbuf)
+{
+	register int cur;	/* index of current queue */
+	register int n;		/* number of live queues seen */
+	register QUEUE *q;	/* pointer to queue structure */
+	unsigned long long now;	/* time of the snapshot */
+
+	if (nbuf < 0 || (buf == NULL && nbuf > 0)){
+		ERRBUF2("queue_dump: bad buffer (%d entries)", nbuf);
+		return(QE_BADPARAM);
+	}
+
+	now = clkns();
+	for(cur = n = 0; cur < MAXQ; cur++){
+		if ((q = queues[cur]) == NULL)
+			continue;
+		if (n < nbuf){
+			buf[n].ticket = q->ticket;
+			buf[n].index = cur;
+			buf[n].kind = q->kind;
+			buf[n].count = q->kind == QK_DEQUE ? qdeque_count(q->dq) :
+				q->kind == QK_BCAST ? qbcast_count(q->bc) :
+				q->kind == QK_SHARD ? qshard_count(q->sh) :
+				q->kind == QK_PART ? qpart_count(q->pt) :
+				q->kind == QK_SCHED ? sactive(q) : q->count;
+			buf[n].size = q->size;
+			buf[n].spilled = q->sp != NULL ? qspill_count(q->sp) : 0;
+			buf[n].age = now - q->born;
+#ifdef QSTATS
+			buf[n].stats = q->stats;
+#else
+			(void) memset(&buf[n].stats, 0, sizeof(struct qstats));
+#endif
+		}
+		n++;
+	}
+
+	return(n);
+}
+
+/*
+ * describe every live queue as text: either one line per queue,
+ * or a JSON array of objects with the fields of struct qinfo
+ * (its stats flattened in; the running count of puts spilled is
+ * "spilled_total", or spilltot in text, beside "spilled", the
+ * elements in the spill file now);
+ * like snprintf, the output is always NUL-terminated (if len > 0)
+ * and the length it needed is returned, so a caller seeing a
+ * return >= len can retry with a bigger buffer
+ *
+ * PARAMETERS:	char *buf	where to put the text
+ *		int len		size of buf
+ *		int how		QD_TEXT or QD_JSON
+ * RETURNED:	int		length of the full text (excluding
+ *				the NUL) or error code
+ * ERRORS:	QE_BADPARAM	buf is NULL but len > 0, len < 0, or
+ *				how is not a known format
+ *		QE_NOROOM	no memory for the snapshot
+ * EXCEPTIONS:	none
+ */
+int queue_dump_text(char *buf, int len, int how)
+{
+	struct qinfo *qi;	/* snapshot of the queues */
+	register int nq;	/* number of queues in it */
+	register int i;		/* index of current entry */
+	register int n;		/* length of the text so far */
+	char *p;		/* where the next piece goes */
+
+	if (len < 0 || (buf == NULL && len > 0)){
+		ERRBUF2("queue_dump_text: bad buffer (%d bytes)", len);
+		return(QE_BADPARAM);
+	}
+	if (how != QD_TEXT && how != QD_JSON){
+		ERRBUF2("queue_dump_text: unknown format %d", how);
+		return(QE_BADPARAM);
+	}
+
+	/* take the snapshot first, so the text is of one moment */
+	if (QE_ISERROR(nq = queue_dump(NULL, 0)))
+		return(nq);
+	if ((qi = malloc((nq + 1) * sizeof(struct qinfo))) == NULL){
+		ERRBUF("queue_dump_text: malloc: no more memory");
+		return(QE_NOROOM);
+	}
+	if ((i = queue_dump(qi, nq)) < nq)
+		nq = i;
+
+	/*
+	 * append each piece; p stays within buf, n counts everything
+	 */
+#define QDPUT(fmt, ...)	(n += snprintf(p, n < len ? len - n : 0, fmt, __VA_ARGS__), \
+				p = buf + (n < len ? n : (len > 0 ? len - 1 : 0)))
+	n = 0;
+	p = buf;
+	if (how == QD_JSON)
+		QDPUT("%s", "[");
+	for(i = 0; i < nq; i++){
+		if (how == QD_JSON)
+			QDPUT("%s{\"ticket\":%u,\"index\":%d,\"kind\":%d,"
+				"\"count\":%d,\"size\":%d,\"spilled\":%ld,"
+				"\"age_ns\":%llu,\"enqueued\":%lu,\"dequeued\":%lu,"
+				"\"full\":%lu,\"empty\":%lu,\"spilled_total\":%lu,"
+				"\"expired\":%lu,\"throttled\":%lu,\"hiwater\":%d}",
+				i ? "," : "", qi[i].ticket, qi[i].index,
+				qi[i].kind, qi[i].count, qi[i].size,
+				qi[i].spilled, qi[i].age,
+				qi[i].stats.enqueued, qi[i].stats.dequeued,
+				qi[i].stats.full, qi[i].stats.empty,
+				qi[i].stats.spilled, qi[i].stats.expired, qi[i].stats.throttled,
+				qi[i].stats.hiwater);
+		else
+			QDPUT("queue %u: index=%d kind=%d count=%d size=%d "
+				"spilled=%ld age=%llums enq=%lu deq=%lu full=%lu "
+				"empty=%lu spilltot=%lu expired=%lu throttled=%lu "
+				"hiwater=%d\n",
+				qi[i].ticket, qi[i].index, qi[i].kind, qi[i].count,
+				qi[i].size, qi[i].spilled, qi[i].age / 1000000,
+				qi[i].stats.enqueued, qi[i].stats.dequeued,
+				qi[i].stats.full, qi[i].stats.empty,
+				qi[i].stats.spilled, qi[i].stats.expired, qi[i].stats.throttled,
+				qi[i].stats.hiwater);
+	}
+	if (how == QD_JSON)
+		QDPUT("%s", "]\n");
+#undef QDPUT
+
+	(void) free(qi);
+	return(n);
+}
@@ -26,12 +26,117 @@ typedef unsigned int QTICKET;
 #define QE_INTINCON	-8		/* internal inconsistency */
 #define	QE_TOOFULL	-9		/* queue is too full */
 #define QE_INVALIDSIZE -10
+#define QE_NOTSUPP	-11		/* feature not compiled in */
+#define QE_WRONGKIND	-12		/* not an operation of this kind
+					   of queue */
+#define QE_NOTYET	-13		/* no element is ready yet */
+#define QE_NOTFOUND	-14		/* no element has that value */
+
+/*
+ * kinds of queue (see queue_dump())
+ */
+#define QK_FIFO		0		/* first in, first out */
+#define QK_PRIO		1		/* least priority first */
+#define QK_LANES	2		/* a FIFO per priority */
+#define QK_DEQUE	3		/* work-stealing deque */
+#define QK_DELAY	4		/* elements ready after a delay */
+#define QK_BCAST	5		/* every subscriber takes every elt */
+#define QK_SHARD	6		/* a FIFO per CPU, stealing */
+#define QK_PART		7		/* a FIFO per partition of keys */
+#define QK_SCHED	8		/* serves other queues in turn */
+
+/*
+ * queue_set_ttl(): forget all expiries
+ */
+#define QTTL_OFF	(-1L)
+
+/*
+ * queue_set_watermarks(): the function it calls, with the ticket,
+ * which watermark the count has crossed, and the argument given
+ */
+typedef void (*QWMFN)(QTICKET, int, void *);
+#define QWM_LOW		0		/* down to the low one */
+#define QWM_HIGH	1		/* up to the high one */
+
+/*
+ * per-queue statistics, as returned by queue_stats();
+ * counted from queue creation (only kept if qlib.c is
+ * compiled with QSTATS)
+ */
+struct qstats {
+	unsigned long enqueued;		/* elements put on the queue */
+	unsigned long dequeued;		/* elements taken off the queue */
+	unsigned long full;		/* puts refused, queue full */
+	unsigned long empty;		/* takes refused, queue empty */
+	unsigned long spilled;		/* puts sent to the spill file */
+	unsigned long expired;		/* elements dropped, time up */
+	unsigned long throttled;	/* takes refused, out of tokens */
+	int hiwater;			/* most elements ever queued at once */
+};
+
+/*
+ * time elements spent in a queue, as returned by queue_latency();
+ * all times in nanoseconds, percentiles accurate to about 12%
+ * (only kept if qlib.c is compiled with QLATENCY)
+ */
+struct qlatency {
+	unsigned long count;		/* elements measured */
+	unsigned long long min;		/* shortest stay */
+	unsigned long long max;		/* longest stay */
+	unsigned long long p50;		/* median stay */
+	unsigned long long p99;		/* 99th percentile */
+	unsigned long long p999;	/* 99.9th percentile */
+};
+
+/*
+ * description of one live queue, as returned by queue_dump();
+ * stats is all zeroes unless qlib.c is compiled with QSTATS
+ */
+struct qinfo {
+	QTICKET ticket;			/* ticket of the queue */
+	int index;			/* slot it occupies in the registry */
+	int kind;			/* QK_FIFO, QK_PRIO, ... */
+	int count;			/* elements in it when looked at */
+	int size;			/* its capacity */
+	long spilled;			/* elements more, in its spill file */
+	unsigned long long age;		/* nanoseconds since it was created */
+	struct qstats stats;		/* its counters */
+};
+
+/*
+ * the elements of a FIFO queue in place, front to back, as
+ * returned by queue_spans(): first p[0][0 .. n[0]-1], then
+ * p[1][0 .. n[1]-1]
+ */
+struct qspans {
+	const int *p[2];		/* the runs of elements */
+	int n[2];			/* elements in each */
+};
+
+/*
+ * group commit thresholds for create_durable_queue(); a zero
+ * field means the default
+ */
+struct qwalopts {
+	int batch;			/* commit every batch records (256) */
+	long maxdelay;			/* ... or when the oldest waited this
+					   many microseconds (1000) */
+	long logmax;			/* checkpoint past this many bytes
+					   of log (16MB) */
+};
+
+/*
+ * formats for queue_dump_text()
+ */
+#define QD_TEXT		0		/* one line per queue */
+#define QD_JSON		1		/* a JSON array of objects */
 
 /*
  * the error buffer; contains a message describing the last queue
- * error (but is NUL if no error encountered); not cleared on success
+ * error in this thread (but is NUL if no error encountered); not
+ * cleared on success
  */
-extern char qe_errbuf[256];
+extern _Thread_local char qe_errbuf[256];
 
 /*
  * forward declarations, for K&R and ANSI C
@@ -40,3 +145,68 @@ QTICKET create_queue(int);		/* create a queue */
 int delete_queue(QTICKET);		/* delete a queue */
 int put_on_queue(QTICKET, int);		/* put number on end of queue */
 int take_off_queue(QTICKET);		/* pull number off front of queue */
+int queue_push_front(QTICKET, int);	/* put number on front of queue */
+int queue_pop_back(QTICKET);		/* pull number off end of queue */
+int queue_peek_front(QTICKET);		/* number take_off_queue would get */
+int queue_peek_back(QTICKET);		/* number queue_pop_back would get */
+int queue_at(QTICKET, int);		/* number i from the front */
+int queue_spans(QTICKET, struct qspans *);	/* all of them, in place */
+int queue_transfer(QTICKET, QTICKET, int);	/* move numbers across */
+int queue_find(QTICKET, int);		/* where a number is in it */
+int queue_remove_if(QTICKET, int, int);	/* drop numbers in a range */
+int queue_stats(QTICKET, struct qstats *);	/* snapshot the counters */
+int queue_latency(QTICKET, struct qlatency *);	/* sojourn percentiles */
+int queue_dump(struct qinfo *, int);	/* describe all live queues */
+int queue_dump_text(char *, int, int);	/* ... as text or JSON */
+QTICKET create_file_queue(const char *, int);	/* queue kept in a file */
+int queue_sync(QTICKET);		/* flush it to disk */
+QTICKET create_durable_queue(const char *, int, const struct qwalopts *);
+					/* queue with a write-ahead log */
+int queue_commit(QTICKET);		/* commit its log now */
+int qlib_snapshot(int);			/* save all queues to a file */
+int qlib_restore(int);			/* ... and bring them back */
+int queue_set_spill(QTICKET, const char *, int);	/* overflow to a file */
+int queue_set_ttl(QTICKET, long);	/* expire elements after a time */
+int put_on_queue_ttl(QTICKET, int, long);	/* ... or this one's time */
+int queue_set_rate(QTICKET, long, int);	/* limit takes with a bucket */
+int queue_token_wait(QTICKET);		/* usecs until it has a token */
+int queue_set_watermarks(QTICKET, int, int, QWMFN, void *);
+					/* say when it fills and drains */
+QTICKET create_prio_queue(int, int);	/* create a priority queue */
+QTICKET create_lane_queue(int, int);	/* create a lane queue */
+int put_on_prio_queue(QTICKET, int, int);	/* put number in either */
+QTICKET create_delay_queue(int, long);	/* create a delay queue */
+int put_on_delay_queue(QTICKET, int, long);	/* put number in it */
+QTICKET create_deque(int);		/* create a work-stealing deque */
+int deque_push(QTICKET, int);		/* owner: put number on bottom */
+int deque_pop(QTICKET);			/* owner: pull number off bottom */
+int deque_steal(QTICKET);		/* anyone: pull number off top */
+QTICKET create_bcast_queue(int, int);	/* create a broadcast queue */
+int bcast_subscribe(QTICKET);		/* add a subscriber to it */
+int bcast_unsubscribe(QTICKET, int);	/* ... or drop one */
+int bcast_put(QTICKET, int);		/* writer: put number on it */
+int bcast_take(QTICKET, int);		/* subscriber: pull next number */
+QTICKET create_shard_queue(int, int);	/* create a sharded queue */
+int shard_put(QTICKET, int);		/* anyone: put number on it */
+int shard_take(QTICKET);		/* anyone: pull number off it */
+QTICKET create_part_queue(int, int);	/* create a partitioned queue */
+int put_on_part_queue(QTICKET, int, int);	/* put number, with key */
+int part_take(QTICKET, int, int);	/* group member: pull number */
+int part_of_key(QTICKET, int);		/* partition a key goes to */
+QTICKET create_sched(void);		/* create a scheduler */
+int sched_attach(QTICKET, QTICKET, int);	/* attach a queue to it */
+int sched_detach(QTICKET);		/* ... or detach one */
+int sched_take(QTICKET, QTICKET *);	/* pull number off the next one */
+
+/*
+ * queues in POSIX shared memory, usable from every process
+ * attached to the same region (see qshm.c)
+ */
+typedef struct qshm QSHM;		/* handle on an attached region */
+int qshm_open(const char *, int, int, QSHM **);	/* create or attach */
+int qshm_close(QSHM *);			/* detach */
+int qshm_unlink(const char *);		/* remove region name */
+QTICKET qshm_create_queue(QSHM *, int);	/* create a queue in it */
+int qshm_delete_queue(QSHM *, QTICKET);	/* delete a queue in it */
+int qshm_put(QSHM *, QTICKET, int);	/* put number on end of queue */
+int qshm_take(QSHM *, QTICKET);		/* pull number off front of queue */
@@ -0,0 +1,254 @@
+/*
+ * qpart.c
+ *
+ * Partitioned queues, behind the partitioned queues of
+ * create_part_queue() in qlib.c: a put carries a key, and the key
+ * picks one of a fixed number of partitions, each a FIFO ring of
+ * its own. All elements with one key go to one partition and so
+ * come off in the order they were put, while different partitions
+ * are drained in parallel by the members of a consumer group,
+ * each owning some of them.
+ *
+ * Internal Representation:
+ * Each partition is a single-producer, single-consumer ring, read
+ * as the rings of qshm.c are: two free-running counters, tail
+ * (elements ever put) and head (elements ever taken), element i in
+ * ring[i & mask]. Only the producer writes tail and only the
+ * partition's owner writes head, so neither takes a lock; the
+ * element is stored before tail is published, and read before head
+ * is. Each side also keeps the last value it saw of the other's
+ * counter, on its own cache line with its own counter, and looks
+ * at the other's line only when that copy says the ring is full
+ * (or empty). The key is hashed before it picks a partition, so
+ * keys that differ only in their high bits still spread out.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include "qlib.h"
+#include "qpriv.h"
+
+#define PLINE	64		/* bytes in a cache line */
+#define PMAX	4096		/* most partitions */
+
+/*
+ * a partition
+ */
+struct ppart {
+	_Alignas(PLINE) atomic_ullong tail;	/* producer: elements put */
+	unsigned long long hseen;		/* ... head when last looked */
+	_Alignas(PLINE) atomic_ullong head;	/* owner: elements taken */
+	unsigned long long tseen;		/* ... tail when last looked */
+	int rr;				/* ... partition it takes from next,
+					   if it owns this one first */
+	_Alignas(PLINE) int *ring;		/* the elements */
+};
+
+/*
+ * a partitioned queue
+ */
+struct qpart {
+	int npart;		/* number of partitions */
+	unsigned int mask;	/* slots per partition - 1 */
+	struct ppart *p;	/* the partitions */
+};
+
+/*
+ * make a partitioned queue
+ *
+ * PARAMETERS:	int size	least capacity of each partition
+ *				(rounded up to a power of two)
+ *		int npart	number of partitions
+ *		struct qpart **pp	where to put it
+ * RETURNED:	int		error code
+ * ERRORS:	QE_INVALIDSIZE	size or npart is not positive, or too
+ *				big
+ *		QE_NOROOM	no memory
+ *				(qe_errbuf has descriptive string)
+ * EXCEPTIONS:	none
+ */
+int qpart_open(int size, int npart, struct qpart **pp)
+{
+	register struct qpart *t;	/* new queue */
+	register unsigned int n;	/* slots per partition */
+	register int i;			/* counter */
+	void *p;			/* aligned block for the partitions */
+
+	if (size <= 0 || size > (1 << 24) || npart <= 0 || npart > PMAX){
+		ERRBUF3("qpart_open: invalid size (%d) or partitions (%d)",
+								size, npart);
+		return(QE_INVALIDSIZE);
+	}
+	for(n = 1; n < (unsigned int) size; n <<= 1)
+		;
+	if ((unsigned long long) n * npart > (1U << 30)){
+		ERRBUF3("qpart_open: %d partitions of %u is too big", npart, n);
+		return(QE_INVALIDSIZE);
+	}
+	if ((t = malloc(sizeof(struct qpart))) == NULL ||
+	    posix_memalign(&p, PLINE, npart * sizeof(struct ppart)) != 0){
+		ERRBUF("qpart_open: malloc: no more memory");
+		(void) free(t);
+		return(QE_NOROOM);
+	}
+	t->p = p;
+	t->mask = n - 1;
+	for(i = 0; i < npart; i++){
+		if ((t->p[i].ring = malloc(n * sizeof(int))) == NULL){
+			ERRBUF("qpart_open: malloc: no more memory");
+			t->npart = i;
+			qpart_close(t);
+			return(QE_NOROOM);
+		}
+		atomic_init(&t->p[i].tail, 0);
+		atomic_init(&t->p[i].head, 0);
+		t->p[i].hseen = t->p[i].tseen = 0;
+		t->p[i].rr = i;
+	}
+	t->npart = npart;
+	*pp = t;
+	return(QE_NONE);
+}
+
+/*
+ * the partition a key goes to: its bits mixed (the finalizer of
+ * MurmurHash3), then scaled onto 0 .. npart-1 by a multiply
+ */
+int qpart_of(struct qpart *t, int key)
+{
+	register unsigned int h = (unsigned int) key;	/* the hash */
+
+	h ^= h >> 16;
+	h *= 0x85ebca6bU;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35U;
+	h ^= h >> 16;
+	return((int) (((unsigned long long) h * t->npart) >> 32));
+}
+
+/*
+ * put an element on the partition of its key; the producer only
+ *
+ * PARAMETERS:	struct qpart *t	the queue
+ *		int key		its key
+ *		int n		element to put
+ * RETURNED:	int		error code
+ * ERRORS:	QE_TOOFULL	the key's partition is full
+ * EXCEPTIONS:	none
+ */
+int qpart_put(struct qpart *t, int key, int n)
+{
+	register struct ppart *p = &t->p[qpart_of(t, key)];	/* partition */
+	register unsigned long long i;	/* number of this element */
+
+	i = atomic_load_explicit(&p->tail, memory_order_relaxed);
+	if (i - p->hseen > t->mask &&
+	    i - (p->hseen = atomic_load_explicit(&p->head,
+				memory_order_acquire)) > t->mask){
+		ERRBUF2("qpart_put: partition full (max %u elts)", t->mask + 1);
+		return(QE_TOOFULL);
+	}
+	p->ring[i & t->mask] = n;
+	atomic_store_explicit(&p->tail, i + 1, memory_order_release);
+	return(QE_NONE);
+}
+
+/* take from partition k into *n; 0 if done, -1 if it is empty */
+static int ptake(struct qpart *t, int k, int *n)
+{
+	register struct ppart *p = &t->p[k];	/* the partition */
+	register unsigned long long i;		/* number of its next element */
+
+	i = atomic_load_explicit(&p->head, memory_order_relaxed);
+	if (i == p->tseen &&
+	    i == (p->tseen = atomic_load_explicit(&p->tail,
+				memory_order_acquire)))
+		return(-1);
+	*n = p->ring[i & t->mask];
+	atomic_store_explicit(&p->head, i + 1, memory_order_release);
+	return(0);
+}
+
+/*
+ * take an element for one member of a consumer group of nmember,
+ * from the partitions it owns: member, member + nmember, and so
+ * on. They are taken from in turn, so none is starved; that
+ * member's thread only
+ *
+ * PARAMETERS:	struct qpart *t	the queue
+ *		int member	the member taking
+ *		int nmember	members in the group
+ *		int *n		where to put the element
+ * RETURNED:	int		error code
+ * ERRORS:	QE_BADPARAM	member is not in the group, or owns no
+ *				partition
+ *		QE_EMPTY	all its partitions are empty
+ * EXCEPTIONS:	none
+ */
+int qpart_take(struct qpart *t, int member, int nmember, int *n)
+{
+	register int k;		/* partition to try */
+	register int i;		/* counter */
+	register int *rr;	/* where the turn is kept */
+
+	if (member < 0 || member >= nmember || member >= t->npart){
+		ERRBUF3("qpart_take: member %d of %d owns no partition",
+							member, nmember);
+		return(QE_BADPARAM);
+	}
+	/* the turn lives with the first partition the member owns */
+	rr = &t->p[member].rr;
+	if ((k = *rr) >= t->npart || k % nmember != member)
+		k = member;
+	for(i = 0; i < t->npart; i += nmember){
+		if (ptake(t, k, n) == 0){
+			*rr = k + nmember < t->npart ? k + nmember : member;
+			return(QE_NONE);
+		}
+		if ((k += nmember) >= t->npart)
+			k = member;
+	}
+	ERRBUF("qpart_take: partitions empty");
+	return(QE_EMPTY);
+}
+
+/*
+ * number of elements in a partitioned queue; only a hint while it
+ * is in use
+ */
+int qpart_count(struct qpart *t)
+{
+	register long long n = 0;	/* elements so far */
+	register long long k;		/* in one partition */
+	register int i;			/* counter */
+
+	for(i = 0; i < t->npart; i++)
+		if ((k = (long long) (atomic_load_explicit(&t->p[i].tail,
+					memory_order_relaxed) -
+		    atomic_load_explicit(&t->p[i].head,
+					memory_order_relaxed))) > 0)
+			n += k;
+	return((int) n);
+}
+
+/*
+ * capacity of a partitioned queue
+ */
+int qpart_size(struct qpart *t)
+{
+	return((int) ((t->mask + 1) * t->npart));
+}
+
+/*
+ * free a partitioned queue; nobody may be using it
+ */
+void qpart_close(struct qpart *t)
+{
+	register int i;		/* counter */
+
+	for(i = 0; i < t->npart; i++)
+		(void) free(t->p[i].ring);
+	(void) free(t->p);
+	(void) free(t);
+}
@@ -0,0 +1,108 @@
+/*
+ * This file contains the definitions shared among the modules
+ * of the qlib library; external programs have no business with
+ * them (they use qlib.h).
+ */
+
+/*
+ * tickets: index number + IOFFSET,,nonce + NOFFSET (see qtktref()
+ * in qlib.c)
+ */
+#define IOFFSET	0x1221		/* used to hide index number in ticket */
+#define NOFFSET	0x0502		/* used to hide nonce in ticket */
+
+/*
+ * error handling
+ * macros to fill qe_errbuf (defined in qlib.c)
+ */
+#define ERRBUF(str)	(void) strncpy(qe_errbuf, str, sizeof(qe_errbuf))
+#define ERRBUF2(str,n)		(void) sprintf(qe_errbuf, str, n)
+#define ERRBUF3(str,n,m)	(void) sprintf(qe_errbuf, str, n, m)
+
+/*
+ * the write-ahead log of durable queues (see qwal.c)
+ */
+#define QW_PUT	0		/* qwal_append(): put on the back */
+#define QW_TAKE	1		/* ... take off the front */
+#define QW_PUSH	2		/* ... put on the front */
+#define QW_POP	3		/* ... take off the back */
+struct qwal;
+int qwal_open(const char *, const struct qwalopts *, int, int *, int *,
+					int *, struct qwal **);
+int qwal_append(struct qwal *, int, int);
+int qwal_commit(struct qwal *);
+int qwal_checkpoint(struct qwal *, const int *, int, int, int);
+int qwal_close(struct qwal *);
+
+/*
+ * the overflow file of spilling queues (see qspill.c)
+ */
+struct qspill;
+int qspill_open(const char *, int, struct qspill **);
+int qspill_put(struct qspill *, int);
+int qspill_refill(struct qspill *, int *, int, int, int *);
+int qspill_back(struct qspill *, int, int *);
+long qspill_count(struct qspill *);
+void qspill_close(struct qspill *);
+
+/*
+ * work-stealing deques (see qdeque.c)
+ */
+struct qdeque;
+int qdeque_open(int, struct qdeque **);
+int qdeque_push(struct qdeque *, int);
+int qdeque_pop(struct qdeque *, int *);
+int qdeque_steal(struct qdeque *, int *);
+int qdeque_count(struct qdeque *);
+int qdeque_size(struct qdeque *);
+void qdeque_close(struct qdeque *);
+
+/*
+ * the timing wheels of delay queues (see qtwheel.c)
+ */
+struct qtwheel;
+int qtw_open(int, unsigned long long, unsigned long long, struct qtwheel **);
+void qtw_put(struct qtwheel *, int, unsigned long long);
+int qtw_take(struct qtwheel *, unsigned long long, int, int *);
+void qtw_close(struct qtwheel *);
+
+/*
+ * broadcast rings (see qbcast.c)
+ */
+struct qbcast;
+int qbcast_open(int, int, struct qbcast **);
+int qbcast_put(struct qbcast *, int);
+int qbcast_take(struct qbcast *, int, int *);
+int qbcast_subscribe(struct qbcast *);
+int qbcast_unsubscribe(struct qbcast *, int);
+int qbcast_count(struct qbcast *);
+int qbcast_size(struct qbcast *);
+void qbcast_close(struct qbcast *);
+
+/*
+ * sharded queues (see qshard.c)
+ */
+struct qshard;
+int qshard_open(int, int, struct qshard **);
+int qshard_put(struct qshard *, int);
+int qshard_take(struct qshard *, int *);
+int qshard_count(struct qshard *);
+int qshard_size(struct qshard *);
+void qshard_close(struct qshard *);
+
+/*
+ * partitioned queues (see qpart.c)
+ */
+struct qpart;
+int qpart_open(int, int, struct qpart **);
+int qpart_of(struct qpart *, int);
+int qpart_put(struct qpart *, int, int);
+int qpart_take(struct qpart *, int, int, int *);
+int qpart_count(struct qpart *);
+int qpart_size(struct qpart *);
+void qpart_close(struct qpart *);
+
+/*
+ * range search of runs of elements (see qscan.c)
+ */
+int qscan(const int *, int, int, int);
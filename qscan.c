@@ -0,0 +1,132 @@
+/*
+ * qscan.c
+ *
+ * Searching a run of elements for the first whose value lies in
+ * a range, behind queue_find() and queue_remove_if() in qlib.c.
+ * On x86 the run is looked at 8 elements at a time with AVX2, or
+ * 4 at a time with SSE4.1, whichever the CPU has (asked each time,
+ * which costs a load and a test), and otherwise one at a time.
+ * The vector loops look at four vectors before testing any, so a
+ * run with nothing in range goes by at about the speed memory
+ * delivers it.
+ *
+ * Internal Representation:
+ * x lies in [lo, hi] exactly when x - lo, taken as unsigned, is
+ * no more than hi - lo, so one subtraction and one unsigned
+ * comparison test both ends at once. Neither instruction set
+ * compares unsigned integers directly; x - lo is no more than
+ * hi - lo when the unsigned maximum of the two is hi - lo, which
+ * is an equality test.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "qlib.h"
+#include "qpriv.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+/* first of p[0 .. n-1] in [lo, hi], or n; one at a time */
+static int scan1(const int *p, int n, int lo, int hi)
+{
+	register unsigned int r = (unsigned int) hi - lo;	/* range */
+	register int i;						/* counter */
+
+	for(i = 0; i < n; i++)
+		if ((unsigned int) p[i] - lo <= r)
+			break;
+	return(i);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/* the same, 8 at a time with AVX2 */
+__attribute__((target("avx2")))
+static int scan8(const int *p, int n, int lo, int hi)
+{
+	const __m256i vlo = _mm256_set1_epi32(lo);	/* lo, in each lane */
+	const __m256i vr = _mm256_set1_epi32((int) ((unsigned int) hi - lo));
+							/* hi - lo, likewise */
+	__m256i m[4];					/* lanes in range */
+	__m256i t;					/* ... in any */
+	register int i, j;				/* counters */
+	register unsigned int b;			/* ... as bits */
+
+#define IN8(k)	_mm256_cmpeq_epi32(_mm256_max_epu32(_mm256_sub_epi32( \
+		_mm256_loadu_si256((const __m256i *) (p + i + 8 * (k))), vlo), \
+		vr), vr)
+	for(i = 0; i + 32 <= n; i += 32){
+		m[0] = IN8(0);
+		m[1] = IN8(1);
+		m[2] = IN8(2);
+		m[3] = IN8(3);
+		t = _mm256_or_si256(_mm256_or_si256(m[0], m[1]),
+					_mm256_or_si256(m[2], m[3]));
+		if (_mm256_testz_si256(t, t))
+			continue;
+		for(j = 0; j < 4; j++)
+			if ((b = _mm256_movemask_ps(_mm256_castsi256_ps(m[j]))) != 0)
+				return(i + 8 * j + __builtin_ctz(b));
+	}
+	for(; i + 8 <= n; i += 8)
+		if ((b = _mm256_movemask_ps(_mm256_castsi256_ps(IN8(0)))) != 0)
+			return(i + __builtin_ctz(b));
+#undef IN8
+	return(i + scan1(p + i, n - i, lo, hi));
+}
+
+/* the same, 4 at a time with SSE4.1 */
+__attribute__((target("sse4.1")))
+static int scan4(const int *p, int n, int lo, int hi)
+{
+	const __m128i vlo = _mm_set1_epi32(lo);		/* lo, in each lane */
+	const __m128i vr = _mm_set1_epi32((int) ((unsigned int) hi - lo));
+							/* hi - lo, likewise */
+	__m128i m[4];					/* lanes in range */
+	__m128i t;					/* ... in any */
+	register int i, j;				/* counters */
+	register unsigned int b;			/* ... as bits */
+
+#define IN4(k)	_mm_cmpeq_epi32(_mm_max_epu32(_mm_sub_epi32( \
+		_mm_loadu_si128((const __m128i *) (p + i + 4 * (k))), vlo), \
+		vr), vr)
+	for(i = 0; i + 16 <= n; i += 16){
+		m[0] = IN4(0);
+		m[1] = IN4(1);
+		m[2] = IN4(2);
+		m[3] = IN4(3);
+		t = _mm_or_si128(_mm_or_si128(m[0], m[1]),
+					_mm_or_si128(m[2], m[3]));
+		if (_mm_testz_si128(t, t))
+			continue;
+		for(j = 0; j < 4; j++)
+			if ((b = _mm_movemask_ps(_mm_castsi128_ps(m[j]))) != 0)
+				return(i + 4 * j + __builtin_ctz(b));
+	}
+	for(; i + 4 <= n; i += 4)
+		if ((b = _mm_movemask_ps(_mm_castsi128_ps(IN4(0)))) != 0)
+			return(i + __builtin_ctz(b));
+#undef IN4
+	return(i + scan1(p + i, n - i, lo, hi));
+}
+#endif
+
+/*
+ * find the first element of a run whose value is in a range
+ *
+ * PARAMETERS:	const int *p	the run
+ *		int n		elements in it
+ *		int lo, hi	the range, inclusive (lo <= hi)
+ * RETURNED:	int		index of that element, or n if none
+ * EXCEPTIONS:	none
+ */
+int qscan(const int *p, int n, int lo, int hi)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	if (__builtin_cpu_supports("avx2"))
+		return(scan8(p, n, lo, hi));
+	if (__builtin_cpu_supports("sse4.1"))
+		return(scan4(p, n, lo, hi));
+#endif
+	return(scan1(p, n, lo, hi));
+}
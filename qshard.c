@@ -0,0 +1,275 @@
+/*
+ * qshard.c
+ *
+ * Sharded queues, behind the sharded queues of create_shard_queue()
+ * in qlib.c: rather than one ring every thread fights over, a ring
+ * (a shard) per CPU. A put goes on the shard of the CPU the caller
+ * is running on, and a take tries that shard first and then steals
+ * from the others in turn, so while producers and consumers are
+ * spread over the CPUs each mostly touches lines only its own CPU
+ * uses.
+ *
+ * The price is order. Each shard is FIFO, so elements put from one
+ * CPU on to its own shard come off in the order they were put; but
+ * a put finding that shard full goes on to the next with room, and
+ * from there may be stolen before elements put earlier. Elements
+ * put from different CPUs come off in no particular order, and a
+ * thread that moves to another CPU between two puts may see them
+ * taken in either order.
+ *
+ * Internal Representation:
+ * Each shard is a bounded multi-producer, multi-consumer ring of
+ * cells as described by Dmitry Vyukov: every cell carries a
+ * sequence number saying whose turn it is, a put claims the cell
+ * at enq with a compare-and-swap, and a take the cell at deq
+ * likewise, so puts and takes on a shard do not wait on each
+ * other, only on other puts (or takes) on the same shard. enq and
+ * deq are on cache lines of their own, and each shard starts on a
+ * new line.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include "qlib.h"
+#include "qpriv.h"
+
+#define SHLINE	64		/* bytes in a cache line */
+#define SHMAX	1024		/* most shards */
+
+/*
+ * a cell of a shard
+ */
+struct shcell {
+	atomic_llong seq;	/* pos when free for the put of pos,
+				   pos + 1 when full for the take of pos */
+	int val;		/* the element */
+};
+
+/*
+ * a shard
+ */
+struct shard {
+	_Alignas(SHLINE) atomic_llong enq;	/* next put */
+	_Alignas(SHLINE) atomic_llong deq;	/* next take */
+	_Alignas(SHLINE) long long mask;	/* cells - 1 */
+	struct shcell *cell;			/* the ring */
+};
+
+/*
+ * a sharded queue
+ */
+struct qshard {
+	int nshard;		/* number of shards */
+	int size;		/* capacity of all of them */
+	struct shard *sh;	/* the shards */
+};
+
+/* the shard for the caller, by the CPU it is on */
+static _Thread_local int shnext;	/* ... if that is unknown */
+
+static int shhome(struct qshard *s)
+{
+	register int c;		/* the CPU */
+
+	if ((c = sched_getcpu()) < 0)
+		c = shnext++;
+	return(c % s->nshard);
+}
+
+/*
+ * make a sharded queue
+ *
+ * PARAMETERS:	int size	least capacity, shared out among the
+ *				shards (each rounded up to a power of
+ *				two)
+ *		int nshard	number of shards (0 for one per CPU)
+ *		struct qshard **sp	where to put it
+ * RETURNED:	int		error code
+ * ERRORS:	QE_INVALIDSIZE	size or nshard is not positive, or too
+ *				big
+ *		QE_NOROOM	no memory
+ *				(qe_errbuf has descriptive string)
+ * EXCEPTIONS:	none
+ */
+int qshard_open(int size, int nshard, struct qshard **sp)
+{
+	register struct qshard *s;	/* new queue */
+	register long long n;		/* cells per shard */
+	register int i, j;		/* counters */
+	void *p;			/* aligned block for the shards */
+
+	if (nshard == 0 && (nshard = (int) sysconf(_SC_NPROCESSORS_CONF)) <= 0)
+		nshard = 1;
+	if (size <= 0 || size > (1 << 30) || nshard < 0 || nshard > SHMAX){
+		ERRBUF3("qshard_open: invalid size (%d) or shards (%d)",
+								size, nshard);
+		return(QE_INVALIDSIZE);
+	}
+	for(n = 1; n * nshard < size; n <<= 1)
+		;
+	if ((s = malloc(sizeof(struct qshard))) == NULL ||
+	    posix_memalign(&p, SHLINE, nshard * sizeof(struct shard)) != 0){
+		ERRBUF("qshard_open: malloc: no more memory");
+		(void) free(s);
+		return(QE_NOROOM);
+	}
+	s->sh = p;
+	s->nshard = nshard;
+	s->size = (int) (n * nshard);
+	for(i = 0; i < nshard; i++){
+		if (posix_memalign(&p, SHLINE, n * sizeof(struct shcell)) != 0){
+			ERRBUF("qshard_open: malloc: no more memory");
+			s->nshard = i;
+			qshard_close(s);
+			return(QE_NOROOM);
+		}
+		s->sh[i].cell = p;
+		s->sh[i].mask = n - 1;
+		atomic_init(&s->sh[i].enq, 0);
+		atomic_init(&s->sh[i].deq, 0);
+		for(j = 0; j < n; j++)
+			atomic_init(&s->sh[i].cell[j].seq, j);
+	}
+	*sp = s;
+	return(QE_NONE);
+}
+
+/* put n on a shard; 0 if done, -1 if it is full */
+static int shput(struct shard *h, int n)
+{
+	register struct shcell *c;	/* cell to fill */
+	register long long d;		/* its seq - pos */
+	long long pos;			/* next put */
+
+	pos = atomic_load_explicit(&h->enq, memory_order_relaxed);
+	for(;;){
+		c = &h->cell[pos & h->mask];
+		d = atomic_load_explicit(&c->seq, memory_order_acquire) - pos;
+		if (d == 0){
+			if (atomic_compare_exchange_weak_explicit(&h->enq, &pos,
+					pos + 1, memory_order_relaxed,
+					memory_order_relaxed))
+				break;
+		}
+		else if (d < 0)
+			return(-1);
+		else
+			pos = atomic_load_explicit(&h->enq, memory_order_relaxed);
+	}
+	c->val = n;
+	atomic_store_explicit(&c->seq, pos + 1, memory_order_release);
+	return(0);
+}
+
+/* take from a shard into *n; 0 if done, -1 if it is empty */
+static int shtake(struct shard *h, int *n)
+{
+	register struct shcell *c;	/* cell to empty */
+	register long long d;		/* its seq - (pos + 1) */
+	long long pos;			/* next take */
+
+	pos = atomic_load_explicit(&h->deq, memory_order_relaxed);
+	for(;;){
+		c = &h->cell[pos & h->mask];
+		d = atomic_load_explicit(&c->seq, memory_order_acquire) - (pos + 1);
+		if (d == 0){
+			if (atomic_compare_exchange_weak_explicit(&h->deq, &pos,
+					pos + 1, memory_order_relaxed,
+					memory_order_relaxed))
+				break;
+		}
+		else if (d < 0)
+			return(-1);
+		else
+			pos = atomic_load_explicit(&h->deq, memory_order_relaxed);
+	}
+	*n = c->val;
+	atomic_store_explicit(&c->seq, pos + h->mask + 1, memory_order_release);
+	return(0);
+}
+
+/*
+ * put an element on the shard of the caller's CPU or, if that is
+ * full, on the next one that is not; any thread
+ *
+ * PARAMETERS:	struct qshard *s	the queue
+ *		int n		element to put
+ * RETURNED:	int		error code
+ * ERRORS:	QE_TOOFULL	every shard is full
+ * EXCEPTIONS:	none
+ */
+int qshard_put(struct qshard *s, int n)
+{
+	register int h = shhome(s);	/* shard to try */
+	register int i;			/* counter */
+
+	for(i = 0; i < s->nshard; i++, h = h + 1 == s->nshard ? 0 : h + 1)
+		if (shput(&s->sh[h], n) == 0)
+			return(QE_NONE);
+	ERRBUF2("qshard_put: queue full (max %d elts)", s->size);
+	return(QE_TOOFULL);
+}
+
+/*
+ * take an element from the shard of the caller's CPU or, if that
+ * is empty, steal one from the next one that is not; any thread
+ *
+ * PARAMETERS:	struct qshard *s	the queue
+ *		int *n		where to put the element
+ * RETURNED:	int		error code
+ * ERRORS:	QE_EMPTY	every shard is empty
+ * EXCEPTIONS:	none
+ */
+int qshard_take(struct qshard *s, int *n)
+{
+	register int h = shhome(s);	/* shard to try */
+	register int i;			/* counter */
+
+	for(i = 0; i < s->nshard; i++, h = h + 1 == s->nshard ? 0 : h + 1)
+		if (shtake(&s->sh[h], n) == 0)
+			return(QE_NONE);
+	ERRBUF("qshard_take: queue empty");
+	return(QE_EMPTY);
+}
+
+/*
+ * number of elements in a sharded queue; only a hint while it is
+ * in use
+ */
+int qshard_count(struct qshard *s)
+{
+	register long long n = 0;	/* elements so far */
+	register long long k;		/* in one shard */
+	register int i;			/* counter */
+
+	for(i = 0; i < s->nshard; i++)
+		if ((k = atomic_load_explicit(&s->sh[i].enq, memory_order_relaxed) -
+		    atomic_load_explicit(&s->sh[i].deq, memory_order_relaxed)) > 0)
+			n += k;
+	return((int) n);
+}
+
+/*
+ * capacity of a sharded queue
+ */
+int qshard_size(struct qshard *s)
+{
+	return(s->size);
+}
+
+/*
+ * free a sharded queue; nobody may be using it
+ */
+void qshard_close(struct qshard *s)
+{
+	register int i;		/* counter */
+
+	for(i = 0; i < s->nshard; i++)
+		(void) free(s->sh[i].cell);
+	(void) free(s->sh);
+	(void) free(s);
+}
@@ -0,0 +1,546 @@
+/*
+ * qshm.c
+ *
+ * Queues of integers living in a named POSIX shared memory region,
+ * so that separate processes attached to the same region can use
+ * them with plain loads and stores -- no sockets, no copies through
+ * the kernel.
+ *
+ * Internal Representation:
+ * The region starts with a header (struct shmhdr) holding a
+ * process-shared lock, a nonce generator, and a table of maxq
+ * queue slots (struct shmq); after the table comes an arena the
+ * rings are carved out of. Nothing in the region is a pointer:
+ * a slot refers to its ring by its offset from the start of the
+ * region, since each process maps the region at its own address.
+ *
+ * A ring is read with two free-running 64-bit counters: tail
+ * (number of elements ever put) and head (number ever taken);
+ * tail - head is the depth and element i lives in ring[i % size].
+ * The putter only writes tail and the taker only writes head, so
+ * one producer and one consumer (in any processes) need no lock --
+ * the element is stored before tail is published, and read before
+ * head is. The lock is only taken to create and delete queues.
+ *
+ * Arena space is handed out from the bottom up and never given
+ * back; a deleted queue's slot keeps its ring, which a later
+ * queue in that slot reuses if it is small enough.
+ *
+ * External Representation
+ * Queues are referred to by tickets built just as for private
+ * queues (see qlib.c), from the slot index and a nonce kept in the
+ * region; so a ticket handed from one process to another refers
+ * to the same queue in both, and a deleted queue's ticket stays
+ * invalid in all of them.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "qlib.h"
+#include "qpriv.h"
+
+/*
+ * various macros
+ */
+#define SHMMAGIC	0x51534d31	/* "QSM1": region is initialized */
+#define SHMALIGN	64		/* rings start on cache lines */
+
+/*
+ * one queue in the region; head and tail on their own cache lines
+ * so the producer and consumer don't fight over them
+ */
+struct shmq {
+	QTICKET ticket;			/* contains unique queue ID; 0 if free */
+	int size;			/* capacity of the queue */
+	size_t ring;			/* offset of its elements; 0 if none */
+	int ringcap;			/* elements the ring has room for */
+	_Alignas(SHMALIGN) atomic_ullong tail;	/* elements ever put on */
+	_Alignas(SHMALIGN) atomic_ullong head;	/* elements ever taken off */
+};
+
+/*
+ * the region header
+ */
+struct shmhdr {
+	atomic_uint magic;		/* SHMMAGIC once set up */
+	int maxq;			/* slots in qtab[] */
+	size_t len;			/* size of the whole region */
+	size_t brk;			/* first free byte of the arena */
+	unsigned int noncectr;		/* nonce generator, non-zero always */
+	pthread_mutex_t lock;		/* guards all of the above but magic */
+	struct shmq qtab[];		/* the queue slots */
+};
+
+/*
+ * a process's handle on an attached region
+ */
+struct qshm {
+	struct shmhdr *hdr;		/* where it is mapped */
+	size_t len;			/* how much is mapped */
+};
+
+/* element i of the ring of slot s */
+#define RING(h,s)	((int *)((char *)(h) + (s)->ring))
+
+/*
+ * take the region lock, cleaning up after a process that died
+ * holding it (creation and deletion leave the table consistent at
+ * every store, so there is nothing to repair)
+ *
+ * PARAMETERS:	struct shmhdr *h	region header
+ * RETURNED:	int		error code
+ * ERRORS:	QE_INTINCON	lock cannot be taken
+ * EXCEPTIONS:	none
+ */
+static int shmlock(struct shmhdr *h)
+{
+	register int e;		/* error from pthreads */
+
+	if ((e = pthread_mutex_lock(&h->lock)) == EOWNERDEAD)
+		e = pthread_mutex_consistent(&h->lock);
+	if (e != 0){
+		ERRBUF2("qshm: cannot lock region: %s", strerror(e));
+		return(QE_INTINCON);
+	}
+	return(QE_NONE);
+}
+
+/*
+ * check a ticket number and turn it into a slot
+ * as readref() in qlib.c, plus checks that the ring lies inside
+ * the region, as another process may have scribbled on it
+ *
+ * PARAMETERS:	QSHM *r		region the ticket is for
+ *		QTICKET qno	queue ticket from the user
+ * RETURNED:	int		index of the slot
+ * ERRORS:	QE_BADPARAM	r is NULL
+ *		QE_BADTICKET	queue ticket is invalid because:
+ *				* index out of range [0 .. maxq)
+ *				* nonce is of old (or no) queue
+ * 		QE_INTINCON	slot is internally inconsistent because:
+ *				* ring lies outside the region
+ *				* depth is negative or over capacity
+ *				(qe_errbuf has disambiguating string)
+ * EXCEPTIONS:	none
+ */
+static int shmref(QSHM *r, QTICKET qno)
+{
+	register unsigned index;	/* index of current queue */
+	register struct shmq *s;	/* its slot */
+	unsigned long long hd, tl, hd2;	/* head, tail, then head again */
+
+	if (r == NULL){
+		ERRBUF("qshm: NULL region");
+		return(QE_BADPARAM);
+	}
+
+	/* get the index number and check it for validity */
+	index = ((qno >> 16) & 0xffff) - IOFFSET;
+	if (index >= (unsigned) r->hdr->maxq){
+		ERRBUF3("shmref: index %u exceeds %d", index, r->hdr->maxq);
+		return(QE_BADTICKET);
+	}
+	s = &r->hdr->qtab[index];
+	if (s->ticket != qno){
+		ERRBUF2("shmref: ticket refers to old or unused queue %u",
+									index);
+		return(QE_BADTICKET);
+	}
+
+	/* check for internal consistencies */
+	if (s->size <= 0 || s->size > s->ringcap ||
+	    s->ring < sizeof(struct shmhdr) ||
+	    s->ring + (size_t) s->ringcap * sizeof(int) > r->len){
+		ERRBUF3("shmref: internal inconsistency: ring=%lu,size=%d",
+					(unsigned long) s->ring, s->size);
+		return(QE_INTINCON);
+	}
+
+	/*
+	 * other processes move head and tail while we look, so head is
+	 * read on both sides of tail, each read (being an acquire) done
+	 * in its turn; head never passing tail, nor tail getting more
+	 * than size ahead of head, a sound queue then has
+	 * hd <= tl <= hd2 + size
+	 */
+	hd = atomic_load_explicit(&s->head, memory_order_acquire);
+	tl = atomic_load_explicit(&s->tail, memory_order_acquire);
+	hd2 = atomic_load_explicit(&s->head, memory_order_acquire);
+	if (hd > tl || (tl > hd2 && tl - hd2 > (unsigned long long) s->size)){
+		ERRBUF3("shmref: internal inconsistency: head=%llu,tail=%llu",
+								hd, tl);
+		return(QE_INTINCON);
+	}
+
+	/* all's well -- return index */
+	return(index);
+}
+
+/*
+ * create or attach to a shared memory region
+ * the first process to open a name creates the region with room
+ * for maxq queues holding nelts elements between them; later ones
+ * just attach, and their maxq and nelts are ignored
+ *
+ * PARAMETERS:	char *name	region name, "/something" (see shm_open(3))
+ *		int maxq	number of queues (when creating)
+ *		int nelts	total elements of all rings (when creating)
+ *		QSHM **rp	where to put the handle
+ * RETURNED:	int		error code
+ * ERRORS:	QE_BADPARAM	name or rp is NULL
+ *		QE_INVALIDSIZE	maxq or nelts is not positive, or maxq
+ *				exceeds the ticket index range
+ *		QE_NOROOM	region can't be created or mapped (sys err)
+ *		QE_INTINCON	existing region is not a queue region
+ *				(qe_errbuf has descriptive string)
+ * EXCEPTIONS:	none
+ */
+int qshm_open(const char *name, int maxq, int nelts, QSHM **rp)
+{
+	register struct shmhdr *h;	/* region header */
+	pthread_mutexattr_t ma;		/* attributes of its lock */
+	struct stat st;			/* to learn an old region's size */
+	size_t len;			/* size of region */
+	int fd;				/* region's descriptor */
+	int creat = 1;			/* 1 if we made the region */
+	int tries;			/* waiting for the creator */
+
+	if (name == NULL || rp == NULL){
+		ERRBUF("qshm_open: NULL parameter");
+		return(QE_BADPARAM);
+	}
+
+	/* try creating it; if somebody beat us to it, attach */
+	if ((fd = shm_open(name, O_RDWR|O_CREAT|O_EXCL, 0600)) < 0){
+		if (errno != EEXIST ||
+		    (fd = shm_open(name, O_RDWR, 0600)) < 0){
+			ERRBUF2("qshm_open: shm_open: %s", strerror(errno));
+			return(QE_NOROOM);
+		}
+		creat = 0;
+	}
+
+	if (creat){
+		if (maxq <= 0 || nelts <= 0 || maxq > 0x7fff - IOFFSET){
+			ERRBUF3("qshm_open: invalid size (%d queues, %d elts)",
+								maxq, nelts);
+			(void) close(fd);
+			(void) shm_unlink(name);
+			return(QE_INVALIDSIZE);
+		}
+		len = sizeof(struct shmhdr) + maxq * sizeof(struct shmq) +
+			(size_t) nelts * sizeof(int) + maxq * SHMALIGN;
+		if (ftruncate(fd, len) < 0){
+			ERRBUF2("qshm_open: ftruncate: %s", strerror(errno));
+			(void) close(fd);
+			(void) shm_unlink(name);
+			return(QE_NOROOM);
+		}
+	}
+	else{
+		/* the creator may not have sized it yet */
+		for(tries = 0; fstat(fd, &st) == 0 && st.st_size == 0; tries++){
+			if (tries == 1000){
+				ERRBUF("qshm_open: region never initialized");
+				(void) close(fd);
+				return(QE_INTINCON);
+			}
+			(void) usleep(1000);
+		}
+		len = st.st_size;
+		if (len < sizeof(struct shmhdr)){
+			ERRBUF("qshm_open: region too small to be a queue region");
+			(void) close(fd);
+			return(QE_INTINCON);
+		}
+	}
+
+	h = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	(void) close(fd);
+	if (h == MAP_FAILED){
+		ERRBUF2("qshm_open: mmap: %s", strerror(errno));
+		if (creat)
+			(void) shm_unlink(name);
+		return(QE_NOROOM);
+	}
+
+	if (creat){
+		/* fresh pages are zero, so every slot is free already */
+		h->maxq = maxq;
+		h->len = len;
+		h->brk = sizeof(struct shmhdr) + maxq * sizeof(struct shmq);
+		h->noncectr = 1;
+		(void) pthread_mutexattr_init(&ma);
+		(void) pthread_mutexattr_setpshared(&ma, PTHREAD_PROCESS_SHARED);
+		(void) pthread_mutexattr_setrobust(&ma, PTHREAD_MUTEX_ROBUST);
+		(void) pthread_mutex_init(&h->lock, &ma);
+		(void) pthread_mutexattr_destroy(&ma);
+		atomic_store_explicit(&h->magic, SHMMAGIC, memory_order_release);
+	}
+	else{
+		for(tries = 0; atomic_load_explicit(&h->magic,
+				memory_order_acquire) != SHMMAGIC; tries++){
+			if (tries == 1000){
+				ERRBUF("qshm_open: not a queue region");
+				(void) munmap(h, len);
+				return(QE_INTINCON);
+			}
+			(void) usleep(1000);
+		}
+		if (h->len != len || h->maxq <= 0 ||
+		    sizeof(struct shmhdr) + h->maxq * sizeof(struct shmq) > len){
+			ERRBUF("qshm_open: region header is inconsistent");
+			(void) munmap(h, len);
+			return(QE_INTINCON);
+		}
+	}
+
+	if ((*rp = malloc(sizeof(QSHM))) == NULL){
+		ERRBUF("qshm_open: malloc: no more memory");
+		(void) munmap(h, len);
+		return(QE_NOROOM);
+	}
+	(*rp)->hdr = h;
+	(*rp)->len = len;
+	return(QE_NONE);
+}
+
+/*
+ * detach from a region; its queues live on for other processes
+ *
+ * PARAMETERS:	QSHM *r		region to detach from
+ * RETURNED:	int		error code
+ * ERRORS:	QE_BADPARAM	r is NULL
+ * EXCEPTIONS:	none
+ */
+int qshm_close(QSHM *r)
+{
+	if (r == NULL){
+		ERRBUF("qshm_close: NULL region");
+		return(QE_BADPARAM);
+	}
+	(void) munmap(r->hdr, r->len);
+	(void) free(r);
+	return(QE_NONE);
+}
+
+/*
+ * remove a region's name; it goes away when the last process
+ * detaches
+ *
+ * PARAMETERS:	char *name	region name
+ * RETURNED:	int		error code
+ * ERRORS:	QE_BADPARAM	name is NULL or no such region
+ * EXCEPTIONS:	none
+ */
+int qshm_unlink(const char *name)
+{
+	if (name == NULL || shm_unlink(name) < 0){
+		ERRBUF2("qshm_unlink: %s", name ? strerror(errno) : "NULL name");
+		return(QE_BADPARAM);
+	}
+	return(QE_NONE);
+}
+
+/*
+ * create a new queue in a region
+ *
+ * PARAMETERS:	QSHM *r		region to create it in
+ *		int size	maximum size of the queue
+ * RETURNED:	QTICKET		token (if > 0); error number (if < 0)
+ * ERRORS:	QE_BADPARAM	r is NULL
+ *		QE_INVALIDSIZE	invalid size
+ *		QE_TOOMANYQS	all slots of the region in use
+ *		QE_NOROOM	arena has no room for the ring
+ *		QE_INTINCON	ticket can't be made, or lock trouble
+ *				(qe_errbuf has descriptive string)
+ * EXCEPTIONS:	none
+ */
+QTICKET qshm_create_queue(QSHM *r, int size)
+{
+	register struct shmhdr *h;	/* region header */
+	register struct shmq *s;	/* slot being looked at */
+	register int cur;		/* its index */
+	register int fit = -1;		/* free slot whose ring fits */
+	register int bare = -1;		/* free slot with no ring */
+	register int rv;		/* error code */
+	unsigned int low;		/* nonce part of ticket */
+	size_t need;			/* bytes for a new ring */
+
+	if (r == NULL){
+		ERRBUF("qshm_create_queue: NULL region");
+		return(QE_BADPARAM);
+	}
+	if (size <= 0){
+		ERRBUF2("qshm_create_queue: invalid size (%d)", size);
+		return(QE_INVALIDSIZE);
+	}
+	h = r->hdr;
+	if (QE_ISERROR(rv = shmlock(h)))
+		return(rv);
+
+	/* find a slot, preferring one whose old ring can be reused */
+	for(cur = 0; cur < h->maxq && fit < 0; cur++){
+		if ((s = &h->qtab[cur])->ticket != 0)
+			continue;
+		if (s->ring != 0 && s->ringcap >= size)
+			fit = cur;
+		else if (s->ring == 0 && bare < 0)
+			bare = cur;
+	}
+	if (fit >= 0)
+		s = &h->qtab[cur = fit];
+	else if (bare >= 0){
+		/* carve a new ring out of the arena */
+		s = &h->qtab[cur = bare];
+		need = ((size_t) size * sizeof(int) + SHMALIGN - 1) & ~(size_t)(SHMALIGN - 1);
+		h->brk = (h->brk + SHMALIGN - 1) & ~(size_t)(SHMALIGN - 1);
+		if (h->brk + need > h->len){
+			(void) pthread_mutex_unlock(&h->lock);
+			ERRBUF2("qshm_create_queue: no room in region for %d elts",
+									size);
+			return(QE_NOROOM);
+		}
+		s->ring = h->brk;
+		s->ringcap = need / sizeof(int);
+		h->brk += need;
+	}
+	else{
+		(void) pthread_mutex_unlock(&h->lock);
+		ERRBUF2("qshm_create_queue: too many queues (max %d)", h->maxq);
+		return(QE_TOOMANYQS);
+	}
+
+	/*
+	 * generate the ticket; the region outlives any one program,
+	 * so rather than running out, the nonce wraps (skipping 0)
+	 */
+	low = h->noncectr + NOFFSET;
+	if (++h->noncectr + NOFFSET > 0xffff)
+		h->noncectr = 1;
+
+	/* now initialize queue entry; the ticket makes it live */
+	s->size = size;
+	atomic_store_explicit(&s->tail, 0, memory_order_relaxed);
+	atomic_store_explicit(&s->head, 0, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	s->ticket = ((cur + IOFFSET) << 16) | low;
+	rv = s->ticket;
+
+	(void) pthread_mutex_unlock(&h->lock);
+	return(rv);
+}
+
+/*
+ * delete a queue in a region; its ring stays with the slot
+ *
+ * PARAMETERS:	QSHM *r		region the queue is in
+ *		QTICKET qno	ticket for the queue to be deleted
+ * RETURNED:	int		error code
+ * ERRORS:	QE_BADPARAM	r is NULL (from shmref())
+ *		QE_BADTICKET	qno refers to deleted or invalid queue
+ *				(from shmref())
+ * 		QE_INTINCON	queue is internally inconsistent (from
+ *				shmref()), or lock trouble
+ * EXCEPTIONS:	none
+ */
+int qshm_delete_queue(QSHM *r, QTICKET qno)
+{
+	register int cur;	/* index of current queue */
+	register int rv;	/* error code */
+
+	if (r == NULL){
+		ERRBUF("qshm_delete_queue: NULL region");
+		return(QE_BADPARAM);
+	}
+	if (QE_ISERROR(rv = shmlock(r->hdr)))
+		return(rv);
+	if (!QE_ISERROR(cur = shmref(r, qno)))
+		r->hdr->qtab[cur].ticket = 0;
+	(void) pthread_mutex_unlock(&r->hdr->lock);
+
+	return(QE_ISERROR(cur) ? cur : QE_NONE);
+}
+
+/*
+ * add an element to a queue in a region
+ * at most one process (thread) may put on a given queue at a time
+ *
+ * PARAMETERS:	QSHM *r		region the queue is in
+ *		QTICKET qno	ticket for the queue involved
+ *		int n		element to be appended
+ * RETURNED:	int		error code
+ * ERRORS:	QE_BADPARAM	r is NULL (from shmref())
+ *		QE_BADTICKET	qno refers to deleted or invalid queue
+ *				(from shmref())
+ * 		QE_INTINCON	queue is internally inconsistent (from
+ *				shmref())
+ *		QE_TOOFULL	queue is full
+ * EXCEPTIONS:	none
+ */
+int qshm_put(QSHM *r, QTICKET qno, int n)
+{
+	register int cur;		/* index of current queue */
+	register struct shmq *s;	/* its slot */
+	unsigned long long t;		/* its tail */
+
+	if (QE_ISERROR(cur = shmref(r, qno)))
+		return(cur);
+
+	s = &r->hdr->qtab[cur];
+	t = atomic_load_explicit(&s->tail, memory_order_relaxed);
+	if (t - atomic_load_explicit(&s->head, memory_order_acquire) >=
+					(unsigned long long) s->size){
+		ERRBUF2("qshm_put: queue full (max %d elts)", s->size);
+		return(QE_TOOFULL);
+	}
+	RING(r->hdr, s)[t % s->size] = n;
+	atomic_store_explicit(&s->tail, t + 1, memory_order_release);
+
+	return(QE_NONE);
+}
+
+/*
+ * take an element off the front of a queue in a region
+ * at most one process (thread) may take from a given queue at a time
+ *
+ * PARAMETERS:	QSHM *r		region the queue is in
+ *		QTICKET qno	ticket for the queue involved
+ * RETURNED:	int		the element, or error code
+ * ERRORS:	QE_BADPARAM	r is NULL (from shmref())
+ *		QE_BADTICKET	qno refers to deleted or invalid queue
+ *				(from shmref())
+ * 		QE_INTINCON	queue is internally inconsistent (from
+ *				shmref())
+ *		QE_EMPTY	queue has no elements
+ * EXCEPTIONS:	none
+ */
+int qshm_take(QSHM *r, QTICKET qno)
+{
+	register int cur;		/* index of current queue */
+	register struct shmq *s;	/* its slot */
+	unsigned long long hd;		/* its head */
+	register int n;			/* element taken off */
+
+	if (QE_ISERROR(cur = shmref(r, qno)))
+		return(cur);
+
+	s = &r->hdr->qtab[cur];
+	hd = atomic_load_explicit(&s->head, memory_order_relaxed);
+	if (hd == atomic_load_explicit(&s->tail, memory_order_acquire)){
+		ERRBUF("qshm_take: queue empty");
+		return(QE_EMPTY);
+	}
+	n = RING(r->hdr, s)[hd % s->size];
+	atomic_store_explicit(&s->head, hd + 1, memory_order_release);
+
+	return(n);
+}
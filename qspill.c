@@ -0,0 +1,302 @@
+/*
+ * qspill.c
+ *
+ * Overflow of a full queue to a local file (see queue_set_spill()
+ * in qlib.c). Elements put on a queue whose ring is full go here
+ * instead; as the ring drains, it is refilled from here, oldest
+ * first, so the queue as a whole stays FIFO.
+ *
+ * Internal Representation:
+ * Spilled elements, oldest first, are found in three places:
+ *	* rbuf[rpos..rlen): a block read back from the file
+ *	* the file from offset roff up to woff
+ *	* wbuf[wpos..wlen): elements not yet written to the file
+ * Puts append to wbuf, which is written to the end of the file a
+ * block at a time; refills come from rbuf, which is read from the
+ * file a block at a time, or straight from wbuf once the file has
+ * been read up. So it costs one write and one read system call per
+ * block of elements. When nothing is left in the file, it is cut
+ * back to nothing.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "qlib.h"
+#include "qpriv.h"
+
+#define SPBLOCK	4096		/* default elements per block */
+
+/*
+ * an overflow file
+ */
+struct qspill {
+	char *path;			/* name of the file */
+	int fd;				/* open on it */
+	int block;			/* elements per block */
+	int *wbuf;			/* elements waiting to be written */
+	int wpos, wlen;			/* unconsumed part of wbuf */
+	int *rbuf;			/* elements read back */
+	int rpos, rlen;			/* unconsumed part of rbuf */
+	off_t roff, woff;		/* unread part of the file */
+	long n;				/* elements spilled in all */
+};
+
+/*
+ * start spilling to a file
+ *
+ * PARAMETERS:	char *path	file to use (created or emptied)
+ *		int block	elements per block (0 for the default)
+ *		struct qspill **sp	where to put the handle
+ * RETURNED:	int		error code
+ * ERRORS:	QE_BADPARAM	file can't be created
+ *		QE_INVALIDSIZE	block is negative
+ *		QE_NOROOM	no memory
+ *				(qe_errbuf has descriptive string)
+ * EXCEPTIONS:	none
+ */
+int qspill_open(const char *path, int block, struct qspill **sp)
+{
+	register struct qspill *s;	/* new spill */
+
+	if (block < 0){
+		ERRBUF2("qspill_open: invalid block size (%d)", block);
+		return(QE_INVALIDSIZE);
+	}
+	if (block == 0)
+		block = SPBLOCK;
+	if ((s = calloc(1, sizeof(struct qspill))) == NULL ||
+	    (s->path = strdup(path)) == NULL ||
+	    (s->wbuf = malloc(block * sizeof(int))) == NULL ||
+	    (s->rbuf = malloc(block * sizeof(int))) == NULL){
+		ERRBUF("qspill_open: malloc: no more memory");
+		if (s != NULL){
+			(void) free(s->wbuf);
+			(void) free(s->path);
+		}
+		(void) free(s);
+		return(QE_NOROOM);
+	}
+	if ((s->fd = open(path, O_RDWR|O_CREAT|O_TRUNC, 0600)) < 0){
+		ERRBUF2("qspill_open: open: %s", strerror(errno));
+		(void) free(s->rbuf);
+		(void) free(s->wbuf);
+		(void) free(s->path);
+		(void) free(s);
+		return(QE_BADPARAM);
+	}
+	s->block = block;
+	*sp = s;
+	return(QE_NONE);
+}
+
+/*
+ * write out the elements waiting in wbuf
+ *
+ * PARAMETERS:	struct qspill *s	the spill
+ * RETURNED:	int		error code
+ * ERRORS:	QE_NOROOM	write failed (sys err)
+ * EXCEPTIONS:	none
+ */
+static int spflush(struct qspill *s)
+{
+	register ssize_t k;	/* bytes written by one call */
+	register char *p;	/* next byte to write */
+	register size_t len;	/* bytes left to write */
+
+	p = (char *) &s->wbuf[s->wpos];
+	len = (s->wlen - s->wpos) * sizeof(int);
+	while(len > 0){
+		if ((k = pwrite(s->fd, p, len, s->woff)) < 0){
+			if (errno == EINTR)
+				continue;
+			ERRBUF2("qspill: write: %s", strerror(errno));
+			return(QE_NOROOM);
+		}
+		p += k;
+		len -= k;
+		s->woff += k;
+	}
+	s->wpos = s->wlen = 0;
+	return(QE_NONE);
+}
+
+/*
+ * spill an element
+ *
+ * PARAMETERS:	struct qspill *s	the spill
+ *		int n		element to append
+ * RETURNED:	int		error code
+ * ERRORS:	QE_NOROOM	block can't be written (sys err); the
+ *				element is not spilled
+ * EXCEPTIONS:	none
+ */
+int qspill_put(struct qspill *s, int n)
+{
+	register int rv;	/* error code */
+
+	if (s->wlen == s->block && QE_ISERROR(rv = spflush(s)))
+		return(rv);
+	s->wbuf[s->wlen++] = n;
+	s->n++;
+	return(QE_NONE);
+}
+
+/*
+ * move spilled elements, oldest first, to the end of a queue's
+ * ring until the ring is full or nothing is left
+ *
+ * PARAMETERS:	struct qspill *s	the spill
+ *		int *que	the ring
+ *		int size	its capacity
+ *		int head	index of its first element
+ *		int *count	number of elements in it (updated)
+ * RETURNED:	int		number of elements moved, or error code
+ * ERRORS:	QE_NOROOM	file can't be read (sys err); what was
+ *				moved before that stays moved
+ * EXCEPTIONS:	none
+ */
+int qspill_refill(struct qspill *s, int *que, int size, int head, int *count)
+{
+	register int k;		/* elements in hand */
+	register int tail;	/* where they go in the ring */
+	register int moved = 0;	/* elements moved */
+	register int *src;	/* where they come from */
+	register ssize_t got;	/* bytes read */
+
+	while(*count < size && s->n > 0){
+		/* find the oldest elements in hand */
+		if (s->rpos == s->rlen && s->roff < s->woff){
+			got = pread(s->fd, s->rbuf, s->block * sizeof(int), s->roff);
+			if (got < 0 && errno == EINTR)
+				continue;
+			if (got <= 0){
+				ERRBUF2("qspill: read: %s",
+					got < 0 ? strerror(errno) : "file is short");
+				return(QE_NOROOM);
+			}
+			s->rpos = 0;
+			s->rlen = got / sizeof(int);
+			s->roff += s->rlen * sizeof(int);
+			if (s->roff == s->woff){
+				/* all read back; start the file over */
+				(void) ftruncate(s->fd, 0);
+				s->roff = s->woff = 0;
+			}
+		}
+		if (s->rpos < s->rlen){
+			src = &s->rbuf[s->rpos];
+			k = s->rlen - s->rpos;
+		}
+		else{
+			src = &s->wbuf[s->wpos];
+			k = s->wlen - s->wpos;
+		}
+
+		/* as many as fit, in at most two copies */
+		if (k > size - *count)
+			k = size - *count;
+		tail = (head + *count) % size;
+		if (tail + k > size){
+			(void) memcpy(&que[tail], src, (size - tail) * sizeof(int));
+			(void) memcpy(que, src + size - tail,
+					(k - (size - tail)) * sizeof(int));
+		}
+		else
+			(void) memcpy(&que[tail], src, k * sizeof(int));
+		if (src == &s->rbuf[s->rpos])
+			s->rpos += k;
+		else if ((s->wpos += k) == s->wlen)
+			s->wpos = s->wlen = 0;
+		*count += k;
+		s->n -= k;
+		moved += k;
+	}
+	return(moved);
+}
+
+/*
+ * the newest spilled element, for taking or peeking at the back of
+ * the queue: the last in wbuf or, with wbuf used up, in the file
+ * (whose last block is read back into wbuf) or rbuf
+ *
+ * PARAMETERS:	struct qspill *s	the spill
+ *		int pop		1 to remove it, 0 just to look
+ *		int *n		where to put it
+ * RETURNED:	int		error code
+ * ERRORS:	QE_EMPTY	nothing is spilled
+ *		QE_NOROOM	file can't be read (sys err)
+ * EXCEPTIONS:	none
+ */
+int qspill_back(struct qspill *s, int pop, int *n)
+{
+	register int *p;	/* where it is */
+	register ssize_t got;	/* bytes read */
+	register size_t len;	/* bytes wanted */
+
+	if (s->n == 0){
+		ERRBUF("qspill: nothing spilled");
+		return(QE_EMPTY);
+	}
+	if (s->wpos == s->wlen && s->roff < s->woff){
+		/* take the file's last block back into wbuf */
+		len = s->woff - s->roff;
+		if (len > s->block * sizeof(int))
+			len = s->block * sizeof(int);
+		while((got = pread(s->fd, s->wbuf, len, s->woff - len)) < 0 &&
+								errno == EINTR)
+			;
+		if (got != (ssize_t) len){
+			ERRBUF2("qspill: read: %s",
+				got < 0 ? strerror(errno) : "file is short");
+			return(QE_NOROOM);
+		}
+		s->wpos = 0;
+		s->wlen = len / sizeof(int);
+		if ((s->woff -= len) == s->roff){
+			(void) ftruncate(s->fd, 0);
+			s->roff = s->woff = 0;
+		}
+	}
+	if (s->wpos < s->wlen){
+		p = &s->wbuf[s->wlen - 1];
+		if (pop && --s->wlen == s->wpos)
+			s->wpos = s->wlen = 0;
+	}
+	else{
+		p = &s->rbuf[s->rlen - 1];
+		if (pop)
+			s->rlen--;
+	}
+	*n = *p;
+	if (pop)
+		s->n--;
+	return(QE_NONE);
+}
+
+/*
+ * number of elements spilled and not yet taken back
+ */
+long qspill_count(struct qspill *s)
+{
+	return(s->n);
+}
+
+/*
+ * stop spilling; the file and anything still in it are removed
+ *
+ * PARAMETERS:	struct qspill *s	the spill
+ * RETURNED:	nothing
+ * EXCEPTIONS:	none
+ */
+void qspill_close(struct qspill *s)
+{
+	(void) close(s->fd);
+	(void) unlink(s->path);
+	(void) free(s->rbuf);
+	(void) free(s->wbuf);
+	(void) free(s->path);
+	(void) free(s);
+}
@@ -0,0 +1,42 @@
+/*
+ * This file contains the static tracepoints of the qlib library;
+ * it is internal to qlib.c and not meant for external programs.
+ *
+ * With QTRACE defined (qlib.c defines it unless compiled with
+ * -DQNOTRACE) and <sys/sdt.h> (systemtap-sdt-dev) around,
+ * every QPROBEn() becomes a USDT probe in provider "qlib": a
+ * single nop in the code plus a note in the ELF file telling
+ * perf, bpftrace, etc. where to patch in a breakpoint. So they
+ * cost nothing until something attaches, and can stay in release
+ * builds. Otherwise they compile to nothing at all.
+ *
+ * Probes (all arguments are integers unless noted):
+ *	create(ticket, size)		queue created
+ *	delete(ticket, count)		queue deleted, count elts lost
+ *	put(ticket, count, slot)	element put in que[slot];
+ *					count is the new depth; slot
+ *					is -1 if it went to the spill
+ *					file (see queue_set_spill())
+ *	take(ticket, count, slot)	element taken from que[slot];
+ *					count is the new depth; slot
+ *					is -1 if it came from the
+ *					spill file
+ *	error(ticket, code, where)	call failed with qlib error
+ *					code; where is the function
+ *					name (a C string); ticket is 0
+ *					when there is none yet
+ *
+ * See trace/ for bpftrace scripts using these.
+ */
+#if defined(QTRACE) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define QPROBE2(name,a,b)	DTRACE_PROBE2(qlib, name, a, b)
+#define QPROBE3(name,a,b,c)	DTRACE_PROBE3(qlib, name, a, b, c)
+#endif
+#endif
+
+#ifndef QPROBE2
+#define QPROBE2(name,a,b)
+#define QPROBE3(name,a,b,c)
+#endif
@@ -0,0 +1,315 @@
+/*
+ * qtwheel.c
+ *
+ * A hierarchical timing wheel, behind the delay queues of
+ * create_delay_queue() in qlib.c: elements go in with the time
+ * they become ready, and come out once that time has passed, in
+ * order of readiness (elements ready in the same tick, in the order
+ * they went in). Putting an element, and moving it along until it
+ * is ready, take constant time however many are waiting.
+ *
+ * Internal Representation:
+ * Time is counted in ticks from when the wheel was made; cur is
+ * the first tick not yet looked at. There are WLEVELS wheels of
+ * WSLOTS slots, each slot a list of elements: level 0 has a slot
+ * per tick, level 1 a slot per WSLOTS ticks, and so on, so together
+ * they span WSLOTS^WLEVELS ticks (2^32: 49 days of 1ms ticks).
+ * An element due at tick e goes in level 0 at slot e % WSLOTS if
+ * that is under WSLOTS ticks off, else in the level where it is
+ * under WSLOTS slots off. Each time cur enters a new turn of level
+ * 0, the level 1 slot for that turn is emptied and its elements put
+ * in again, now in level 0 (and so on up, when level 1 starts a
+ * new turn too). Elements put in again go ahead of those already
+ * in the slots they land in, in the order they were in: an element
+ * for a given tick is put in a lower level the nearer that tick is,
+ * so those coming down were put before any already there for the
+ * same tick. When cur reaches a level 0 slot, its elements are
+ * ready, and move to the end of the ready list, which is what take
+ * takes from. Elements due beyond the span wait in the last slot of
+ * the top level and are put in again when it comes round.
+ *
+ * The lists are linked through arrays of next indices, elements
+ * and due ticks, one entry per element the queue can hold, with a
+ * free list through the unused entries; so nothing is allocated
+ * after the wheel is made. A bit per level 0 slot says whether it
+ * has anything in it, so ticks with nothing due are skipped over
+ * a turn at a time rather than one by one.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "qlib.h"
+#include "qpriv.h"
+
+#define WBITS	8			/* log2 of slots per level */
+#define WSLOTS	(1 << WBITS)		/* slots per level */
+#define WMASK	(WSLOTS - 1)
+#define WLEVELS	4			/* levels */
+#define WSPAN	(1ULL << (WBITS * WLEVELS))	/* ticks spanned */
+#define WNIL	(-1)			/* end of a list */
+
+/*
+ * a list of elements, by index
+ */
+struct wlist {
+	int head, tail;			/* first and last, or WNIL */
+};
+
+/*
+ * a timing wheel
+ */
+struct qtwheel {
+	unsigned long long base;	/* clock at tick 0, ns */
+	unsigned long long tickns;	/* nanoseconds per tick */
+	unsigned long long cur;		/* first tick not looked at */
+	int *next;			/* next in list, per element */
+	int *elt;			/* the element */
+	unsigned long long *due;	/* tick it is ready at */
+	int free;			/* list of unused entries */
+	int npend;			/* elements in the wheel */
+	struct wlist ready;		/* elements ready, in order */
+	struct wlist slot[WLEVELS][WSLOTS];	/* the wheel */
+	unsigned long long bits[WSLOTS / 64];	/* level 0 slots in use */
+};
+
+/*
+ * make a timing wheel
+ *
+ * PARAMETERS:	int size	most elements it holds
+ *		unsigned long long now	the clock now, ns
+ *		unsigned long long tickns	nanoseconds per tick
+ *		struct qtwheel **wp	where to put it
+ * RETURNED:	int		error code
+ * ERRORS:	QE_NOROOM	no memory
+ *				(qe_errbuf has descriptive string)
+ * EXCEPTIONS:	none
+ */
+int qtw_open(int size, unsigned long long now, unsigned long long tickns,
+							struct qtwheel **wp)
+{
+	register struct qtwheel *w;	/* new wheel */
+	register int i, j;		/* counters */
+
+	if ((w = calloc(1, sizeof(struct qtwheel))) == NULL ||
+	    (w->next = malloc(size * sizeof(int))) == NULL ||
+	    (w->elt = malloc(size * sizeof(int))) == NULL ||
+	    (w->due = malloc(size * sizeof(unsigned long long))) == NULL){
+		ERRBUF("qtw_open: malloc: no more memory");
+		if (w != NULL){
+			(void) free(w->elt);
+			(void) free(w->next);
+		}
+		(void) free(w);
+		return(QE_NOROOM);
+	}
+	w->base = now;
+	w->tickns = tickns;
+	for(i = 0; i < size; i++)
+		w->next[i] = i + 1 < size ? i + 1 : WNIL;
+	w->free = 0;
+	w->ready.head = w->ready.tail = WNIL;
+	for(i = 0; i < WLEVELS; i++)
+		for(j = 0; j < WSLOTS; j++)
+			w->slot[i][j].head = w->slot[i][j].tail = WNIL;
+	*wp = w;
+	return(QE_NONE);
+}
+
+/* append entry k to a list */
+static void wappend(struct qtwheel *w, struct wlist *l, int k)
+{
+	w->next[k] = WNIL;
+	if (l->tail == WNIL)
+		l->head = k;
+	else
+		w->next[l->tail] = k;
+	l->tail = k;
+}
+
+/* put entry k at the front of a list */
+static void wprepend(struct qtwheel *w, struct wlist *l, int k)
+{
+	w->next[k] = l->head;
+	if (l->tail == WNIL)
+		l->tail = k;
+	l->head = k;
+}
+
+/*
+ * put entry k in the wheel where its due tick belongs (at the end
+ * of its slot, or at the front if front is set), or on the ready
+ * list if that has come
+ */
+static void wplace(struct qtwheel *w, int k, int front)
+{
+	register unsigned long long e = w->due[k];	/* due tick */
+	register unsigned long long d;			/* ticks off */
+	register int lv;				/* level */
+	register struct wlist *l;			/* its slot */
+
+	if (e < w->cur){
+		wappend(w, &w->ready, k);
+		return;
+	}
+	if ((d = e - w->cur) >= WSPAN)
+		/* beyond the span: the last slot, to be put in again */
+		e = w->cur + WSPAN - 1;
+	for(lv = 0; lv < WLEVELS - 1 && d >= 1ULL << (WBITS * (lv + 1)); lv++)
+		;
+	l = &w->slot[lv][(e >> (WBITS * lv)) & WMASK];
+	if (front)
+		wprepend(w, l, k);
+	else
+		wappend(w, l, k);
+	if (lv == 0)
+		w->bits[(e & WMASK) >> 6] |= 1ULL << (e & 63);
+	w->npend++;
+}
+
+/*
+ * put the elements of a slot in again, lower down, each ahead of
+ * what is in the slot it lands in; they go in last first, so they
+ * keep their order
+ */
+static void wcascade(struct qtwheel *w, struct wlist *l)
+{
+	register int k, nk;	/* current entry, next one */
+	register int r = WNIL;	/* the slot's list, reversed */
+
+	for(k = l->head, l->head = l->tail = WNIL; k != WNIL; k = nk){
+		nk = w->next[k];
+		w->next[k] = r;
+		r = k;
+	}
+	for(k = r; k != WNIL; k = nk){
+		nk = w->next[k];
+		w->npend--;
+		wplace(w, k, 1);
+	}
+}
+
+/* first level 0 slot in use at or after s, or WSLOTS if none */
+static int wnext(struct qtwheel *w, int s)
+{
+	register int i;			/* word of bits */
+	unsigned long long b;		/* bits left in it */
+
+	for(i = s >> 6; i < WSLOTS / 64; i++){
+		b = w->bits[i];
+		if (i == s >> 6)
+			b &= ~0ULL << (s & 63);
+		if (b != 0)
+			return((i << 6) + __builtin_ctzll(b));
+	}
+	return(WSLOTS);
+}
+
+/*
+ * move along to a given tick: everything due by then becomes ready
+ */
+static void wadvance(struct qtwheel *w, unsigned long long to)
+{
+	register int s, lv, k;		/* slot, level, entry */
+	register unsigned long long t;	/* tick of slot s */
+	unsigned long long end;		/* end of this turn of level 0 */
+	struct wlist *l;		/* slot being emptied */
+
+	while(w->cur <= to){
+		if (w->npend == 0){
+			w->cur = to + 1;
+			break;
+		}
+		/* a new turn of level 0: bring down what it holds */
+		if ((w->cur & WMASK) == 0)
+			for(lv = 1; lv < WLEVELS; lv++){
+				s = (w->cur >> (WBITS * lv)) & WMASK;
+				wcascade(w, &w->slot[lv][s]);
+				if (s != 0)
+					break;
+			}
+
+		/* the next slot in use this turn, if it is due */
+		s = wnext(w, (int) (w->cur & WMASK));
+		t = (w->cur & ~(unsigned long long) WMASK) + s;
+		if (s == WSLOTS || t > to){
+			end = (w->cur | WMASK) + 1;
+			w->cur = end < to + 1 ? end : to + 1;
+			continue;
+		}
+		/* it is: its list goes on the end of the ready list */
+		l = &w->slot[0][s];
+		for(k = l->head; k != WNIL; k = w->next[k])
+			w->npend--;
+		if (w->ready.tail == WNIL)
+			w->ready.head = l->head;
+		else
+			w->next[w->ready.tail] = l->head;
+		w->ready.tail = l->tail;
+		l->head = l->tail = WNIL;
+		w->bits[s >> 6] &= ~(1ULL << (s & 63));
+		w->cur = t + 1;
+	}
+}
+
+/*
+ * put an element in the wheel; there must be room for it
+ *
+ * PARAMETERS:	struct qtwheel *w	the wheel
+ *		int n		the element
+ *		unsigned long long when	clock time it is ready at, ns
+ * RETURNED:	nothing
+ * EXCEPTIONS:	none
+ */
+void qtw_put(struct qtwheel *w, int n, unsigned long long when)
+{
+	register int k;		/* entry for it */
+
+	k = w->free;
+	w->free = w->next[k];
+	w->elt[k] = n;
+	/* round up, so nothing is ready early */
+	w->due[k] = when <= w->base ? 0 : (when - w->base + w->tickns - 1) / w->tickns;
+	wplace(w, k, 0);
+}
+
+/*
+ * take (or look at) the first ready element
+ *
+ * PARAMETERS:	struct qtwheel *w	the wheel
+ *		unsigned long long now	the clock now, ns
+ *		int pop		1 to take it, 0 just to look
+ *		int *n		where to put it
+ * RETURNED:	int		error code
+ * ERRORS:	QE_NOTYET	nothing is ready yet
+ * EXCEPTIONS:	none
+ */
+int qtw_take(struct qtwheel *w, unsigned long long now, int pop, int *n)
+{
+	register int k;		/* entry taken */
+
+	if (w->ready.head == WNIL && now >= w->base)
+		wadvance(w, (now - w->base) / w->tickns);
+	if ((k = w->ready.head) == WNIL){
+		ERRBUF("qtw_take: nothing ready yet");
+		return(QE_NOTYET);
+	}
+	*n = w->elt[k];
+	if (pop){
+		if ((w->ready.head = w->next[k]) == WNIL)
+			w->ready.tail = WNIL;
+		w->next[k] = w->free;
+		w->free = k;
+	}
+	return(QE_NONE);
+}
+
+/*
+ * free a timing wheel
+ */
+void qtw_close(struct qtwheel *w)
+{
+	(void) free(w->due);
+	(void) free(w->elt);
+	(void) free(w->next);
+	(void) free(w);
+}
@@ -0,0 +1,451 @@
+/*
+ * qwal.c
+ *
+ * The write-ahead log behind durable queues (create_durable_queue()
+ * in qlib.c). Every element put on a durable queue is appended to
+ * the log before it goes on the queue, and every element taken off
+ * is logged as a truncation point, so replaying the log from the
+ * start rebuilds the queue.
+ *
+ * Internal Representation:
+ * The log is a sequence of 8-byte records (struct wrec): a put
+ * carrying the element, or a truncation carrying how many elements
+ * were taken off the front since the record before; runs of takes
+ * are folded into one truncation record. The other end of the ring
+ * has records of its own: a push carrying an element put on the
+ * front, and a back truncation carrying how many were taken off
+ * the back (runs folded the same way). Records are gathered in
+ * a buffer and the buffer written and fdatasync()ed as one group
+ * commit when it holds batch records, or when the oldest record in
+ * it has waited maxdelay microseconds (checked whenever the log is
+ * appended to), or on request; so the cost of a sync is shared by
+ * a whole batch instead of being paid per element.
+ *
+ * Once the log passes logmax bytes, the next commit is followed by
+ * a checkpoint: the live elements are written to a fresh log, which
+ * is synced and renamed over the old one.
+ *
+ * On replay, a record that is not a put or truncation, or a partial
+ * record at the end, marks where a group commit was cut short by a
+ * crash; the log is truncated there.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include "qlib.h"
+#include "qpriv.h"
+
+/*
+ * various macros
+ */
+#define WPUT	0x50555431	/* record is a put */
+#define WTRUNC	0x54524e31	/* record is a truncation */
+#define WPUSH	0x50534831	/* record is a put on the front */
+#define WBTRUNC	0x42545231	/* record is a truncation of the back */
+#define WREAD	8192		/* records read at a time on replay */
+
+/*
+ * a log record
+ */
+struct wrec {
+	int op;				/* WPUT, WTRUNC, WPUSH, WBTRUNC */
+	int val;			/* element, or number taken off */
+};
+
+/*
+ * an open log
+ */
+struct qwal {
+	char *path;			/* name of the log */
+	int fd;				/* open for appending */
+	struct qwalopts o;		/* thresholds */
+	struct wrec *buf;		/* records not yet committed */
+	int nbuf;			/* number of them */
+	unsigned long long t0;		/* when buf[0] was appended, ns */
+	long len;			/* bytes in the log file */
+};
+
+/* defaults for unset options */
+static const struct qwalopts defopts = { 256, 1000, 16L << 20 };
+
+static unsigned long long walns(void)
+{
+	struct timespec ts;
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+	return((unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+/*
+ * write a buffer of records in full
+ *
+ * PARAMETERS:	int fd		where to write
+ *		void *p		what to write
+ *		size_t n	how many bytes
+ * RETURNED:	int		error code
+ * ERRORS:	QE_NOROOM	write failed (sys err)
+ * EXCEPTIONS:	none
+ */
+static int walwrite(int fd, const void *p, size_t n)
+{
+	register ssize_t k;	/* bytes written by one call */
+
+	while(n > 0){
+		if ((k = write(fd, p, n)) < 0){
+			if (errno == EINTR)
+				continue;
+			ERRBUF2("qwal: write: %s", strerror(errno));
+			return(QE_NOROOM);
+		}
+		p = (const char *) p + k;
+		n -= k;
+	}
+	return(QE_NONE);
+}
+
+/*
+ * sync the directory holding a file, so a rename into it sticks;
+ * failing that is not fatal (the old log is still consistent)
+ */
+static void walsyncdir(const char *path)
+{
+	register const char *p;	/* last slash in path */
+	char dir[4096];		/* the directory */
+	int fd;			/* open on it */
+
+	if ((p = strrchr(path, '/')) == NULL)
+		(void) strcpy(dir, ".");
+	else if (p == path)
+		(void) strcpy(dir, "/");
+	else if (p - path < (int) sizeof(dir)){
+		(void) memcpy(dir, path, p - path);
+		dir[p - path] = '\0';
+	}
+	else
+		return;
+	if ((fd = open(dir, O_RDONLY)) >= 0){
+		(void) fsync(fd);
+		(void) close(fd);
+	}
+}
+
+/*
+ * open a log, replaying what it holds
+ *
+ * PARAMETERS:	char *path	the log file (created if absent)
+ *		struct qwalopts *o	thresholds (NULL or 0 fields
+ *				for the defaults)
+ *		int size	capacity of the queue
+ *		int *que	the queue's ring (size elements)
+ *		int *headp	where to put the index of the first
+ *				element in que
+ *		int *countp	where to put the number of elements
+ *		struct qwal **wp	where to put the handle
+ * RETURNED:	int		error code
+ * ERRORS:	QE_BADPARAM	log can't be opened or read
+ *		QE_INTINCON	log holds more than size elements, or
+ *				takes more elements than it put
+ *		QE_NOROOM	no memory
+ *				(qe_errbuf has descriptive string)
+ * EXCEPTIONS:	none
+ */
+int qwal_open(const char *path, const struct qwalopts *o, int size,
+			int *que, int *headp, int *countp, struct qwal **wp)
+{
+	register struct qwal *w;	/* new log */
+	register int i, k;		/* records in hand, current one */
+	register int head, n;		/* replayed ring: head, count */
+	struct wrec *rb = NULL;		/* records read */
+	ssize_t got;			/* bytes of them */
+	long good = 0;			/* bytes of well-formed records */
+
+	if ((w = calloc(1, sizeof(struct qwal))) == NULL ||
+	    (w->path = strdup(path)) == NULL){
+		ERRBUF("qwal_open: malloc: no more memory");
+		(void) free(w);
+		return(QE_NOROOM);
+	}
+	w->o = defopts;
+	if (o != NULL){
+		if (o->batch > 0)
+			w->o.batch = o->batch;
+		if (o->maxdelay > 0)
+			w->o.maxdelay = o->maxdelay;
+		if (o->logmax > 0)
+			w->o.logmax = o->logmax;
+	}
+	if ((w->buf = malloc(w->o.batch * sizeof(struct wrec))) == NULL ||
+	    (rb = malloc(WREAD * sizeof(struct wrec))) == NULL){
+		ERRBUF("qwal_open: malloc: no more memory");
+		(void) free(w->buf);
+		(void) free(w->path);
+		(void) free(w);
+		return(QE_NOROOM);
+	}
+	if ((w->fd = open(path, O_RDWR|O_CREAT, 0600)) < 0){
+		ERRBUF2("qwal_open: open: %s", strerror(errno));
+		(void) free(rb);
+		(void) free(w->buf);
+		(void) free(w->path);
+		(void) free(w);
+		return(QE_BADPARAM);
+	}
+
+	/*
+	 * replay into the ring: puts go on the end, truncations come
+	 * off the front, and pushes and back truncations the other way
+	 */
+	head = n = 0;
+	for(;;){
+		if ((got = read(w->fd, rb, WREAD * sizeof(struct wrec))) < 0){
+			if (errno == EINTR)
+				continue;
+			ERRBUF2("qwal_open: read: %s", strerror(errno));
+			goto bad;
+		}
+		i = got / sizeof(struct wrec);
+		for(k = 0; k < i; k++){
+			if (rb[k].op == WPUT){
+				if (n == size){
+					ERRBUF2("qwal_open: log holds over %d elts",
+									size);
+					goto incon;
+				}
+				que[(head + n++) % size] = rb[k].val;
+			}
+			else if (rb[k].op == WTRUNC){
+				if (rb[k].val < 0 || rb[k].val > n){
+					ERRBUF3("qwal_open: log takes %d of %d elts",
+							rb[k].val, n);
+					goto incon;
+				}
+				head = (head + rb[k].val) % size;
+				n -= rb[k].val;
+			}
+			else if (rb[k].op == WPUSH){
+				if (n == size){
+					ERRBUF2("qwal_open: log holds over %d elts",
+									size);
+					goto incon;
+				}
+				head = (head + size - 1) % size;
+				que[head] = rb[k].val;
+				n++;
+			}
+			else if (rb[k].op == WBTRUNC){
+				if (rb[k].val < 0 || rb[k].val > n){
+					ERRBUF3("qwal_open: log takes %d of %d elts",
+							rb[k].val, n);
+					goto incon;
+				}
+				n -= rb[k].val;
+			}
+			else
+				break;
+			good += sizeof(struct wrec);
+		}
+		if (k < i || got % sizeof(struct wrec) != 0 ||
+		    got < (ssize_t) (WREAD * sizeof(struct wrec)))
+			break;
+	}
+	(void) free(rb);
+	rb = NULL;
+
+	/* cut off a torn tail, then append from there */
+	if (ftruncate(w->fd, good) < 0 || lseek(w->fd, good, SEEK_SET) < 0){
+		ERRBUF2("qwal_open: ftruncate: %s", strerror(errno));
+		goto bad;
+	}
+	w->len = good;
+
+	*headp = head;
+	*countp = n;
+	*wp = w;
+	return(QE_NONE);
+
+incon:
+	(void) free(rb);
+	qwal_close(w);
+	return(QE_INTINCON);
+bad:
+	(void) free(rb);
+	qwal_close(w);
+	return(QE_BADPARAM);
+}
+
+/*
+ * cut off whatever a failed commit got into the file, and go back
+ * to the end of what was committed, so the records still buffered
+ * are written again whole, in the right place, by the next commit;
+ * qe_errbuf keeps the reason the commit failed
+ */
+static void walrewind(struct qwal *w)
+{
+	(void) ftruncate(w->fd, w->len);
+	(void) lseek(w->fd, w->len, SEEK_SET);
+}
+
+/*
+ * group commit: write out the buffered records and sync them; if
+ * that fails they stay buffered, and the file is as it was
+ *
+ * PARAMETERS:	struct qwal *w	the log
+ * RETURNED:	int		error code
+ * ERRORS:	QE_NOROOM	write or sync failed (sys err)
+ * EXCEPTIONS:	none
+ */
+int qwal_commit(struct qwal *w)
+{
+	register int rv;	/* error code */
+
+	if (w->nbuf == 0)
+		return(QE_NONE);
+	if (QE_ISERROR(rv = walwrite(w->fd, w->buf, w->nbuf * sizeof(struct wrec)))){
+		walrewind(w);
+		return(rv);
+	}
+	if (fdatasync(w->fd) < 0){
+		ERRBUF2("qwal_commit: fdatasync: %s", strerror(errno));
+		walrewind(w);
+		return(QE_NOROOM);
+	}
+	w->len += w->nbuf * sizeof(struct wrec);
+	w->nbuf = 0;
+	return(QE_NONE);
+}
+
+/*
+ * log a put or take, committing the group if it is due; if the
+ * commit fails, the record is taken back out, as the caller will
+ * not do what it records
+ *
+ * PARAMETERS:	struct qwal *w	the log
+ *		int what	QW_PUT or QW_PUSH to log a put of n on
+ *				the back or front, QW_TAKE or QW_POP to
+ *				log a take off the front or back
+ *		int n		element put
+ * RETURNED:	int		1 if the log is due for a checkpoint,
+ *				0 if not, or error code
+ * ERRORS:	QE_NOROOM	commit failed (from qwal_commit())
+ * EXCEPTIONS:	none
+ */
+int qwal_append(struct qwal *w, int what, int n)
+{
+	static const int ops[] = { WPUT, WTRUNC, WPUSH, WBTRUNC };
+	register int op = ops[what];	/* record to append */
+	register int rv;		/* error code */
+	register int fold;		/* 1 if folded into the last record */
+
+	if ((fold = (op == WTRUNC || op == WBTRUNC) &&
+	    w->nbuf > 0 && w->buf[w->nbuf - 1].op == op))
+		/* fold a run of takes into one truncation */
+		w->buf[w->nbuf - 1].val++;
+	else{
+		if (w->nbuf == 0 && w->o.maxdelay > 0)
+			w->t0 = walns();
+		w->buf[w->nbuf].op = op;
+		w->buf[w->nbuf].val = (op == WTRUNC || op == WBTRUNC) ? 1 : n;
+		w->nbuf++;
+	}
+
+	if (w->nbuf == w->o.batch ||
+	    (w->o.maxdelay > 0 && walns() - w->t0 >= w->o.maxdelay * 1000ULL)){
+		if (QE_ISERROR(rv = qwal_commit(w))){
+			if (fold)
+				w->buf[w->nbuf - 1].val--;
+			else
+				w->nbuf--;
+			return(rv);
+		}
+		return(w->len >= w->o.logmax);
+	}
+	return(0);
+}
+
+/*
+ * replace the log by one holding just the live elements
+ *
+ * PARAMETERS:	struct qwal *w	the log
+ *		int *que	the queue's ring
+ *		int size	its capacity
+ *		int head	index of the first element
+ *		int count	number of elements
+ * RETURNED:	int		error code
+ * ERRORS:	QE_NOROOM	new log can't be written (sys err); the
+ *				old one is still good
+ * EXCEPTIONS:	none
+ */
+int qwal_checkpoint(struct qwal *w, const int *que, int size, int head, int count)
+{
+	register int i, k;	/* elements done, in this batch */
+	register int rv;	/* error code */
+	char *tmp;		/* name of the new log */
+	int fd;			/* the new log */
+
+	if (QE_ISERROR(rv = qwal_commit(w)))
+		return(rv);
+	if ((tmp = malloc(strlen(w->path) + 6)) == NULL){
+		ERRBUF("qwal_checkpoint: malloc: no more memory");
+		return(QE_NOROOM);
+	}
+	(void) sprintf(tmp, "%s.ckpt", w->path);
+	if ((fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0600)) < 0){
+		ERRBUF2("qwal_checkpoint: open: %s", strerror(errno));
+		(void) free(tmp);
+		return(QE_NOROOM);
+	}
+
+	/* the buffer is empty after the commit; reuse it for puts */
+	for(i = 0; i < count && !QE_ISERROR(rv); i += k){
+		for(k = 0; k < w->o.batch && i + k < count; k++){
+			w->buf[k].op = WPUT;
+			w->buf[k].val = que[(head + i + k) % size];
+		}
+		rv = walwrite(fd, w->buf, k * sizeof(struct wrec));
+	}
+	if (QE_ISERROR(rv) || fdatasync(fd) < 0 || rename(tmp, w->path) < 0){
+		if (!QE_ISERROR(rv))
+			ERRBUF2("qwal_checkpoint: %s", strerror(errno));
+		(void) close(fd);
+		(void) unlink(tmp);
+		(void) free(tmp);
+		return(QE_NOROOM);
+	}
+	(void) free(tmp);
+	walsyncdir(w->path);
+
+	/* from now on append to the new log */
+	(void) close(w->fd);
+	w->fd = fd;
+	if (lseek(fd, 0, SEEK_END) < 0){
+		ERRBUF2("qwal_checkpoint: lseek: %s", strerror(errno));
+		return(QE_NOROOM);
+	}
+	w->len = (long) count * sizeof(struct wrec);
+	return(QE_NONE);
+}
+
+/*
+ * commit what is buffered and close the log; the file stays, so
+ * the queue can be brought back from it
+ *
+ * PARAMETERS:	struct qwal *w	the log
+ * RETURNED:	int		error code
+ * ERRORS:	QE_NOROOM	final commit failed (from qwal_commit())
+ * EXCEPTIONS:	none
+ */
+int qwal_close(struct qwal *w)
+{
+	register int rv;	/* error code */
+
+	rv = qwal_commit(w);
+	(void) close(w->fd);
+	(void) free(w->buf);
+	(void) free(w->path);
+	(void) free(w);
+	return(rv);
+}